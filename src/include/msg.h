@@ -74,6 +74,29 @@ class BaseMsg {
    *
    */
   virtual void decode() {}
+  /**
+   * @brief The length of the fields of a derived msg type which are not in
+   * the buffer, e.g. its destination. They are copied along with the buffer
+   * when a msg crosses a process.
+   *
+   * @return int
+   */
+  virtual int metaSize() const { return 0; }
+  /**
+   * @brief Serialize the fields of a derived msg type to `metaSize()` bytes.
+   *
+   * @param out
+   */
+  virtual void saveMeta(octet* out) const {}
+  /**
+   * @brief Restore the fields of a derived msg type from `len` bytes.
+   *
+   * @param in
+   * @param len
+   * @return false Return false if `len` bytes can't be the fields of this
+   * type.
+   */
+  virtual bool loadMeta(const octet* in, int len) { return len == 0; }
   /**
    * @brief The length of the stored data in message object.
    *
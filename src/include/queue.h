@@ -11,6 +11,9 @@
 #ifndef SRC_INCLUDE_QUEUE_H_
 #define SRC_INCLUDE_QUEUE_H_
 
+#include <sys/eventfd.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <atomic>
 #include <condition_variable>
@@ -80,6 +83,9 @@ class Queue {
     if (wait_strategy_) {
       BreakAllWait();
     }
+    if (event_fd_ >= 0) {
+      close(event_fd_);
+    }
     pool_.clear();
     std::deque<T>().swap(pool_);
   }
@@ -88,10 +94,11 @@ class Queue {
    *
    * @param element The element to be enqueued to the queue.
    * @return true Return true if enqueue action is done.
-   * @return false Return false if enqueue action was timeout.
+   * @return false Return false if enqueue action was timeout or interrupted.
    */
   bool WaitEnqueue(const T& element) {
-    while (!break_all_wait_) {
+    auto generation = interrupt_gen_.load();
+    while (!break_all_wait_ && generation == interrupt_gen_.load()) {
       if (Enqueue(element)) {
         return true;
       }
@@ -111,7 +118,8 @@ class Queue {
    * @return false Return true if dequeue action is done.
    */
   bool WaitDequeue(T& element) {
-    while (!break_all_wait_) {
+    auto generation = interrupt_gen_.load();
+    while (!break_all_wait_ && generation == interrupt_gen_.load()) {
       if (Dequeue(element)) {
         return true;
       }
@@ -123,6 +131,62 @@ class Queue {
     }
     return false;
   }
+  /**
+   * @brief Keep trying dequeue an element from the queue, `on_dequeue` is
+   * invoked with the element while the queue is still locked, so callers can
+   * stamp an ingress order which matches the dequeue order.
+   *
+   * @param element The element to be dequeued from the queue.
+   * @param on_dequeue Called once with the dequeued element.
+   * @return true Return true if dequeue action is done.
+   * @return false Return false if dequeue action was timeout.
+   */
+  template <typename F>
+  bool WaitDequeue(T& element, F&& on_dequeue) {
+    auto generation = interrupt_gen_.load();
+    while (!break_all_wait_ && generation == interrupt_gen_.load()) {
+      if (Dequeue(element, on_dequeue)) {
+        return true;
+      }
+      if (wait_strategy_->EmptyWait()) {
+        continue;
+      }
+      // wait timeout
+      break;
+    }
+    return false;
+  }
+  /**
+   * @brief Enqueue an element without wait.
+   *
+   * @param element The element to be enqueued to the queue.
+   * @return true Return true if enqueue done.
+   * @return false Return false if the queue is full.
+   */
+  bool TryEnqueue(const T& element) { return Enqueue(element); }
+  /**
+   * @brief Dequeue an element without wait.
+   *
+   * @param element The element dequeued from the queue.
+   * @return true Return true if dequeue done.
+   * @return false Return false if the queue is empty.
+   */
+  bool TryDequeue(T& element) { return Dequeue(element); }
+  /**
+   * @brief Signal an eventfd each time the queue turns non-empty, so that a
+   * poller can wait for the queue along with its sockets. The consumer reads
+   * the eventfd first, then dequeues by `TryDequeue` until the queue is empty.
+   *
+   * @return int The eventfd, or -1 on failure.
+   */
+  int EnableEventFd() {
+    std::lock_guard<std::mutex> lg(mutex_);
+    if (event_fd_ < 0) {
+      event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    return event_fd_;
+  }
+  int EventFd() const { return event_fd_; }
   /**
    * @brief Notify all the threads to break the wait.
    *
@@ -131,6 +195,21 @@ class Queue {
     break_all_wait_ = true;
     wait_strategy_->BreakAllWait();
   }
+  /**
+   * @brief Whether `BreakAllWait` was called, no wait blocks after it.
+   *
+   */
+  bool WaitBroken() const { return break_all_wait_; }
+  /**
+   * @brief Break the current waits only, the queue stays usable. A waiting
+   * consumer returns false without an element, a waiting producer returns
+   * false without enqueuing its element.
+   *
+   */
+  void Interrupt() {
+    interrupt_gen_++;
+    wait_strategy_->BreakAllWait();
+  }
   /**
    * @brief The number of elements in the queue.
    *
@@ -144,6 +223,23 @@ class Queue {
    * @return false Return false if the queue is not empty.
    */
   bool Empty() { return Size() == 0; }
+  /**
+   * @brief The capacity of the queue.
+   *
+   * @return int
+   */
+  int Capacity() const { return pool_size_; }
+  /**
+   * @brief The number of elements which ever went in and out of the queue.
+   *
+   * @return uint64_t
+   */
+  uint64_t Enqueued() const {
+    return enqueued_.load(std::memory_order_relaxed);
+  }
+  uint64_t Dequeued() const {
+    return dequeued_.load(std::memory_order_relaxed);
+  }
   /**
    * @brief Get the ID of the queue.
    *
@@ -176,8 +272,16 @@ class Queue {
     if (pool_.size() >= pool_size_) {
       return false;
     }
+    bool signal = event_fd_ >= 0 && pool_.empty();
     pool_.push_back(element);
+    enqueued_.fetch_add(1, std::memory_order_relaxed);
     wait_strategy_->NotifyOne();
+    lg.unlock();
+    if (signal) {
+      uint64_t one = 1;
+      auto ret = write(event_fd_, &one, sizeof(one));
+      (void)ret;
+    }
     return true;
   }
 
@@ -188,6 +292,21 @@ class Queue {
     }
     element = pool_.front();
     pool_.pop_front();
+    dequeued_.fetch_add(1, std::memory_order_relaxed);
+    wait_strategy_->NotifyOne();
+    return true;
+  }
+
+  template <typename F>
+  bool Dequeue(T& element, F& on_dequeue) {
+    std::unique_lock<std::mutex> lg(mutex_);
+    if (pool_.empty()) {
+      return false;
+    }
+    element = pool_.front();
+    pool_.pop_front();
+    dequeued_.fetch_add(1, std::memory_order_relaxed);
+    on_dequeue(element);
     wait_strategy_->NotifyOne();
     return true;
   }
@@ -196,10 +315,15 @@ class Queue {
   std::mutex mutex_;
   std::deque<T> pool_;
   int pool_size_ = 0;
+  std::atomic<uint64_t> enqueued_ = {0};
+  std::atomic<uint64_t> dequeued_ = {0};
   std::string name_;
   std::string uuid_;
   std::unique_ptr<WaitStrategy> wait_strategy_ = nullptr;
   volatile bool break_all_wait_ = false;
+  // bumped by `Interrupt`, the waits started before it return.
+  std::atomic<uint64_t> interrupt_gen_ = {0};
+  int event_fd_ = -1;
 };
 
 #endif  // SRC_INCLUDE_QUEUE_H_
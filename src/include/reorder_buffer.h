@@ -0,0 +1,125 @@
+/**
+ * @file reorder_buffer.h
+ * @author peng lei (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-11-20
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef SRC_INCLUDE_REORDER_BUFFER_H_
+#define SRC_INCLUDE_REORDER_BUFFER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <utility>
+
+#include "macros.h"
+
+/**
+ * @brief A lock-free reorder buffer. Workers commit results tagged with the
+ * sequence number their input got on ingress, the results are emitted strictly
+ * in sequence order by whichever committer is able to advance the head.
+ *
+ * At most `window` sequences can be in flight, a committer which is too far
+ * ahead of the head waits until the window slides.
+ *
+ * @tparam T The result type, it must be default constructible and movable.
+ */
+template <typename T>
+class ReorderBuffer {
+ public:
+  using Emitter = std::function<void(T&)>;
+  /**
+   * @brief Construct a reorder buffer.
+   *
+   * @param window The number of in flight sequences, rounded up to a power of
+   * two.
+   * @param emit Called for each result in sequence order. Calls never overlap.
+   */
+  ReorderBuffer(int window, Emitter emit) : emit_(std::move(emit)) {
+    size_ = 1;
+    while (size_ < static_cast<uint64_t>(window)) {
+      size_ <<= 1;
+    }
+    mask_ = size_ - 1;
+    slots_.reset(new Slot[size_]);
+  }
+  ~ReorderBuffer() = default;
+  /**
+   * @brief Publish the result of sequence `seq`, and emit every result which
+   * is in order now.
+   *
+   * @param seq The ingress sequence of the result.
+   * @param item The result.
+   */
+  void Commit(uint64_t seq, T&& item) {
+    while (seq >= next_.load(std::memory_order_acquire) + size_) {
+      std::this_thread::yield();
+    }
+    auto& slot = slots_[seq & mask_];
+    slot.item = std::move(item);
+    // 0 means empty, so the slot stores `seq + 1`.
+    slot.seq.store(seq + 1, std::memory_order_seq_cst);
+    Drain();
+  }
+  /**
+   * @brief The next sequence to be emitted.
+   *
+   * @return uint64_t
+   */
+  uint64_t Next() const { return next_.load(std::memory_order_acquire); }
+  /**
+   * @brief The number of committed results waiting for an earlier sequence.
+   *
+   * @return uint64_t
+   */
+  uint64_t Pending() const {
+    return pending_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct alignas(CACHELINE_SIZE) Slot {
+    std::atomic<uint64_t> seq = {0};
+    T item;
+  };
+
+  bool Ready(uint64_t seq) const {
+    return slots_[seq & mask_].seq.load(std::memory_order_seq_cst) == seq + 1;
+  }
+
+  void Drain() {
+    pending_.fetch_add(1, std::memory_order_relaxed);
+    while (!draining_.exchange(true, std::memory_order_seq_cst)) {
+      auto n = next_.load(std::memory_order_relaxed);
+      while (Ready(n)) {
+        auto& slot = slots_[n & mask_];
+        emit_(slot.item);
+        slot.item = T();
+        pending_.fetch_sub(1, std::memory_order_relaxed);
+        next_.store(++n, std::memory_order_release);
+      }
+      draining_.store(false, std::memory_order_seq_cst);
+      // a commit may have landed between the last check and the release of
+      // the drain flag, its committer gave up on the flag so retry here.
+      if (!Ready(n)) {
+        break;
+      }
+    }
+  }
+
+  Emitter emit_;
+  uint64_t size_ = 0;
+  uint64_t mask_ = 0;
+  std::unique_ptr<Slot[]> slots_;
+  alignas(CACHELINE_SIZE) std::atomic<uint64_t> next_ = {0};
+  alignas(CACHELINE_SIZE) std::atomic<bool> draining_ = {false};
+  std::atomic<uint64_t> pending_ = {0};
+  DISALLOW_COPY_AND_ASSIGN(ReorderBuffer)
+};
+
+#endif  // SRC_INCLUDE_REORDER_BUFFER_H_
@@ -0,0 +1,55 @@
+#include "epoll_backend.h"
+
+#include <glog/logging.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace bats {
+namespace io {
+
+EpollBackend::~EpollBackend() {
+  if (epoll_fd_ >= 0) {
+    close(epoll_fd_);
+    epoll_fd_ = -1;
+  }
+}
+
+bool EpollBackend::Init() {
+  epoll_fd_ = epoll_create(kPollSize);
+  if (epoll_fd_ < 0) {
+    LOG(INFO) << "epoll create failed, " << strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool EpollBackend::Control(const PollCtrlParam& param) {
+  auto event = param.event;
+  if (epoll_ctl(epoll_fd_, param.operation, param.fd, &event) == 0) {
+    return true;
+  }
+  // a DEL merged with the ADD of a reused fd, the closed one left epoll
+  // by itself.
+  if (param.operation == EPOLL_CTL_MOD && errno == ENOENT) {
+    return epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, param.fd, &event) == 0;
+  }
+  return false;
+}
+
+int EpollBackend::Wait(PollEvent* events, int max_events, int timeout_ms) {
+  if (static_cast<int>(events_.size()) < max_events) {
+    events_.resize(max_events);
+  }
+  int ready_num = epoll_wait(epoll_fd_, events_.data(), max_events, timeout_ms);
+  for (int i = 0; i < ready_num; ++i) {
+    events[i].fd = events_[i].data.fd;
+    events[i].events = events_[i].events;
+  }
+  return ready_num;
+}
+
+}  // namespace io
+}  // namespace bats
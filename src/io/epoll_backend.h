@@ -0,0 +1,33 @@
+#ifndef BATS_IO_EPOLL_BACKEND_H_
+#define BATS_IO_EPOLL_BACKEND_H_
+
+#include <vector>
+
+#include "poll_backend.h"
+namespace bats {
+namespace io {
+
+class EpollBackend : public PollBackend {
+ public:
+  EpollBackend() = default;
+  ~EpollBackend() override;
+
+  bool Init() override;
+  bool Control(const PollCtrlParam& param) override;
+  int Wait(PollEvent* events, int max_events, int timeout_ms) override;
+  const char* Name() const override { return "epoll"; }
+
+ private:
+  EpollBackend(EpollBackend const&) = delete;
+  EpollBackend& operator=(EpollBackend const&) = delete;
+
+  int epoll_fd_ = -1;
+  std::vector<epoll_event> events_;
+
+  const int kPollSize = 32;
+};
+
+}  // namespace io
+}  // namespace bats
+
+#endif  // BATS_IO_EPOLL_BACKEND_H_
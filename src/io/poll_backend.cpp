@@ -0,0 +1,22 @@
+#include "poll_backend.h"
+
+#include "epoll_backend.h"
+#include "uring_backend.h"
+namespace bats {
+namespace io {
+
+std::unique_ptr<PollBackend> MakePollBackend(PollBackendType type) {
+  std::unique_ptr<PollBackend> backend;
+  if (type == PollBackendType::IO_URING) {
+    backend.reset(new UringBackend());
+  } else {
+    backend.reset(new EpollBackend());
+  }
+  if (!backend->Init()) {
+    return nullptr;
+  }
+  return backend;
+}
+
+}  // namespace io
+}  // namespace bats
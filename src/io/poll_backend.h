@@ -0,0 +1,37 @@
+#ifndef BATS_IO_POLL_BACKEND_H_
+#define BATS_IO_POLL_BACKEND_H_
+
+#include <cstdint>
+#include <memory>
+
+#include "poll_data.h"
+namespace bats {
+namespace io {
+
+// A readiness report of one fd.
+struct PollEvent {
+  int fd;
+  uint32_t events;
+};
+
+// The kernel interface of a reactor. It's used by the reactor thread only.
+class PollBackend {
+ public:
+  virtual ~PollBackend() = default;
+
+  virtual bool Init() = 0;
+  // Apply an EPOLL_CTL_ADD/MOD/DEL, errno is set on failure.
+  virtual bool Control(const PollCtrlParam& param) = 0;
+  // Wait up to `timeout_ms` (-1 for ever) for ready fds. Return the number of
+  // events filled, or -1 with errno set.
+  virtual int Wait(PollEvent* events, int max_events, int timeout_ms) = 0;
+  virtual const char* Name() const = 0;
+};
+
+// Make the backend of `type`, or nullptr if the kernel doesn't support it.
+std::unique_ptr<PollBackend> MakePollBackend(PollBackendType type);
+
+}  // namespace io
+}  // namespace bats
+
+#endif  // BATS_IO_POLL_BACKEND_H_
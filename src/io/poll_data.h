@@ -8,6 +8,8 @@
 namespace bats {
 namespace io {
 
+enum class PollBackendType { EPOLL, IO_URING };
+
 struct PollResponse {
   explicit PollResponse(uint32_t e = 0) : events(e) {}
   uint32_t events;
@@ -17,9 +19,28 @@ struct PollRequest {
   int fd = -1;
   uint32_t events = 0;
   int timeout_ms = -1;
+  // the reactor which polls `fd`, -1 to pick one by hashing `fd`.
+  int reactor = -1;
   std::function<void(const PollResponse&)> callback = nullptr;
 };
 
+// Called on the reactor with the expirations of the timer since its last run,
+// more than one if the reactor was late.
+using TimerCallback = std::function<void(uint64_t expirations)>;
+
+// The service an fd got from its reactor.
+struct PollFdStats {
+  int fd = -1;
+  int reactor = 0;
+  // the callbacks run for the fd
+  uint64_t calls = 0;
+  // the times its callback ran out of budget and re-armed the fd
+  uint64_t rearms = 0;
+  // the time spent in its callback
+  uint64_t callback_ns = 0;
+  uint64_t max_callback_ns = 0;
+};
+
 struct PollCtrlParam {
   int operation;
   int fd;
@@ -1,283 +1,235 @@
 #include "poller.h"
 
-#include <fcntl.h>
 #include <glog/logging.h>
-#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
-#include <csignal>
+#include <cerrno>
 #include <cstring>
-#include <iostream>
 
-#include "util/timetool.h"
 namespace bats {
 namespace io {
 
-Poller::Poller() {
-  if (!Init()) {
-    LOG(INFO) << "Poller init failed!";
-    Clear();
+std::mutex Poller::config_mutex_;
+bool Poller::built_ = false;
+int Poller::reactor_num_ = 1;
+std::vector<int> Poller::cpus_;
+PollBackendType Poller::backend_ = PollBackendType::EPOLL;
+
+bool Poller::Configure(int reactors, const std::vector<int>& cpus,
+                       PollBackendType backend) {
+  if (reactors < 1) {
+    LOG(INFO) << "invalid reactor num " << reactors;
+    return false;
+  }
+  std::lock_guard<std::mutex> lg(config_mutex_);
+  if (built_) {
+    if (reactors == reactor_num_ && cpus == cpus_ && backend == backend_) {
+      return true;
+    }
+    LOG(WARNING) << "poller is configured after it's built, it keeps "
+                 << reactor_num_ << " reactors";
+    return false;
   }
+  reactor_num_ = reactors;
+  cpus_ = cpus;
+  backend_ = backend;
+  return true;
+}
+
+Poller::Poller() {
+  std::lock_guard<std::mutex> lg(config_mutex_);
+  built_ = true;
+  for (int i = 0; i < reactor_num_; ++i) {
+    int cpu = cpus_.empty() ? -1 : cpus_[i % cpus_.size()];
+    reactors_.emplace_back(new Reactor(i, cpu, backend_));
+  }
+  LOG(INFO) << "Poller runs " << reactor_num_ << " reactors on "
+            << reactors_[0]->BackendName();
 }
 
 Poller::~Poller() { Shutdown(); }
 
 void Poller::Shutdown() {
-  if (is_shutdown_.exchange(true)) {
-    return;
+  for (auto& reactor : reactors_) {
+    reactor->Shutdown();
   }
-  Clear();
-}
-
-bool Poller::Register(const PollRequest& req) {
-  if (is_shutdown_.load()) {
-    return false;
+  std::lock_guard<std::mutex> lg(mutex_);
+  fd_reactors_.clear();
+  for (auto& item : timers_) {
+    close(item.first);
   }
+  timers_.clear();
+}
 
-  if (req.fd < 0 || req.callback == nullptr) {
+int Poller::AddTimer(uint64_t delay_us, uint64_t interval_us,
+                     TimerCallback callback, int reactor) {
+  if (callback == nullptr) {
     LOG(INFO) << "input is invalid";
-    return false;
-  }
-
-  PollCtrlParam ctrl_param{};
-  ctrl_param.fd = req.fd;
-  ctrl_param.event.data.fd = req.fd;
-  ctrl_param.event.events = req.events;
-
-  {
-    std::lock_guard<std::mutex> lg(poll_mutex_);
-    if (requests_.count(req.fd) == 0) {
-      ctrl_param.operation = EPOLL_CTL_ADD;
-      requests_[req.fd] = std::make_shared<PollRequest>();
-    } else {
-      ctrl_param.operation = EPOLL_CTL_MOD;
+    return -1;
+  }
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0) {
+    LOG(INFO) << "create timerfd failed, " << strerror(errno);
+    return -1;
+  }
+
+  PollRequest req;
+  req.fd = fd;
+  req.events = EPOLLIN;
+  req.reactor = reactor;
+  req.callback = [fd, callback](const PollResponse&) {
+    uint64_t expirations = 0;
+    // EAGAIN if the timer was reset after it fired
+    if (read(fd, &expirations, sizeof(expirations)) > 0) {
+      callback(expirations);
     }
-    *requests_[req.fd] = req;
-    ctrl_params_[ctrl_param.fd] = ctrl_param;
+  };
+  {
+    std::lock_guard<std::mutex> lg(mutex_);
+    timers_[fd] = req;
   }
-
-  Notify();
-  return true;
+  if (!Register(req) || !ResetTimer(fd, delay_us, interval_us)) {
+    CancelTimer(fd);
+    return -1;
+  }
+  return fd;
 }
 
-bool Poller::Unregister(const PollRequest& req) {
-  if (is_shutdown_.load()) {
-    return false;
+bool Poller::ResetTimer(int id, uint64_t delay_us, uint64_t interval_us) {
+  {
+    std::lock_guard<std::mutex> lg(mutex_);
+    if (timers_.find(id) == timers_.end()) {
+      LOG(INFO) << "reset failed, can't find timer: " << id;
+      return false;
+    }
   }
-
-  if (req.fd < 0 || req.callback == nullptr) {
-    LOG(INFO) << "input is invalid";
+  itimerspec spec = {};
+  spec.it_value.tv_sec = delay_us / 1000000;
+  spec.it_value.tv_nsec = (delay_us % 1000000) * 1000;
+  spec.it_interval.tv_sec = interval_us / 1000000;
+  spec.it_interval.tv_nsec = (interval_us % 1000000) * 1000;
+  if (timerfd_settime(id, 0, &spec, nullptr) < 0) {
+    LOG(INFO) << "set timerfd failed, " << strerror(errno);
     return false;
   }
+  return true;
+}
 
+bool Poller::CancelTimer(int id) {
+  PollRequest req;
   {
-    std::lock_guard<std::mutex> lg(poll_mutex_);
-    auto size = requests_.erase(req.fd);
-    if (size == 0) {
-      LOG(INFO) << "unregister failed, can't find fd: " << req.fd;
+    std::lock_guard<std::mutex> lg(mutex_);
+    auto search = timers_.find(id);
+    if (search == timers_.end()) {
+      LOG(INFO) << "cancel failed, can't find timer: " << id;
       return false;
     }
-
-    PollCtrlParam ctrl_param;
-    ctrl_param.operation = EPOLL_CTL_DEL;
-    ctrl_param.fd = req.fd;
-    ctrl_params_[ctrl_param.fd] = ctrl_param;
+    req = std::move(search->second);
+    timers_.erase(search);
   }
-
-  Notify();
+  Unregister(req);
+  close(id);
   return true;
 }
 
-bool Poller::Init() {
-  epoll_fd_ = epoll_create(kPollSize);
-  if (epoll_fd_ < 0) {
-    LOG(INFO) << "epoll create failed, " << strerror(errno);
-    return false;
+bool Poller::Rearm(int fd) {
+  int index = -1;
+  {
+    std::lock_guard<std::mutex> lg(mutex_);
+    auto search = fd_reactors_.find(fd);
+    if (search == fd_reactors_.end()) {
+      return false;
+    }
+    index = search->second;
   }
+  return reactors_[index]->Rearm(fd);
+}
 
-  // create pipe, and set nonblock
-  if (pipe(pipe_fd_) == -1) {
-    LOG(INFO) << "create pipe failed, " << strerror(errno);
-    return false;
-  }
-  if (fcntl(pipe_fd_[0], F_SETFL, O_NONBLOCK) == -1) {
-    LOG(INFO) << "set nonblock failed, " << strerror(errno);
-    return false;
-  }
-  if (fcntl(pipe_fd_[1], F_SETFL, O_NONBLOCK) == -1) {
-    LOG(INFO) << "set nonblock failed, " << strerror(errno);
-    return false;
+std::vector<PollFdStats> Poller::FdStats() {
+  std::vector<PollFdStats> stats;
+  for (auto& reactor : reactors_) {
+    reactor->FdStats(stats);
   }
-
-  // add pipe[0] to epoll
-  auto request = std::make_shared<PollRequest>();
-  request->fd = pipe_fd_[0];
-  request->events = EPOLLIN;
-  request->timeout_ms = -1;
-  request->callback = [this](const PollResponse&) {
-    char c = 0;
-    while (read(pipe_fd_[0], &c, 1) > 0) {
-    }
-  };
-  requests_[request->fd] = request;
-
-  PollCtrlParam ctrl_param{};
-  ctrl_param.operation = EPOLL_CTL_ADD;
-  ctrl_param.fd = pipe_fd_[0];
-  ctrl_param.event.data.fd = pipe_fd_[0];
-  ctrl_param.event.events = EPOLLIN;
-  ctrl_params_[ctrl_param.fd] = ctrl_param;
-
-  is_shutdown_.store(false);
-  thread_ = std::thread(&Poller::ThreadFunc, this);
-  return true;
+  return stats;
 }
 
-void Poller::Clear() {
-  if (thread_.joinable()) {
-    thread_.join();
+void Poller::SetBusyPoll(int budget_us, int socket_us) {
+  for (auto& reactor : reactors_) {
+    reactor->SetBusyPoll(budget_us, socket_us);
   }
+}
 
-  if (epoll_fd_ >= 0) {
-    close(epoll_fd_);
-    epoll_fd_ = -1;
+std::vector<ReactorStats> Poller::Stats() const {
+  std::vector<ReactorStats> stats;
+  for (auto& reactor : reactors_) {
+    stats.push_back(reactor->Stats());
   }
+  return stats;
+}
 
-  if (pipe_fd_[0] >= 0) {
-    close(pipe_fd_[0]);
-    pipe_fd_[0] = -1;
+void Poller::SetSlowCallback(int threshold_us) {
+  for (auto& reactor : reactors_) {
+    reactor->SetSlowCallback(threshold_us);
   }
+}
 
-  if (pipe_fd_[1] >= 0) {
-    close(pipe_fd_[1]);
-    pipe_fd_[1] = -1;
-  }
+Poller::Snapshot Poller::TakeSnapshot() {
+  Snapshot snapshot;
+  snapshot.reactors = Stats();
+  snapshot.fds = FdStats();
+  return snapshot;
+}
 
-  {
-    std::lock_guard<std::mutex> lg(poll_mutex_);
-    requests_.clear();
-    ctrl_params_.clear();
+int Poller::Select(const PollRequest& req) const {
+  if (req.reactor >= 0) {
+    return req.reactor % reactors_.size();
   }
+  return req.fd % reactors_.size();
 }
 
-void Poller::Poll(int timeout_ms) {
-  epoll_event evt[kPollSize];
-  auto before_time_ns = bats::util::Time::Now().ToNanosecond();
-  int ready_num = epoll_wait(epoll_fd_, evt, kPollSize, timeout_ms);
-  auto after_time_ns = bats::util::Time::Now().ToNanosecond();
-  int interval_ms =
-      static_cast<int>((after_time_ns - before_time_ns) / 1000000);
-  if (interval_ms == 0) {
-    interval_ms = 1;
+bool Poller::Register(const PollRequest& req) {
+  if (req.fd < 0) {
+    LOG(INFO) << "input is invalid";
+    return false;
   }
 
-  std::unordered_map<int, PollResponse> responses;
+  int index = Select(req);
+  int old = -1;
   {
-    std::lock_guard<std::mutex> lg(poll_mutex_);
-    for (auto& item : requests_) {
-      auto& request = item.second;
-      if (ctrl_params_.count(request->fd) != 0) {
-        continue;
-      }
-
-      if (request->timeout_ms > 0) {
-        request->timeout_ms -= interval_ms;
-        if (request->timeout_ms < 0) {
-          request->timeout_ms = 0;
-        }
-      }
-
-      if (request->timeout_ms == 0) {
-        responses[item.first] = PollResponse();
-        request->timeout_ms = -1;
-      }
-    }
-  }
-
-  if (ready_num > 0) {
-    for (int i = 0; i < ready_num; ++i) {
-      int fd = evt[i].data.fd;
-      uint32_t events = evt[i].events;
-      responses[fd] = PollResponse(events);
-    }
-  }
-
-  for (auto& item : responses) {
-    int fd = item.first;
-    auto& response = item.second;
-    std::lock_guard<std::mutex> lg(poll_mutex_);
-    auto search = requests_.find(fd);
-    if (search != requests_.end()) {
-      search->second->timeout_ms = -1;
-      search->second->callback(response);
+    // not held while calling a reactor, whose callbacks may register.
+    std::lock_guard<std::mutex> lg(mutex_);
+    auto search = fd_reactors_.find(req.fd);
+    if (search != fd_reactors_.end()) {
+      old = search->second;
     }
+    fd_reactors_[req.fd] = index;
   }
-
-  if (ready_num < 0) {
-    if (errno != EINTR) {
-      LOG(INFO) << "epoll wait failed, " << strerror(errno);
-    }
+  if (old >= 0 && old != index) {
+    // moved to another reactor
+    reactors_[old]->Unregister(req);
   }
-}
-
-void Poller::ThreadFunc() {
-  // block all signals in this thread
-  sigset_t signal_set;
-  sigfillset(&signal_set);
-  pthread_sigmask(SIG_BLOCK, &signal_set, nullptr);
-
-  while (!is_shutdown_.load()) {
-    HandleChanges();
-    int timeout_ms = GetTimeoutMs();
-    // DLOG(INFO) << "this poll timeout ms: " << timeout_ms;
-    Poll(timeout_ms);
+  if (!reactors_[index]->Register(req)) {
+    std::lock_guard<std::mutex> lg(mutex_);
+    fd_reactors_.erase(req.fd);
+    return false;
   }
+  return true;
 }
 
-void Poller::HandleChanges() {
-  CtrlParamMap local_params;
+bool Poller::Unregister(const PollRequest& req) {
+  int index = -1;
   {
-    std::lock_guard<std::mutex> lg(poll_mutex_);
-    if (ctrl_params_.empty()) {
-      return;
-    }
-    local_params.swap(ctrl_params_);
-  }
-
-  for (auto& pair : local_params) {
-    auto& item = pair.second;
-    LOG(INFO) << "epoll ctl, op[" << item.operation << "] fd[" << item.fd
-              << "] events[" << item.event.events << "]";
-    if (epoll_ctl(epoll_fd_, item.operation, item.fd, &item.event) != 0 &&
-        errno != EBADF) {
-      LOG(INFO) << "epoll ctl failed, " << strerror(errno);
-    }
-  }
-}
-
-// min heap can be used to optimize
-int Poller::GetTimeoutMs() {
-  int timeout_ms = kPollTimeoutMs;
-  std::lock_guard<std::mutex> lg(poll_mutex_);
-  for (auto& item : requests_) {
-    auto& req = item.second;
-    if (req->timeout_ms >= 0 && req->timeout_ms < timeout_ms) {
-      timeout_ms = req->timeout_ms;
+    std::lock_guard<std::mutex> lg(mutex_);
+    auto search = fd_reactors_.find(req.fd);
+    if (search == fd_reactors_.end()) {
+      LOG(INFO) << "unregister failed, can't find fd: " << req.fd;
+      return false;
     }
+    index = search->second;
+    fd_reactors_.erase(search);
   }
-  return timeout_ms;
-}
-
-void Poller::Notify() {
-  std::unique_lock<std::mutex> lock(pipe_mutex_, std::try_to_lock);
-  if (!lock.owns_lock()) {
-    return;
-  }
-
-  char msg = 'C';
-  if (write(pipe_fd_[1], &msg, 1) < 0) {
-    LOG(INFO) << "notify failed, " << strerror(errno);
-  }
+  return reactors_[index]->Unregister(req);
 }
 
 }  // namespace io
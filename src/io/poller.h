@@ -1,28 +1,21 @@
 #ifndef BATS_POOLER_HEADER_H_
 #define BATS_POOLER_HEADER_H_
 
-#include <fcntl.h>
-#include <unistd.h>
-
-#include <atomic>
-#include <condition_variable>
-#include <list>
 #include <memory>
 #include <mutex>
-#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include "poll_data.h"
+#include "reactor.h"
 namespace bats {
 namespace io {
 
+// A group of reactors, each with its own epoll fd and thread, so a busy fd
+// only delays the fds sharing its reactor. A request is sharded by
+// `PollRequest::reactor`, or by its fd when that is -1.
 class Poller {
  public:
-  using RequestPtr = std::shared_ptr<PollRequest>;
-  using RequestMap = std::unordered_map<int, RequestPtr>;
-  using CtrlParamMap = std::unordered_map<int, PollCtrlParam>;
-
   static Poller* Instance() {
     static Poller* ins = nullptr;
     if (!ins) {
@@ -32,41 +25,75 @@ class Poller {
     return ins;
   }
 
+  // Set the number of reactors, the cpus they are pinned to, round robin,
+  // and their backend. Once `Instance()` has built the reactors, it returns
+  // false unless the settings are the ones they run with.
+  static bool Configure(int reactors, const std::vector<int>& cpus = {},
+                        PollBackendType backend = PollBackendType::EPOLL);
+
   virtual ~Poller();
 
   void Shutdown();
 
   bool Register(const PollRequest& req);
+  // The callback of `req` isn't called after this returns. Called off the
+  // reactor thread, it waits for the running callback of the fd to return.
   bool Unregister(const PollRequest& req);
 
+  // A timer on the monotonic clock backed by a timerfd, so it fires with the
+  // resolution of the kernel hrtimers instead of the ms of `timeout_ms`.
+  // `callback` runs on the reactor `delay_us` later, then every `interval_us`
+  // if it's > 0. A 0 `delay_us` leaves it disarmed until `ResetTimer`.
+  // Returns the timer id, -1 on failure.
+  int AddTimer(uint64_t delay_us, uint64_t interval_us, TimerCallback callback,
+               int reactor = -1);
+  // Re-arm a timer as `AddTimer` does, or disarm it with a 0 `delay_us`.
+  bool ResetTimer(int id, uint64_t delay_us, uint64_t interval_us = 0);
+  // The callback of the timer isn't called after this returns, see
+  // `Unregister`.
+  bool CancelTimer(int id);
+
+  // See `Reactor::Rearm`.
+  bool Rearm(int fd);
+  // The service stats of every registered fd.
+  std::vector<PollFdStats> FdStats();
+
+  int ReactorNum() const { return static_cast<int>(reactors_.size()); }
+  // See `Reactor::SetBusyPoll`, it applies to all the reactors at runtime.
+  void SetBusyPoll(int budget_us, int socket_us = 0);
+  std::vector<ReactorStats> Stats() const;
+  // See `Reactor::SetSlowCallback`, it applies to all the reactors.
+  void SetSlowCallback(int threshold_us);
+
+  // The counters of the reactors and of their fds at one time, to diff with
+  // an older one for the rates.
+  struct Snapshot {
+    std::vector<ReactorStats> reactors;
+    std::vector<PollFdStats> fds;
+  };
+  Snapshot TakeSnapshot();
+
  private:
   Poller();
   Poller(Poller const&) = delete;
   Poller& operator=(Poller const&) = delete;
 
-  bool Init();
-  void Clear();
-  void Poll(int timeout_ms);
-  void ThreadFunc();
-  void HandleChanges();
-  int GetTimeoutMs();
-  void Notify();
-
-  int epoll_fd_ = -1;
-  std::thread thread_;
-  std::atomic<bool> is_shutdown_ = {true};
-
-  int pipe_fd_[2] = {-1, -1};
-  std::mutex pipe_mutex_;
-
-  RequestMap requests_;
-  CtrlParamMap ctrl_params_;
-
-  std::mutex poll_mutex_;
-  std::condition_variable condition_;
-
-  const int kPollSize = 32;
-  const int kPollTimeoutMs = 100;
+  int Select(const PollRequest& req) const;
+
+  std::vector<std::unique_ptr<Reactor>> reactors_;
+  // the reactor of each registered fd, an fd is unregistered from the one it
+  // was registered to.
+  std::unordered_map<int, int> fd_reactors_;
+  // the requests of the timers by their timerfd
+  std::unordered_map<int, PollRequest> timers_;
+  std::mutex mutex_;
+
+  // guards the settings below against a `Configure` racing the constructor.
+  static std::mutex config_mutex_;
+  static bool built_;
+  static int reactor_num_;
+  static std::vector<int> cpus_;
+  static PollBackendType backend_;
 };
 
 }  // namespace io
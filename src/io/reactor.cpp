@@ -0,0 +1,483 @@
+#include "reactor.h"
+
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "util/timetool.h"
+namespace bats {
+namespace io {
+
+Reactor::Reactor(int index, int cpu, PollBackendType backend)
+    : index_(index), cpu_(cpu), backend_type_(backend) {
+  if (!Init()) {
+    LOG(INFO) << "Reactor " << index_ << " init failed!";
+    Clear();
+  }
+}
+
+Reactor::~Reactor() { Shutdown(); }
+
+void Reactor::Shutdown() {
+  if (is_shutdown_.exchange(true)) {
+    return;
+  }
+  Clear();
+}
+
+bool Reactor::Register(const PollRequest& req) {
+  if (is_shutdown_.load()) {
+    return false;
+  }
+
+  if (req.fd < 0 || req.callback == nullptr) {
+    LOG(INFO) << "input is invalid";
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> lg(poll_mutex_);
+    auto& slot = SlotOf(req.fd);
+    auto socket_us = socket_busy_poll_us_.load();
+    if (socket_us > 0 && !slot.request) {
+      // fails with ENOTSOCK on other fds
+      setsockopt(req.fd, SOL_SOCKET, SO_BUSY_POLL, &socket_us,
+                 sizeof(socket_us));
+    }
+    auto operation = slot.request ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (!slot.request) {
+      slot.calls = 0;
+      slot.rearms = 0;
+      slot.callback_ns = 0;
+      slot.max_callback_ns = 0;
+    }
+    // a running callback keeps the request it was called with.
+    slot.request = std::make_shared<PollRequest>(req);
+    QueueCtrl(req.fd, operation, req.events);
+    ArmTimer(req.fd, req.timeout_ms);
+  }
+
+  Notify();
+  return true;
+}
+
+bool Reactor::Unregister(const PollRequest& req) {
+  if (is_shutdown_.load()) {
+    return false;
+  }
+
+  if (req.fd < 0 || req.callback == nullptr) {
+    LOG(INFO) << "input is invalid";
+    return false;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(poll_mutex_);
+    auto slot = FindSlot(req.fd);
+    if (slot == nullptr || !slot->request) {
+      LOG(INFO) << "unregister failed, can't find fd: " << req.fd;
+      return false;
+    }
+    auto request = std::move(slot->request);
+    slot->request = nullptr;
+    slot->timer_seq = 0;
+    QueueCtrl(req.fd, EPOLL_CTL_DEL, 0);
+
+    // the callback isn't called once this returns, wait for the running one
+    // unless it's the caller.
+    if (std::this_thread::get_id() != thread_.get_id()) {
+      condition_.wait(lock, [&]() { return running_ != request; });
+    }
+  }
+
+  Notify();
+  return true;
+}
+
+bool Reactor::Rearm(int fd) {
+  {
+    std::lock_guard<std::mutex> lg(poll_mutex_);
+    auto slot = FindSlot(fd);
+    if (slot == nullptr || !slot->request) {
+      return false;
+    }
+    slot->rearms++;
+    // a MOD re-arms the edge trigger
+    QueueCtrl(fd, EPOLL_CTL_MOD, slot->request->events);
+  }
+  // the reactor thread applies it before its next wait
+  if (std::this_thread::get_id() != thread_.get_id()) {
+    Notify();
+  }
+  return true;
+}
+
+void Reactor::FdStats(std::vector<PollFdStats>& out) {
+  std::lock_guard<std::mutex> lg(poll_mutex_);
+  for (size_t fd = 0; fd < slots_.size(); ++fd) {
+    auto& slot = slots_[fd];
+    if (!slot.request || static_cast<int>(fd) == event_fd_) {
+      continue;
+    }
+    PollFdStats stats;
+    stats.fd = static_cast<int>(fd);
+    stats.reactor = index_;
+    stats.calls = slot.calls;
+    stats.rearms = slot.rearms;
+    stats.callback_ns = slot.callback_ns;
+    stats.max_callback_ns = slot.max_callback_ns;
+    out.push_back(stats);
+  }
+}
+
+bool Reactor::Init() {
+  backend_ = MakePollBackend(backend_type_);
+  if (!backend_ && backend_type_ != PollBackendType::EPOLL) {
+    LOG(INFO) << "reactor " << index_ << " falls back to epoll";
+    backend_ = MakePollBackend(PollBackendType::EPOLL);
+  }
+  if (!backend_) {
+    return false;
+  }
+
+  // the wakeups of the reactor add up in the counter, none is lost.
+  event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd_ < 0) {
+    LOG(INFO) << "create eventfd failed, " << strerror(errno);
+    return false;
+  }
+
+  // add the eventfd to the backend
+  auto request = std::make_shared<PollRequest>();
+  request->fd = event_fd_;
+  request->events = EPOLLIN;
+  request->timeout_ms = -1;
+  request->callback = [this](const PollResponse&) {
+    uint64_t count = 0;
+    auto ret = read(event_fd_, &count, sizeof(count));
+    (void)ret;
+  };
+  SlotOf(request->fd).request = request;
+  QueueCtrl(request->fd, EPOLL_CTL_ADD, EPOLLIN);
+
+  ctrl_work_.reserve(kPollSize);
+  events_.resize(kPollSize);
+  responses_.reserve(kPollSize);
+
+  is_shutdown_.store(false);
+  thread_ = std::thread(&Reactor::ThreadFunc, this);
+  return true;
+}
+
+void Reactor::Clear() {
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+
+  backend_.reset();
+
+  if (event_fd_ >= 0) {
+    close(event_fd_);
+    event_fd_ = -1;
+  }
+
+  {
+    std::lock_guard<std::mutex> lg(poll_mutex_);
+    slots_.clear();
+    ctrl_params_.clear();
+    timers_ = TimerHeap();
+  }
+}
+
+int Reactor::Poll(int timeout_ms) {
+  int ready_num = backend_->Wait(events_.data(), kPollSize, timeout_ms);
+  int poll_errno = errno;
+  auto wakeup_ns = NowNs();
+  auto now_ms = wakeup_ns / 1000000;
+  loop_++;
+  if (ready_num > 0) {
+    wakeups_.fetch_add(1, std::memory_order_relaxed);
+    ready_events_.fetch_add(ready_num, std::memory_order_relaxed);
+  }
+  events_per_wait_[Bucket(ready_num > 0 ? ready_num : 0,
+                          ReactorStats::kEventBuckets)]
+      .fetch_add(1, std::memory_order_relaxed);
+
+  responses_.clear();
+  {
+    std::lock_guard<std::mutex> lg(poll_mutex_);
+    for (int i = 0; i < ready_num; ++i) {
+      auto slot = FindSlot(events_[i].fd);
+      if (slot != nullptr && slot->ready_loop != loop_) {
+        slot->ready_loop = loop_;
+        responses_.push_back(events_[i]);
+      }
+    }
+
+    while (!timers_.empty() && timers_.top().deadline_ms <= now_ms) {
+      auto timer = timers_.top();
+      timers_.pop();
+      auto slot = FindSlot(timer.fd);
+      if (slot == nullptr || slot->timer_seq != timer.seq) {
+        continue;
+      }
+      // the fd isn't added to the backend yet
+      if (slot->ctrl >= 0) {
+        pending_timers_.push_back(timer);
+        continue;
+      }
+      slot->timer_seq = 0;
+      // a ready fd is reported with its events instead
+      if (slot->ready_loop != loop_) {
+        slot->ready_loop = loop_;
+        responses_.push_back(PollEvent{timer.fd, 0});
+      }
+    }
+    for (auto& timer : pending_timers_) {
+      timers_.push(timer);
+    }
+    pending_timers_.clear();
+  }
+
+  // the callbacks run unlocked, `Register` and `Unregister` never wait for
+  // them except to unregister the fd of the running one.
+  auto slow_ns = slow_callback_us_.load(std::memory_order_relaxed) * 1000ULL;
+  for (auto& item : responses_) {
+    RequestPtr request;
+    {
+      std::lock_guard<std::mutex> lg(poll_mutex_);
+      auto slot = FindSlot(item.fd);
+      if (slot == nullptr || !slot->request) {
+        continue;
+      }
+      slot->timer_seq = 0;
+      slot->calls++;
+      request = slot->request;
+      running_ = request;
+    }
+    // the lock and the logs around a callback aren't charged to it.
+    auto begin_ns = NowNs();
+    request->callback(PollResponse(item.events));
+    auto cost_ns = NowNs() - begin_ns;
+    {
+      std::lock_guard<std::mutex> lg(poll_mutex_);
+      running_ = nullptr;
+      // the slot may be gone with an unregistered fd
+      auto slot = FindSlot(item.fd);
+      if (slot != nullptr && slot->request == request) {
+        slot->callback_ns += cost_ns;
+        slot->max_callback_ns = std::max(slot->max_callback_ns, cost_ns);
+      }
+    }
+    condition_.notify_all();
+    callback_ns_.fetch_add(cost_ns, std::memory_order_relaxed);
+    if (slow_ns > 0 && cost_ns > slow_ns) {
+      slow_callbacks_.fetch_add(1, std::memory_order_relaxed);
+      LOG(WARNING) << "reactor " << index_ << " fd " << item.fd
+                   << " callback took " << cost_ns / 1000 << " us";
+    }
+  }
+  // an empty spin isn't a loop which served anything.
+  if (!responses_.empty()) {
+    loop_us_[Bucket((NowNs() - wakeup_ns) / 1000,
+                    ReactorStats::kLatencyBuckets)]
+        .fetch_add(1, std::memory_order_relaxed);
+  }
+
+  if (ready_num < 0) {
+    if (poll_errno != EINTR) {
+      LOG(INFO) << backend_->Name() << " wait failed, "
+                << strerror(poll_errno);
+    }
+  }
+  return ready_num;
+}
+
+void Reactor::ThreadFunc() {
+  // block all signals in this thread
+  sigset_t signal_set;
+  sigfillset(&signal_set);
+  pthread_sigmask(SIG_BLOCK, &signal_set, nullptr);
+
+  if (cpu_ >= 0) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu_, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0) {
+      LOG(INFO) << "pin reactor " << index_ << " to cpu " << cpu_ << " failed";
+    }
+  }
+  std::string name = "reactor" + std::to_string(index_);
+  pthread_setname_np(pthread_self(), name.c_str());
+
+  bool spinning = false;
+  uint64_t spin_until_ns = 0;
+  while (!is_shutdown_.load()) {
+    HandleChanges();
+    int timeout_ms = spinning ? 0 : GetTimeoutMs();
+    // DLOG(INFO) << "this poll timeout ms: " << timeout_ms;
+    int ready_num = Poll(timeout_ms);
+    loops_.fetch_add(1, std::memory_order_relaxed);
+
+    auto budget_us = busy_poll_us_.load(std::memory_order_relaxed);
+    if (budget_us <= 0) {
+      spinning = false;
+      continue;
+    }
+    auto now_ns = bats::util::Time::MonoTime().ToNanosecond();
+    if (spinning) {
+      spins_.fetch_add(1, std::memory_order_relaxed);
+      if (ready_num > 0) {
+        spin_hits_.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    if (ready_num > 0) {
+      // the budget restarts on every activity
+      spinning = true;
+      spin_until_ns = now_ns + budget_us * 1000ULL;
+    } else if (now_ns >= spin_until_ns) {
+      spinning = false;
+    }
+  }
+}
+
+void Reactor::HandleChanges() {
+  {
+    std::lock_guard<std::mutex> lg(poll_mutex_);
+    if (ctrl_params_.empty()) {
+      return;
+    }
+    ctrl_work_.swap(ctrl_params_);
+    for (auto& item : ctrl_work_) {
+      slots_[item.fd].ctrl = -1;
+    }
+  }
+
+  for (auto& item : ctrl_work_) {
+    if (item.operation == 0) {
+      continue;
+    }
+    DLOG(INFO) << backend_->Name() << " ctl, op[" << item.operation
+               << "] fd[" << item.fd << "] events[" << item.event.events
+               << "]";
+    if (!backend_->Control(item) && errno != EBADF) {
+      LOG(WARNING) << backend_->Name() << " ctl op[" << item.operation
+                   << "] fd[" << item.fd << "] failed, " << strerror(errno);
+    }
+  }
+  ctrl_work_.clear();
+}
+
+// called with poll_mutex_ held. The ops of an fd queued in the same loop are
+// merged into one, so the backend never sees a DEL of an fd it doesn't have.
+void Reactor::QueueCtrl(int fd, int operation, uint32_t events) {
+  auto& slot = SlotOf(fd);
+  if (slot.ctrl < 0) {
+    slot.ctrl = static_cast<int>(ctrl_params_.size());
+    ctrl_params_.emplace_back();
+  } else {
+    auto pending = ctrl_params_[slot.ctrl].operation;
+    if (pending == EPOLL_CTL_ADD && operation == EPOLL_CTL_DEL) {
+      operation = 0;
+    } else if (pending == EPOLL_CTL_ADD) {
+      operation = EPOLL_CTL_ADD;
+    } else if (pending == EPOLL_CTL_DEL && operation == EPOLL_CTL_ADD) {
+      operation = EPOLL_CTL_MOD;
+    }
+  }
+  auto& param = ctrl_params_[slot.ctrl];
+  param.operation = operation;
+  param.fd = fd;
+  param.event.data.fd = fd;
+  param.event.events = events;
+}
+
+int Reactor::GetTimeoutMs() {
+  int timeout_ms = kPollTimeoutMs;
+  std::lock_guard<std::mutex> lg(poll_mutex_);
+  while (!timers_.empty()) {
+    auto& timer = timers_.top();
+    auto slot = FindSlot(timer.fd);
+    if (slot == nullptr || slot->timer_seq != timer.seq) {
+      timers_.pop();
+      continue;
+    }
+    auto now_ms = NowMs();
+    if (timer.deadline_ms <= now_ms) {
+      timeout_ms = 0;
+    } else if (timer.deadline_ms - now_ms < static_cast<uint64_t>(timeout_ms)) {
+      timeout_ms = static_cast<int>(timer.deadline_ms - now_ms);
+    }
+    break;
+  }
+  return timeout_ms;
+}
+
+// called with poll_mutex_ held
+void Reactor::ArmTimer(int fd, int timeout_ms) {
+  auto& slot = SlotOf(fd);
+  if (timeout_ms < 0) {
+    slot.timer_seq = 0;
+    return;
+  }
+  Timer timer;
+  timer.deadline_ms = NowMs() + timeout_ms;
+  timer.fd = fd;
+  timer.seq = ++timer_seq_;
+  slot.timer_seq = timer.seq;
+  timers_.push(timer);
+}
+
+ReactorStats Reactor::Stats() const {
+  ReactorStats stats;
+  stats.loops = loops_.load(std::memory_order_relaxed);
+  stats.spins = spins_.load(std::memory_order_relaxed);
+  stats.spin_hits = spin_hits_.load(std::memory_order_relaxed);
+  stats.wasted_spins = stats.spins - stats.spin_hits;
+  stats.wakeups = wakeups_.load(std::memory_order_relaxed);
+  stats.events = ready_events_.load(std::memory_order_relaxed);
+  for (int i = 0; i < ReactorStats::kEventBuckets; ++i) {
+    stats.events_per_wait[i] =
+        events_per_wait_[i].load(std::memory_order_relaxed);
+  }
+  for (int i = 0; i < ReactorStats::kLatencyBuckets; ++i) {
+    stats.loop_us[i] = loop_us_[i].load(std::memory_order_relaxed);
+  }
+  stats.callback_ns = callback_ns_.load(std::memory_order_relaxed);
+  stats.slow_callbacks = slow_callbacks_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+int Reactor::Bucket(uint64_t value, int buckets) {
+  int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+  return bucket < buckets ? bucket : buckets - 1;
+}
+
+uint64_t Reactor::NowMs() {
+  return bats::util::Time::MonoTime().ToMillisecond();
+}
+
+uint64_t Reactor::NowNs() {
+  return bats::util::Time::MonoTime().ToNanosecond();
+}
+
+void Reactor::Notify() {
+  uint64_t one = 1;
+  if (write(event_fd_, &one, sizeof(one)) < 0) {
+    LOG(INFO) << "notify failed, " << strerror(errno);
+  }
+}
+
+}  // namespace io
+}  // namespace bats
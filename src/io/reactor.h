@@ -0,0 +1,212 @@
+#ifndef BATS_IO_REACTOR_H_
+#define BATS_IO_REACTOR_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "poll_backend.h"
+#include "poll_data.h"
+namespace bats {
+namespace io {
+
+// The counters of a reactor.
+struct ReactorStats {
+  // waits by the events they returned, bucket i holds [2^(i-1), 2^i) events
+  // and bucket 0 the empty waits
+  static const int kEventBuckets = 8;
+  // loops which dispatched callbacks by the time from the wakeup to the next
+  // wait, bucket i holds [2^(i-1), 2^i) us and the last one everything above
+  static const int kLatencyBuckets = 20;
+
+  uint64_t loops = 0;
+  // waits which returned events, and the events they returned
+  uint64_t wakeups = 0;
+  uint64_t events = 0;
+  std::array<uint64_t, kEventBuckets> events_per_wait = {};
+  std::array<uint64_t, kLatencyBuckets> loop_us = {};
+  // the time spent in callbacks, and the callbacks over the slow threshold
+  uint64_t callback_ns = 0;
+  uint64_t slow_callbacks = 0;
+
+  // The upper bound in us of the loop latency at `quantile`, e.g. 0.99.
+  uint64_t LoopUsAt(double quantile) const {
+    uint64_t total = 0;
+    for (auto count : loop_us) {
+      total += count;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < kLatencyBuckets; ++i) {
+      seen += loop_us[i];
+      if (seen > 0 && seen >= quantile * total) {
+        return 1ULL << i;
+      }
+    }
+    return 0;
+  }
+  // zero-timeout polls made in busy-poll mode, split into those which caught
+  // events and the wasted ones
+  uint64_t spins = 0;
+  uint64_t spin_hits = 0;
+  uint64_t wasted_spins = 0;
+};
+
+// One poll backend, epoll or io_uring, and the thread running its callbacks.
+class Reactor {
+ public:
+  using RequestPtr = std::shared_ptr<PollRequest>;
+
+  // A request timeout at an absolute monotonic time. A timer is stale once
+  // its fd is rearmed, fired or unregistered, and is dropped when it's on top.
+  struct Timer {
+    uint64_t deadline_ms;
+    int fd;
+    uint64_t seq;
+    bool operator>(const Timer& other) const {
+      return deadline_ms > other.deadline_ms;
+    }
+  };
+  using TimerHeap =
+      std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>>;
+
+  // `cpu` < 0 leaves the thread unpinned. It falls back to epoll if the
+  // kernel doesn't support `backend`.
+  Reactor(int index, int cpu,
+          PollBackendType backend = PollBackendType::EPOLL);
+  virtual ~Reactor();
+
+  void Shutdown();
+
+  bool Register(const PollRequest& req);
+  // The callback of `req` isn't called after this returns. Called off the
+  // reactor thread, it waits for the running callback of the fd to return.
+  bool Unregister(const PollRequest& req);
+  // Report a registered fd again in the next loop even if it's edge triggered
+  // and not drained, after the other ready fds are served. A callback which
+  // stops early to be fair calls it.
+  bool Rearm(int fd);
+  // The stats of the registered fds.
+  void FdStats(std::vector<PollFdStats>& out);
+
+  // After a loop with events, keep polling without sleep for `budget_us`
+  // before blocking again, which saves the wakeup latency of bursty traffic
+  // at the cost of a busy core. 0 turns it off. Sockets registered later also
+  // get SO_BUSY_POLL of `socket_us` if it's > 0.
+  void SetBusyPoll(int budget_us, int socket_us = 0) {
+    busy_poll_us_.store(budget_us < 0 ? 0 : budget_us);
+    socket_busy_poll_us_.store(socket_us < 0 ? 0 : socket_us);
+  }
+  // Log the callbacks which run longer than `threshold_us`, 0 turns it off.
+  void SetSlowCallback(int threshold_us) {
+    slow_callback_us_.store(threshold_us < 0 ? 0 : threshold_us);
+  }
+  ReactorStats Stats() const;
+
+  int Index() const { return index_; }
+  const char* BackendName() const {
+    return backend_ ? backend_->Name() : "none";
+  }
+
+ private:
+  Reactor(Reactor const&) = delete;
+  Reactor& operator=(Reactor const&) = delete;
+
+  bool Init();
+  void Clear();
+  int Poll(int timeout_ms);
+  void ThreadFunc();
+  void HandleChanges();
+  int GetTimeoutMs();
+  void ArmTimer(int fd, int timeout_ms);
+  void QueueCtrl(int fd, int operation, uint32_t events);
+  static uint64_t NowMs();
+  static uint64_t NowNs();
+  // the histogram bucket of `value`, see `ReactorStats`
+  static int Bucket(uint64_t value, int buckets);
+  void Notify();
+
+  int index_ = 0;
+  int cpu_ = -1;
+  PollBackendType backend_type_ = PollBackendType::EPOLL;
+  std::unique_ptr<PollBackend> backend_;
+  std::thread thread_;
+  std::atomic<bool> is_shutdown_ = {true};
+
+  // wakes the reactor up to apply the changes
+  int event_fd_ = -1;
+
+  // The state of an fd, all the tables are indexed by fd and only grow, so
+  // the steady loop neither allocates nor hashes.
+  struct Slot {
+    RequestPtr request;
+    // the seq of the live timer, 0 if none
+    uint64_t timer_seq = 0;
+    // the index of the pending op in `ctrl_params_`, -1 if none
+    int ctrl = -1;
+    // the last loop the fd was reported ready in
+    uint64_t ready_loop = 0;
+    uint64_t calls = 0;
+    uint64_t rearms = 0;
+    uint64_t callback_ns = 0;
+    uint64_t max_callback_ns = 0;
+  };
+  Slot& SlotOf(int fd) {
+    if (fd >= static_cast<int>(slots_.size())) {
+      slots_.resize(fd + 1);
+    }
+    return slots_[fd];
+  }
+  Slot* FindSlot(int fd) {
+    return fd < static_cast<int>(slots_.size()) ? &slots_[fd] : nullptr;
+  }
+
+  std::vector<Slot> slots_;
+  std::vector<PollCtrlParam> ctrl_params_;
+  TimerHeap timers_;
+  uint64_t timer_seq_ = 0;
+
+  // owned by the reactor thread, reused by every loop
+  std::vector<PollCtrlParam> ctrl_work_;
+  std::vector<PollEvent> events_;
+  std::vector<PollEvent> responses_;
+  std::vector<Timer> pending_timers_;
+  uint64_t loop_ = 0;
+
+  std::atomic<int> busy_poll_us_ = {0};
+  std::atomic<int> socket_busy_poll_us_ = {0};
+  std::atomic<uint64_t> loops_ = {0};
+  std::atomic<uint64_t> spins_ = {0};
+  std::atomic<uint64_t> spin_hits_ = {0};
+  // written by the reactor thread only
+  std::atomic<uint64_t> wakeups_ = {0};
+  std::atomic<uint64_t> ready_events_ = {0};
+  std::array<std::atomic<uint64_t>, ReactorStats::kEventBuckets>
+      events_per_wait_ = {};
+  std::array<std::atomic<uint64_t>, ReactorStats::kLatencyBuckets>
+      loop_us_ = {};
+  std::atomic<uint64_t> callback_ns_ = {0};
+  std::atomic<uint64_t> slow_callbacks_ = {0};
+  std::atomic<int> slow_callback_us_ = {0};
+
+  std::mutex poll_mutex_;
+  // signaled when a callback returns.
+  std::condition_variable condition_;
+  RequestPtr running_;
+
+  const int kPollSize = 32;
+  const int kPollTimeoutMs = 100;
+};
+
+}  // namespace io
+}  // namespace bats
+
+#endif  // BATS_IO_REACTOR_H_
@@ -0,0 +1,101 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "reactor.h"
+
+namespace {
+std::atomic<uint64_t> g_allocs = {0};
+}  // namespace
+
+void* operator new(size_t size) {
+  g_allocs.fetch_add(1, std::memory_order_relaxed);
+  void* p = malloc(size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+namespace bats {
+namespace io {
+
+// Wake a reactor through many fds and count the heap allocations of its loop
+// once the tables are warmed up.
+void RunBench(PollBackendType type) {
+  const int kFds = 64;
+  const int kWarmup = 1000;
+  const int kRounds = 100000;
+  Reactor reactor(0, -1, type);
+  std::atomic<uint64_t> received = {0};
+  std::vector<int> writers;
+  std::vector<PollRequest> requests;
+  for (int i = 0; i < kFds; ++i) {
+    int pipe_fd[2] = {-1, -1};
+    ASSERT_EQ(pipe(pipe_fd), 0);
+    ASSERT_EQ(fcntl(pipe_fd[0], F_SETFL, O_NONBLOCK), 0);
+    PollRequest request;
+    request.fd = pipe_fd[0];
+    request.events = EPOLLIN | EPOLLET;
+    request.callback = [fd = pipe_fd[0], &received](const PollResponse&) {
+      char buf[64];
+      ssize_t n = 0;
+      while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        received.fetch_add(n, std::memory_order_relaxed);
+      }
+    };
+    ASSERT_TRUE(reactor.Register(request));
+    requests.push_back(request);
+    writers.push_back(pipe_fd[1]);
+  }
+
+  auto run = [&](int rounds) {
+    auto target = received.load() + rounds;
+    for (int i = 0; i < rounds; ++i) {
+      char c = 'C';
+      ASSERT_EQ(write(writers[i % kFds], &c, 1), 1);
+    }
+    while (received.load() < target) {
+      std::this_thread::yield();
+    }
+  };
+  run(kWarmup);
+
+  auto allocs = g_allocs.load();
+  auto begin = std::chrono::steady_clock::now();
+  run(kRounds);
+  auto end = std::chrono::steady_clock::now();
+  auto loop_allocs = g_allocs.load() - allocs;
+  auto ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+  std::cout << reactor.BackendName() << ": " << kRounds << " wakeups over "
+            << kFds << " fds, " << ns / kRounds << " ns/wakeup, "
+            << loop_allocs << " allocations" << std::endl;
+  EXPECT_EQ(loop_allocs, 0u);
+
+  for (int i = 0; i < kFds; ++i) {
+    reactor.Unregister(requests[i]);
+    close(requests[i].fd);
+    close(writers[i]);
+  }
+  reactor.Shutdown();
+}
+
+TEST(PollerBench, epoll) { RunBench(PollBackendType::EPOLL); }
+
+TEST(PollerBench, io_uring) { RunBench(PollBackendType::IO_URING); }
+
+}  // namespace io
+}  // namespace bats
@@ -3,13 +3,95 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <thread>
 
 #include "gtest/gtest.h"
 
-namespace base {
+namespace bats {
 namespace io {
 
+// wait up to a second for `done`.
+static bool WaitFor(const std::function<bool()>& done) {
+  for (int i = 0; i < 1000 && !done(); i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return done();
+}
+
+// the timer tests run first, `operation` shuts the poller down.
+TEST(PollerTest, timer_fire) {
+  auto poller = Poller::Instance();
+  std::atomic<int> fired = {0};
+  std::atomic<uint64_t> expirations = {0};
+  int id = poller->AddTimer(1000, 0, [&](uint64_t n) {
+    expirations += n;
+    fired++;
+  });
+  ASSERT_GE(id, 0);
+  EXPECT_TRUE(WaitFor([&]() { return fired == 1; }));
+  // one-shot.
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_EQ(fired, 1);
+  EXPECT_EQ(expirations, 1u);
+  EXPECT_TRUE(poller->CancelTimer(id));
+}
+
+TEST(PollerTest, timer_reset_before_expiry) {
+  auto poller = Poller::Instance();
+  std::atomic<int> fired = {0};
+  int id = poller->AddTimer(100 * 1000, 0, [&](uint64_t) { fired++; });
+  ASSERT_GE(id, 0);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  // pushed out past the first expiry.
+  ASSERT_TRUE(poller->ResetTimer(id, 300 * 1000));
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_EQ(fired, 0);
+  EXPECT_TRUE(WaitFor([&]() { return fired == 1; }));
+
+  // a 0 delay disarms it.
+  ASSERT_TRUE(poller->ResetTimer(id, 50 * 1000));
+  ASSERT_TRUE(poller->ResetTimer(id, 0));
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_EQ(fired, 1);
+  EXPECT_TRUE(poller->CancelTimer(id));
+}
+
+TEST(PollerTest, timer_cancel) {
+  auto poller = Poller::Instance();
+  std::atomic<int> fired = {0};
+  int id = poller->AddTimer(50 * 1000, 0, [&](uint64_t) { fired++; });
+  ASSERT_GE(id, 0);
+  EXPECT_TRUE(poller->CancelTimer(id));
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_EQ(fired, 0);
+  EXPECT_FALSE(poller->CancelTimer(id));
+  EXPECT_FALSE(poller->ResetTimer(id, 1000));
+}
+
+TEST(PollerTest, timer_cancel_in_callback) {
+  auto poller = Poller::Instance();
+  std::atomic<int> fired = {0};
+  std::atomic<int> id = {-1};
+  std::atomic<bool> cancelled = {false};
+  // periodic, it runs no more once it cancels itself.
+  id = poller->AddTimer(1000, 1000, [&](uint64_t) {
+    fired++;
+    while (id < 0) {
+      std::this_thread::yield();
+    }
+    cancelled = poller->CancelTimer(id);
+  });
+  ASSERT_GE(id, 0);
+  EXPECT_TRUE(WaitFor([&]() { return fired > 0; }));
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_EQ(fired, 1);
+  EXPECT_TRUE(cancelled);
+  EXPECT_FALSE(poller->CancelTimer(id));
+}
+
 TEST(PollerTest, operation) {
   auto poller = Poller::Instance();
   std::this_thread::sleep_for(std::chrono::milliseconds(10));
@@ -31,8 +113,7 @@ TEST(PollerTest, operation) {
 
   // timeout_ms is 0
   PollResponse response(123);
-  request.callback = [&response](const PollResponse& rsp,
-                                 bats::util::Service_ptr& ser) {
+  request.callback = [&response](const PollResponse& rsp) {
     response = rsp;
   };
   EXPECT_TRUE(poller->Register(request));
@@ -75,7 +156,7 @@ TEST(PollerTest, operation) {
   request.fd = pipe_fd[0];
   request.events = EPOLLIN | EPOLLET;
   request.timeout_ms = 0;
-  request.callback = [](const PollResponse&, bats::util::Service_ptr& ser) {};
+  request.callback = [](const PollResponse&) {};
   // poller->has been shutdown
   EXPECT_FALSE(poller->Register(request));
   EXPECT_FALSE(poller->Unregister(request));
@@ -85,7 +166,7 @@ TEST(PollerTest, operation) {
 }
 
 }  // namespace io
-}  // namespace base
+}  // namespace bats
 
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
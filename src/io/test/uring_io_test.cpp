@@ -0,0 +1,112 @@
+#include "uring_io.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace bats {
+namespace io {
+
+// the ring fd turns readable on a completion.
+static bool WaitRing(const UringReader& reader) {
+  pollfd pfd{reader.RingFd(), POLLIN, 0};
+  return poll(&pfd, 1, 1000) == 1;
+}
+
+// read `fd` by a reader of 4 buffers of 16 bytes, each read is recorded and
+// its buffer lent again.
+static void ExpectReads(int fd, int in, bool socket) {
+  auto reader = UringReader::Make(fd, socket, 4);
+  if (!reader) {
+    // an older kernel, the nodes fall back to epoll and syscalls.
+    return;
+  }
+  std::vector<std::vector<char>> bufs(4, std::vector<char>(16));
+  for (int bid = 0; bid < 4; bid++) {
+    reader->Provide(bid, bufs[bid].data(), bufs[bid].size());
+  }
+  // the wake-up arms the read, nothing is read yet.
+  ASSERT_TRUE(WaitRing(*reader));
+  auto record = [&](std::string* data) {
+    return [&bufs, &reader, data](int bid, int len) {
+      data->append(bufs[bid].data(), len);
+      data->push_back('|');
+      reader->Provide(bid, bufs[bid].data(), bufs[bid].size());
+    };
+  };
+  std::string data;
+  EXPECT_EQ(reader->Read(8, record(&data)), -1);
+  EXPECT_EQ(errno, EAGAIN);
+
+  // more reads than buffers, a read is re-armed once they run out.
+  for (int i = 0; i < 6; i++) {
+    auto msg = std::to_string(i);
+    ASSERT_EQ(write(in, msg.data(), msg.size()),
+              static_cast<ssize_t>(msg.size()));
+    ASSERT_TRUE(WaitRing(*reader));
+    ASSERT_EQ(reader->Read(1, record(&data)), 1);
+  }
+  EXPECT_EQ(data, "0|1|2|3|4|5|");
+  EXPECT_EQ(reader->Read(8, record(&data)), -1);
+}
+
+TEST(UringIoTest, read_socket) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds), 0);
+  ExpectReads(fds[0], fds[1], true);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(UringIoTest, read_pipe) {
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  ExpectReads(fds[0], fds[1], false);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(UringIoTest, write_batch) {
+  auto writer = UringWriter::ThreadLocal();
+  if (writer == nullptr) {
+    return;
+  }
+  EXPECT_EQ(writer, UringWriter::ThreadLocal());
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  std::vector<std::string> msgs;
+  std::vector<iovec> iovs;
+  std::string all;
+  // more than the ring holds, it's flushed in between.
+  for (int i = 0; i < 200; i++) {
+    msgs.push_back(std::to_string(i) + ",");
+    all += msgs.back();
+  }
+  iovs.reserve(msgs.size() + 1);
+  for (auto& msg : msgs) {
+    iovs.push_back({&msg[0], msg.size()});
+    writer->Writev(fds[1], &iovs.back(), 1);
+  }
+  EXPECT_EQ(writer->Flush(), 200 - 128);
+  // the writes land in order.
+  std::vector<char> buf(all.size());
+  ASSERT_EQ(read(fds[0], buf.data(), buf.size()),
+            static_cast<ssize_t>(all.size()));
+  EXPECT_EQ(std::string(buf.data(), buf.size()), all);
+  // a failed write is not counted.
+  iovs.push_back({buf.data(), 1});
+  writer->Writev(-1, &iovs.back(), 1);
+  EXPECT_EQ(writer->Flush(), 0);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+}  // namespace io
+}  // namespace bats
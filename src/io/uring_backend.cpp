@@ -0,0 +1,128 @@
+#include "uring_backend.h"
+
+#include <glog/logging.h>
+#include <sys/epoll.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace bats {
+namespace io {
+
+bool UringBackend::Init() {
+  if (!ring_.Init(kEntries)) {
+    return false;
+  }
+  // RSRC_TAGS comes with 5.13, the first kernel with multishot poll.
+  const unsigned features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG |
+                            IORING_FEAT_RSRC_TAGS;
+  if ((ring_.Features() & features) != features) {
+    LOG(INFO) << "io_uring lacks features, " << ring_.Features();
+    return false;
+  }
+  return true;
+}
+
+void UringBackend::PollAdd(int fd, const Watch& watch) {
+  auto sqe = ring_.GetSqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = watch.events & ~(EPOLLET | EPOLLONESHOT);
+  // a multishot poll is edge triggered, a level triggered fd is polled by a
+  // oneshot which is armed again after each completion.
+  if (watch.events & EPOLLET) {
+    sqe->len = IORING_POLL_ADD_MULTI;
+  }
+  sqe->user_data = UserData(fd, watch.gen);
+}
+
+void UringBackend::PollRemove(int fd, const Watch& watch) {
+  auto sqe = ring_.GetSqe();
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->fd = -1;
+  sqe->addr = UserData(fd, watch.gen);
+  sqe->user_data = kRemoveData;
+}
+
+bool UringBackend::Control(const PollCtrlParam& param) {
+  if (param.fd < 0) {
+    errno = EBADF;
+    return false;
+  }
+  if (param.fd >= static_cast<int>(watches_.size())) {
+    watches_.resize(param.fd + 1);
+  }
+  auto& watch = watches_[param.fd];
+  switch (param.operation) {
+    case EPOLL_CTL_ADD:
+    case EPOLL_CTL_MOD:
+      if (watch.gen != 0) {
+        PollRemove(param.fd, watch);
+      }
+      watch.events = param.event.events;
+      watch.gen = ++gen_;
+      PollAdd(param.fd, watch);
+      return true;
+    case EPOLL_CTL_DEL:
+      if (watch.gen == 0) {
+        errno = ENOENT;
+        return false;
+      }
+      PollRemove(param.fd, watch);
+      watch.gen = 0;
+      return true;
+    default:
+      errno = EINVAL;
+      return false;
+  }
+}
+
+int UringBackend::Wait(PollEvent* events, int max_events, int timeout_ms) {
+  // nothing completed yet, submit the changes and wait
+  if (ring_.PeekCqe() == nullptr) {
+    if (ring_.Enter(1, timeout_ms) < 0 && errno != ETIME) {
+      return -1;
+    }
+  } else if (ring_.Pending() > 0) {
+    ring_.Enter(0, 0);
+  }
+
+  int ready_num = 0;
+  io_uring_cqe* cqe = nullptr;
+  while (ready_num < max_events && (cqe = ring_.PeekCqe()) != nullptr) {
+    auto user_data = cqe->user_data;
+    int res = cqe->res;
+    bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    ring_.SeenCqe();
+    if (user_data == kRemoveData) {
+      continue;
+    }
+    int fd = static_cast<int>(user_data & 0xffffffff);
+    auto gen = static_cast<uint32_t>(user_data >> 32);
+    auto watch = FindWatch(fd);
+    if (watch == nullptr || watch->gen != gen) {
+      continue;
+    }
+    if (res < 0) {
+      if (res != -ECANCELED) {
+        LOG(INFO) << "io_uring poll fd " << fd << " failed, "
+                  << strerror(-res);
+      }
+      watch->gen = 0;
+      continue;
+    }
+    events[ready_num].fd = fd;
+    events[ready_num].events = static_cast<uint32_t>(res);
+    ready_num++;
+    // a oneshot completed, or the kernel ended the multishot, e.g. on cq
+    // overflow, arm it again
+    if (!more) {
+      watch->gen = ++gen_;
+      PollAdd(fd, *watch);
+    }
+  }
+  return ready_num;
+}
+
+}  // namespace io
+}  // namespace bats
@@ -0,0 +1,57 @@
+#ifndef BATS_IO_URING_BACKEND_H_
+#define BATS_IO_URING_BACKEND_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "poll_backend.h"
+#include "uring_ring.h"
+namespace bats {
+namespace io {
+
+// An io_uring reactor backend without liburing. Every fd is watched by a
+// multishot IORING_OP_POLL_ADD, and the pending control ops are submitted by
+// the same `io_uring_enter` which waits for completions, so arming an fd
+// costs no syscall of its own. It needs linux 5.13 for multishot poll.
+class UringBackend : public PollBackend {
+ public:
+  UringBackend() = default;
+  ~UringBackend() override = default;
+
+  bool Init() override;
+  bool Control(const PollCtrlParam& param) override;
+  int Wait(PollEvent* events, int max_events, int timeout_ms) override;
+  const char* Name() const override { return "io_uring"; }
+
+ private:
+  UringBackend(UringBackend const&) = delete;
+  UringBackend& operator=(UringBackend const&) = delete;
+
+  struct Watch {
+    uint32_t events = 0;
+    // 0 if the fd isn't watched
+    uint32_t gen = 0;
+  };
+  Watch* FindWatch(int fd) {
+    return fd < static_cast<int>(watches_.size()) ? &watches_[fd] : nullptr;
+  }
+  void PollAdd(int fd, const Watch& watch);
+  void PollRemove(int fd, const Watch& watch);
+  static uint64_t UserData(int fd, uint32_t gen) {
+    return (static_cast<uint64_t>(gen) << 32) | static_cast<uint32_t>(fd);
+  }
+
+  UringRing ring_;
+  // indexed by fd, a cqe of an older generation of the fd is stale
+  std::vector<Watch> watches_;
+  uint32_t gen_ = 0;
+
+  const unsigned kEntries = 256;
+  // the user_data of a removal, its cqe is dropped
+  const uint64_t kRemoveData = ~0ULL;
+};
+
+}  // namespace io
+}  // namespace bats
+
+#endif  // BATS_IO_URING_BACKEND_H_
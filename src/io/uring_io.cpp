@@ -0,0 +1,198 @@
+#include "uring_io.h"
+
+#include <glog/logging.h>
+#include <sys/mman.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace bats {
+namespace io {
+
+namespace {
+// IORING_OP_READ_MULTISHOT of linux 6.7, newer than some headers.
+const unsigned kOpReadMultishot = IORING_OP_SENDMSG_ZC + 1;
+}  // namespace
+
+UringReader::~UringReader() {
+  if (bufs_ != nullptr) {
+    munmap(bufs_, bufs_size_);
+  }
+}
+
+std::unique_ptr<UringReader> UringReader::Make(int fd, bool socket,
+                                               int buffers) {
+  if (buffers <= 0 || (buffers & (buffers - 1)) != 0) {
+    LOG(ERROR) << "io_uring buffers must be a power of 2, " << buffers;
+    return nullptr;
+  }
+  std::unique_ptr<UringReader> reader(new UringReader());
+  // a read holds a buffer till its cqe is taken, they all fit the cq.
+  if (!reader->ring_.Init(4, 2 * buffers)) {
+    return nullptr;
+  }
+  // IORING_OP_SEND_ZC came with multishot recv in linux 6.0.
+  unsigned op = socket ? IORING_OP_SEND_ZC : kOpReadMultishot;
+  if ((reader->ring_.Features() & IORING_FEAT_EXT_ARG) == 0 ||
+      !reader->ring_.Supports(op)) {
+    LOG(INFO) << "io_uring lacks multishot reads";
+    return nullptr;
+  }
+  reader->fd_ = fd;
+  reader->socket_ = socket;
+  reader->mask_ = buffers - 1;
+  reader->bufs_size_ = buffers * sizeof(io_uring_buf);
+  void* bufs = mmap(nullptr, reader->bufs_size_, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufs == MAP_FAILED) {
+    LOG(INFO) << "io_uring buffer ring mmap failed, " << strerror(errno);
+    return nullptr;
+  }
+  reader->bufs_ = static_cast<io_uring_buf*>(bufs);
+  io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<uint64_t>(bufs);
+  reg.ring_entries = buffers;
+  reg.bgid = kGroup;
+  if (!reader->ring_.Register(IORING_REGISTER_PBUF_RING, &reg, 1)) {
+    LOG(INFO) << "io_uring buffer ring failed, " << strerror(errno);
+    return nullptr;
+  }
+  // the reactor arms the read on the wake-up, it runs the request then.
+  auto sqe = reader->ring_.GetSqe();
+  sqe->opcode = IORING_OP_NOP;
+  sqe->user_data = kWakeData;
+  if (reader->ring_.Enter(0) < 0) {
+    LOG(INFO) << "io_uring enter failed, " << strerror(errno);
+    return nullptr;
+  }
+  return reader;
+}
+
+void UringReader::Provide(int bid, void* addr, int len) {
+  // not `io_uring_buf_ring::bufs`, whose empty struct before it moves it
+  // off the start of the ring in C++.
+  auto& buf = bufs_[tail_ & mask_];
+  buf.addr = reinterpret_cast<uint64_t>(addr);
+  buf.len = len;
+  buf.bid = bid;
+  tail_++;
+  auto ring = reinterpret_cast<io_uring_buf_ring*>(bufs_);
+  __atomic_store_n(&ring->tail, tail_, __ATOMIC_RELEASE);
+}
+
+void UringReader::Arm() {
+  auto sqe = ring_.GetSqe();
+  sqe->fd = fd_;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = kGroup;
+  sqe->user_data = kReadData;
+  if (socket_) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+  } else {
+    sqe->opcode = kOpReadMultishot;
+  }
+  if (ring_.Enter(0) < 0) {
+    LOG(ERROR) << "io_uring enter failed, " << strerror(errno);
+    return;
+  }
+  armed_ = true;
+}
+
+int UringReader::Read(int max, const std::function<void(int, int)>& f) {
+  int num = 0;
+  int err = EAGAIN;
+  io_uring_cqe* cqe;
+  while (num < max && (cqe = ring_.PeekCqe()) != nullptr) {
+    uint64_t data = cqe->user_data;
+    int res = cqe->res;
+    uint32_t flags = cqe->flags;
+    ring_.SeenCqe();
+    if (data != kReadData) {
+      continue;
+    }
+    // the request ends on an error or when the buffers run out
+    if ((flags & IORING_CQE_F_MORE) == 0) {
+      armed_ = false;
+    }
+    if (flags & IORING_CQE_F_BUFFER) {
+      f(flags >> IORING_CQE_BUFFER_SHIFT, res < 0 ? 0 : res);
+      num++;
+    } else if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+      err = -res;
+    }
+  }
+  // the buffers are given back by `f`, a read which ran out of them goes on.
+  if (!armed_) {
+    Arm();
+  }
+  if (num == 0) {
+    errno = err;
+    return -1;
+  }
+  return num;
+}
+
+UringWriter* UringWriter::ThreadLocal() {
+  thread_local std::unique_ptr<UringWriter> writer;
+  thread_local bool tried = false;
+  if (!tried) {
+    tried = true;
+    writer.reset(new UringWriter());
+    if (!writer->ring_.Init(kEntries) ||
+        (writer->ring_.Features() & IORING_FEAT_EXT_ARG) == 0) {
+      LOG(INFO) << "io_uring writes are off, writev is used";
+      writer.reset();
+    }
+  }
+  return writer && !writer->broken_ ? writer.get() : nullptr;
+}
+
+void UringWriter::Writev(int fd, const iovec* iov, int iovcnt) {
+  if (queued_ == kEntries) {
+    Flush();
+  }
+  auto sqe = ring_.GetSqe();
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(iov);
+  sqe->len = iovcnt;
+  // the current position, a tun or a socket has none
+  sqe->off = -1;
+  queued_++;
+}
+
+int UringWriter::Flush() {
+  unsigned done = 0;
+  int written = 0;
+  int err = 0;
+  while (done < queued_) {
+    auto cqe = ring_.PeekCqe();
+    if (cqe == nullptr) {
+      if (ring_.Enter(queued_ - done) < 0 && errno != EINTR &&
+          errno != EAGAIN && errno != EBUSY) {
+        // the unsubmitted writes point to data the caller frees
+        LOG(ERROR) << "io_uring enter failed, " << strerror(errno);
+        broken_ = true;
+        break;
+      }
+      continue;
+    }
+    if (cqe->res < 0) {
+      err = -cqe->res;
+    } else {
+      written++;
+    }
+    ring_.SeenCqe();
+    done++;
+  }
+  if (err != 0) {
+    LOG(INFO) << "write errors, " << strerror(err);
+  }
+  queued_ = 0;
+  return written;
+}
+
+}  // namespace io
+}  // namespace bats
@@ -0,0 +1,86 @@
+#ifndef BATS_IO_URING_IO_H_
+#define BATS_IO_URING_IO_H_
+
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include "uring_ring.h"
+namespace bats {
+namespace io {
+
+// Reads an fd by one multishot request into a ring of provided buffers: the
+// kernel picks a buffer per datagram or packet and posts a completion, no
+// syscall is made per read. The ring fd turns readable on completions, so it
+// is watched by the poller in place of the fd. Used by one thread at a time.
+class UringReader {
+ public:
+  ~UringReader();
+
+  // A reader of `fd` with `buffers` buffers (a power of 2), nullptr if the
+  // kernel lacks it: a socket needs multishot recv of linux 6.0, other fds
+  // multishot read of linux 6.7. The request is armed by the first `Read`,
+  // a completion is posted to wake it.
+  static std::unique_ptr<UringReader> Make(int fd, bool socket, int buffers);
+  int RingFd() const { return ring_.Fd(); }
+  // Lend the buffer `bid` to the kernel, every buffer before the first
+  // `Read` and again once the data of its read is taken.
+  void Provide(int bid, void* addr, int len);
+  // Take up to `max` completed reads, `f(bid, len)` for each. Return the
+  // reads taken, or -1 with errno set, EAGAIN if there is none.
+  int Read(int max, const std::function<void(int bid, int len)>& f);
+
+ private:
+  UringReader() = default;
+  UringReader(UringReader const&) = delete;
+  UringReader& operator=(UringReader const&) = delete;
+
+  void Arm();
+
+  UringRing ring_;
+  int fd_ = -1;
+  bool socket_ = false;
+  bool armed_ = false;
+  // the ring of buffers, its tail overlays a field of the first
+  io_uring_buf* bufs_ = nullptr;
+  size_t bufs_size_ = 0;
+  unsigned mask_ = 0;
+  uint16_t tail_ = 0;
+
+  static const uint16_t kGroup = 0;
+  static const uint64_t kReadData = 1;
+  static const uint64_t kWakeData = 2;
+};
+
+// Queues writes to any fds and submits them by one `io_uring_enter`, in
+// place of a `writev` each. Used by the thread which owns it.
+class UringWriter {
+ public:
+  // The writer of the calling thread, nullptr if the kernel lacks io_uring.
+  static UringWriter* ThreadLocal();
+  // Queue a write of `iov` to `fd`. The iovs and their data must live until
+  // `Flush`, which may be called by it once the ring is full.
+  void Writev(int fd, const iovec* iov, int iovcnt);
+  // Submit the queued writes and wait for them. Return the ones which
+  // succeeded.
+  int Flush();
+
+ private:
+  UringWriter() = default;
+  UringWriter(UringWriter const&) = delete;
+  UringWriter& operator=(UringWriter const&) = delete;
+
+  UringRing ring_;
+  unsigned queued_ = 0;
+  // a failed submission leaves the ring unusable, the writes fall back
+  bool broken_ = false;
+
+  static const unsigned kEntries = 128;
+};
+
+}  // namespace io
+}  // namespace bats
+
+#endif  // BATS_IO_URING_IO_H_
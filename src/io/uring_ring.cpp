@@ -0,0 +1,154 @@
+#include "uring_ring.h"
+
+#include <glog/logging.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+namespace bats {
+namespace io {
+
+namespace {
+unsigned LoadAcquire(const unsigned* p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+void StoreRelease(unsigned* p, unsigned v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+}  // namespace
+
+UringRing::~UringRing() {
+  if (sqes_ != nullptr) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (sq_ring_ != nullptr) {
+    munmap(sq_ring_, ring_size_);
+  }
+  if (ring_fd_ >= 0) {
+    close(ring_fd_);
+  }
+}
+
+bool UringRing::Init(unsigned entries, unsigned cq_entries) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  if (cq_entries > 0) {
+    params.flags |= IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+  }
+  ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring_fd_ < 0) {
+    LOG(INFO) << "io_uring setup failed, " << strerror(errno);
+    return false;
+  }
+  features_ = params.features;
+  // the sq and cq rings share one mapping since 5.4.
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+    LOG(INFO) << "io_uring lacks features, " << params.features;
+    return false;
+  }
+
+  ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (cq_size > ring_size_) {
+    ring_size_ = cq_size;
+  }
+  sq_ring_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = nullptr;
+    LOG(INFO) << "io_uring mmap failed, " << strerror(errno);
+    return false;
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  auto sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    LOG(INFO) << "io_uring mmap failed, " << strerror(errno);
+    return false;
+  }
+  sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+  auto sq = static_cast<char*>(sq_ring_);
+  sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  sq_entries_ = params.sq_entries;
+  cq_head_ = reinterpret_cast<unsigned*>(sq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(sq + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned*>(sq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(sq + params.cq_off.cqes);
+  return true;
+}
+
+io_uring_sqe* UringRing::GetSqe() {
+  auto tail = *sq_tail_;
+  if (tail - LoadAcquire(sq_head_) >= sq_entries_) {
+    // the submission queue is full, flush it
+    Enter(0, 0);
+  }
+  auto index = tail & *sq_mask_;
+  auto sqe = &sqes_[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array_[index] = index;
+  StoreRelease(sq_tail_, tail + 1);
+  to_submit_++;
+  return sqe;
+}
+
+int UringRing::Enter(unsigned min_complete, int timeout_ms) {
+  unsigned flags = 0;
+  __kernel_timespec ts;
+  io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if (min_complete > 0) {
+    flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    if (timeout_ms >= 0) {
+      ts.tv_sec = timeout_ms / 1000;
+      ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+      arg.ts = reinterpret_cast<uint64_t>(&ts);
+    }
+  }
+  int ret = syscall(__NR_io_uring_enter, ring_fd_, to_submit_, min_complete,
+                    flags, flags == 0 ? nullptr : &arg, sizeof(arg));
+  if (ret > 0) {
+    to_submit_ -= ret;
+  }
+  return ret;
+}
+
+io_uring_cqe* UringRing::PeekCqe() {
+  auto head = *cq_head_;
+  if (head == LoadAcquire(cq_tail_)) {
+    return nullptr;
+  }
+  return &cqes_[head & *cq_mask_];
+}
+
+void UringRing::SeenCqe() { StoreRelease(cq_head_, *cq_head_ + 1); }
+
+bool UringRing::Register(unsigned opcode, void* arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, ring_fd_, opcode, arg, nr_args) >= 0;
+}
+
+bool UringRing::Supports(unsigned opcode) {
+  const unsigned kOps = 256;
+  std::vector<char> buf(sizeof(io_uring_probe) +
+                        kOps * sizeof(io_uring_probe_op));
+  auto probe = reinterpret_cast<io_uring_probe*>(buf.data());
+  if (!Register(IORING_REGISTER_PROBE, probe, kOps)) {
+    return false;
+  }
+  return opcode <= probe->last_op &&
+         (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+}
+
+}  // namespace io
+}  // namespace bats
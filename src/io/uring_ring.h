@@ -0,0 +1,67 @@
+#ifndef BATS_IO_URING_RING_H_
+#define BATS_IO_URING_RING_H_
+
+#include <linux/io_uring.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace bats {
+namespace io {
+
+// The submission and completion rings of an io_uring instance, mapped
+// without liburing. It's used by one thread at a time.
+class UringRing {
+ public:
+  UringRing() = default;
+  ~UringRing();
+
+  // `cq_entries` is twice `entries` if it's 0.
+  bool Init(unsigned entries, unsigned cq_entries = 0);
+  int Fd() const { return ring_fd_; }
+  uint32_t Features() const { return features_; }
+  // A zeroed sqe, the queue is submitted first if it's full.
+  io_uring_sqe* GetSqe();
+  // The sqes queued since the last `Enter`.
+  unsigned Pending() const { return to_submit_; }
+  // Submit the queued sqes, and wait up to `timeout_ms` (-1 for ever) for
+  // `min_complete` completions. Return the sqes submitted, or -1 with errno
+  // set.
+  int Enter(unsigned min_complete, int timeout_ms = -1);
+  // The oldest completion, nullptr if there is none.
+  io_uring_cqe* PeekCqe();
+  // Consume the cqe of `PeekCqe`.
+  void SeenCqe();
+  // `io_uring_register`, return false with errno set on failure.
+  bool Register(unsigned opcode, void* arg, unsigned nr_args);
+  // Whether the kernel knows `opcode`.
+  bool Supports(unsigned opcode);
+
+ private:
+  UringRing(UringRing const&) = delete;
+  UringRing& operator=(UringRing const&) = delete;
+
+  int ring_fd_ = -1;
+  uint32_t features_ = 0;
+  void* sq_ring_ = nullptr;
+  size_t ring_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_mask_ = nullptr;
+  unsigned* sq_array_ = nullptr;
+  unsigned sq_entries_ = 0;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned* cq_mask_ = nullptr;
+  io_uring_cqe* cqes_ = nullptr;
+
+  unsigned to_submit_ = 0;
+};
+
+}  // namespace io
+}  // namespace bats
+
+#endif  // BATS_IO_URING_RING_H_
@@ -10,6 +10,12 @@
  */
 #ifndef SRC_EXAMPLE_APP_SRC_CHANNEL_H_
 #define SRC_EXAMPLE_APP_SRC_CHANNEL_H_
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
+
 #include "macros.h"
 #include "msg.h"
 #include "queue.h"
@@ -24,7 +30,13 @@ class BaseChannel {
   BaseChannel() = default;
   virtual ~BaseChannel() = default;
   virtual void ReadMessage(T& msg) = 0;
-  virtual void WriteMessage(const T& msg) = 0;
+  /**
+   * @brief Write a message, wait while the channel is full.
+   *
+   * @return false Return false if the wait is broken, e.g. by
+   * `Queue::Interrupt`, then the message is not written.
+   */
+  virtual bool WriteMessage(const T& msg) = 0;
   virtual std::string Id() = 0;
 };
 
@@ -36,15 +48,115 @@ class BaseChannel {
 template <typename T>
 class QueueBasedChannel : public BaseChannel<T> {
  public:
-  explicit QueueBasedChannel(const std::string& name) : queue_(name, 100) {}
+  using CreditCallback = std::function<void()>;
+  explicit QueueBasedChannel(const std::string& name, int capacity = 100)
+      : queue_(name, capacity) {
+    SetWatermark(queue_.Capacity(), queue_.Capacity() / 2);
+  }
   virtual ~QueueBasedChannel() = default;
-  inline void ReadMessage(T& msg) override { queue_.WaitDequeue(msg); }
-  inline void WriteMessage(const T& msg) override { queue_.WaitEnqueue(msg); }
+  inline void ReadMessage(T& msg) override {
+    queue_.WaitDequeue(msg);
+    ReturnCredit();
+  }
+  inline bool WriteMessage(const T& msg) override {
+    return queue_.WaitEnqueue(msg);
+  }
+  /**
+   * @brief Read a message and call `on_read` in the same critical section as
+   * the dequeue. Used by order-preserving nodes to number their ingress.
+   */
+  template <typename F>
+  inline void ReadMessage(T& msg, F&& on_read) {
+    queue_.WaitDequeue(msg, std::forward<F>(on_read));
+    ReturnCredit();
+  }
+  /**
+   * @brief Write a message without wait.
+   *
+   * @return true Return true if the message is enqueued.
+   * @return false Return false if the channel is full.
+   */
+  inline bool TryWriteMessage(const T& msg) { return queue_.TryEnqueue(msg); }
+  /**
+   * @brief Read a message without wait.
+   *
+   * @return false Return false if the channel is empty.
+   */
+  inline bool TryReadMessage(T& msg) {
+    if (!queue_.TryDequeue(msg)) {
+      return false;
+    }
+    ReturnCredit();
+    return true;
+  }
+  /**
+   * @brief An eventfd which is readable once the channel has msgs, see
+   * `Queue::EnableEventFd`.
+   *
+   * @return int -1 on failure.
+   */
+  int EnableEventFd() { return queue_.EnableEventFd(); }
+  /**
+   * @brief Credit-based flow control. A producer owns credits while the depth
+   * of the channel is below the high watermark. Once it runs out of credits it
+   * asks to be called back by `OnCredit`, the consumer fires the callbacks when
+   * it has drained the channel down to the low watermark.
+   *
+   * @param high The depth where the producer runs out of credits.
+   * @param low The depth where the credits are returned to the producer.
+   */
+  void SetWatermark(int high, int low) {
+    high_watermark_ = std::min(high, queue_.Capacity());
+    low_watermark_ = std::min(low, high_watermark_ - 1);
+  }
+  inline int Credits() { return high_watermark_ - queue_.Size(); }
+  inline bool HasCredit() { return Credits() > 0; }
+  /**
+   * @brief Register an one-shot callback which is fired once the channel has
+   * credits again. It may be fired immediately by the calling thread.
+   *
+   * @param cb
+   */
+  void OnCredit(const CreditCallback& cb) {
+    {
+      std::lock_guard<std::mutex> lg(credit_mutex_);
+      credit_waiters_.push_back(cb);
+      starved_.store(true);
+    }
+    // the consumer may have drained the channel before we were registered.
+    if (HasCredit()) {
+      FireCredit();
+    }
+  }
   virtual std::string Id() { return queue_.Id(); }
   virtual Queue<T>& GetQueue() { return queue_; }
 
  private:
+  inline void ReturnCredit() {
+    if (unlikely(starved_.load())) {
+      if (queue_.Size() <= low_watermark_) {
+        FireCredit();
+      }
+    }
+  }
+  void FireCredit() {
+    std::vector<CreditCallback> waiters;
+    {
+      std::lock_guard<std::mutex> lg(credit_mutex_);
+      waiters.swap(credit_waiters_);
+      starved_.store(false);
+    }
+    for (auto& cb : waiters) {
+      cb();
+    }
+  }
+
   Queue<T> queue_;
+  int high_watermark_ = 0;
+  int low_watermark_ = 0;
+  std::atomic<bool> starved_ = {false};
+  std::mutex credit_mutex_;
+  std::vector<CreditCallback> credit_waiters_;
   DISALLOW_COPY_AND_ASSIGN(QueueBasedChannel)
 };
 
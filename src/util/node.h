@@ -12,14 +12,19 @@
 #define SRC_EXAMPLE_APP_SRC_NODE_H_
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <utility>
 #include <vector>
 
 #include "macros.h"
 #include "types.h"
+#include "util/util.h"
 
 enum class NodeType {
   NODE_SOURCE,       // node without up channels.
@@ -27,6 +32,24 @@ enum class NodeType {
   NODE_FULL_DUPLEX,  //  like udp/tcp or tun service.
   NODE_RELAY,        // node process data from up channels.
 };
+
+/**
+ * @brief The load of a node since its first worker started.
+ *
+ */
+struct NodeStats {
+  uint64_t msgs = 0;        // the number of processed msgs.
+  uint64_t busy_ns = 0;     // the time spent on processing msgs.
+  uint64_t blocked_ns = 0;  // the time spent waiting on full down channels.
+  uint64_t running_ns = 0;  // the time since the node started.
+};
+
+enum class DispatchPolicy {
+  DISPATCH_BY_ID,        // select the down channel by `msg->id()`.
+  DISPATCH_ROUND_ROBIN,  // spread msgs evenly over the down channels.
+  DISPATCH_BY_FLOW       // select it by the addresses of the ip packet in the
+                         // msg, a flow sticks to one channel.
+};
 /**
  * @brief The object represents thoese things which may be used to receive and
  * send data at the same time.
@@ -43,6 +66,49 @@ class FullDuplex {
   int GetFd() const { return fd_; }
   virtual int FDRecv() = 0;
   virtual int FDWrite(const M& msg) = 0;
+  /**
+   * @brief The number of fds the object reads, e.g. the sockets of a port
+   * sharded by `SO_REUSEPORT`. Each is read on its own.
+   *
+   * @return int
+   */
+  virtual int Shards() const { return 1; }
+  virtual int ShardFd(int shard) const { return fd_; }
+  /**
+   * @brief The fd the poller watches for `shard`, the ring of an io_uring
+   * reader which reads `ShardFd` for it.
+   *
+   * @param shard
+   * @return int
+   */
+  virtual int PollFd(int shard) const { return ShardFd(shard); }
+  /**
+   * @brief Read up to `max_msgs` msgs from the fd of `shard` with as few
+   * syscalls as the fd allows.
+   *
+   * @param shard
+   * @param max_msgs
+   * @param msgs The number of msgs read.
+   * @return int The bytes read, or -1 with `errno` set as `FDRecv`.
+   */
+  virtual int FDRecvBatch(int shard, int max_msgs, int* msgs) {
+    *msgs = 1;
+    return FDRecv();
+  }
+  /**
+   * @brief Write `num` msgs with as few syscalls as the fd allows.
+   *
+   * @return int The number of msgs written.
+   */
+  virtual int FDWriteBatch(const M* msgs, int num) {
+    int written = 0;
+    for (int i = 0; i < num; i++) {
+      if (FDWrite(msgs[i]) >= 0) {
+        written++;
+      }
+    }
+    return written;
+  }
 
  protected:
   // The file descriptor
@@ -100,6 +166,7 @@ class Node {
    *
    */
   virtual void AddChannel(CHN& channel, ChnType ct = ChnType::CHN_OUT);
+  virtual void RemoveChannel(const CHN& channel, ChnType ct = ChnType::CHN_OUT);
   virtual CHN& GetChannel(int i, ChnType ct = ChnType::CHN_OUT);
   virtual int GetChannelNum(ChnType ct = ChnType::CHN_OUT) const;
   /**
@@ -123,6 +190,36 @@ class Node {
   virtual void HandleWritting(CHN& channel) {}
   // process the msg.
   virtual void HandleMsg(const msg_type& msg) = 0;
+  /**
+   * @brief How `Dispatch` selects a down channel.
+   *
+   * @param policy
+   */
+  void SetDispatchPolicy(DispatchPolicy policy) { dispatch_policy_ = policy; }
+  /**
+   * @brief Bind the threads of this node to `cpus` in turn. All the cpus are
+   * used in turn if it's empty.
+   *
+   * @param cpus
+   */
+  void SetCpuSet(const std::vector<int>& cpus) { cpus_ = cpus; }
+  /**
+   * @brief The load of this node. The average service time of a msg is
+   * `busy_ns / msgs`.
+   *
+   * @return NodeStats
+   */
+  NodeStats Stats() const {
+    NodeStats stats;
+    stats.msgs = msgs_.load(std::memory_order_relaxed);
+    stats.busy_ns = busy_ns_.load(std::memory_order_relaxed);
+    stats.blocked_ns = blocked_ns_.load(std::memory_order_relaxed);
+    auto start = start_ns_.load(std::memory_order_relaxed);
+    if (start != 0) {
+      stats.running_ns = NowNs() - start;
+    }
+    return stats;
+  }
   /**
    * @brief Thread affinty
    *
@@ -136,14 +233,122 @@ class Node {
   int IncThreads();
 
   void Stop();
+  /**
+   * @brief Let the workers exit without breaking the waits on the channels,
+   * which may be shared with the nodes that keep running. A worker blocked on
+   * a full down-channel keeps its msg for the next workers. The channels of a
+   * quiesced node can be changed once its workers are joined, then `Resume`
+   * it and start the workers again.
+   *
+   */
+  void Quiesce() {
+    is_stop_ = true;
+    for (int i = 0; i < GetChannelNum(ChnType::CHN_IN); i++) {
+      GetChannel(i, ChnType::CHN_IN)->GetQueue().Interrupt();
+    }
+    for (int i = 0; i < GetChannelNum(ChnType::CHN_OUT); i++) {
+      GetChannel(i, ChnType::CHN_OUT)->GetQueue().Interrupt();
+    }
+  }
+  void Resume() {
+    std::unique_lock<std::mutex> lg(mutex_);
+    worker_cnt_ = 0;
+    is_stop_ = false;
+  }
+  /**
+   * @brief Push the msgs which are buffered inside the node to its
+   * down-channels, e.g. before a warm restart.
+   *
+   */
+  virtual void Flush() {}
+  /**
+   * @brief Take the msgs stashed by a quiescence, e.g. to hand them off, in
+   * their order and with the channels they were written to.
+   *
+   * @return std::vector<std::pair<CHN, msg_type>>
+   */
+  std::vector<std::pair<CHN, msg_type>> TakeStashed() {
+    std::vector<std::pair<CHN, msg_type>> stashed;
+    std::lock_guard<std::mutex> lg(stash_mutex_);
+    stashed.swap(stashed_);
+    return stashed;
+  }
 
  protected:
+  static uint64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+  /**
+   * @brief Process `msgs` msgs and account the time spent on them. The time
+   * `WriteTo` waits for room in a full down-channel is not counted.
+   *
+   * @param f
+   * @param msgs
+   */
+  template <typename F>
+  inline void Measure(F&& f, uint64_t msgs = 1) {
+    auto begin = NowNs();
+    auto blocked = ThreadBlockedNs();
+    f();
+    blocked = ThreadBlockedNs() - blocked;
+    busy_ns_.fetch_add(NowNs() - begin - blocked, std::memory_order_relaxed);
+    msgs_.fetch_add(msgs, std::memory_order_relaxed);
+  }
+  // the time the calling thread has waited in `WriteTo`.
+  static uint64_t& ThreadBlockedNs() {
+    static thread_local uint64_t blocked_ns = 0;
+    return blocked_ns;
+  }
+  /**
+   * @brief The index of the down channel which `msg` goes to.
+   *
+   * @param msg
+   * @return int
+   */
+  int DispatchIndex(const msg_type& msg) {
+    if (dispatch_policy_ == DispatchPolicy::DISPATCH_ROUND_ROBIN) {
+      return rr_index_++ % GetChannelNum(ChnType::CHN_OUT);
+    }
+    if (dispatch_policy_ == DispatchPolicy::DISPATCH_BY_FLOW) {
+      auto hash = base::util::IpFlowHash(
+          reinterpret_cast<const char*>(msg->begin()), msg->size());
+      return hash % GetChannelNum(ChnType::CHN_OUT);
+    }
+    return msg->id() % GetChannelNum(ChnType::CHN_OUT);
+  }
+  /**
+   * @brief Write `msg` to a down-channel, wait while it's full. The wait is
+   * broken once the node is stopped or quiesced, then the msg is stashed.
+   *
+   * @param channel
+   * @param msg
+   */
+  void WriteTo(CHN& channel, const msg_type& msg);
+  /**
+   * @brief Dispatch the stashed msgs in their order, before any new one.
+   *
+   */
+  void DispatchStashed();
+
   std::mutex mutex_;
   // init state is in `stopped` state
   bool is_stop_ = true;
   int tid_ = 0;
   int worker_cnt_ = 0;
+  int bound_cnt_ = 0;
   std::string name_;
+  DispatchPolicy dispatch_policy_ = DispatchPolicy::DISPATCH_BY_ID;
+  std::atomic<uint32_t> rr_index_ = {0};
+  std::vector<int> cpus_;
+  std::atomic<uint64_t> msgs_ = {0};
+  std::atomic<uint64_t> busy_ns_ = {0};
+  std::atomic<uint64_t> blocked_ns_ = {0};
+  std::atomic<uint64_t> start_ns_ = {0};
+  // the msgs which were being written when the node was quiesced.
+  std::mutex stash_mutex_;
+  std::vector<std::pair<CHN, msg_type>> stashed_;
   // sink only have up channels
   std::vector<CHN> up_channels_;
   // source only have down channels.
@@ -178,6 +383,13 @@ void Node<CHN, type>::AddChannel(CHN& channel, ChnType ct) {
   channels.push_back(channel);
 }
 
+template <typename CHN, NodeType type>
+void Node<CHN, type>::RemoveChannel(const CHN& channel, ChnType ct) {
+  auto& channels = ((ct == ChnType::CHN_OUT) ? down_channels_ : up_channels_);
+  channels.erase(std::remove(channels.begin(), channels.end(), channel),
+                 channels.end());
+}
+
 template <typename CHN, NodeType type>
 CHN& Node<CHN, type>::GetChannel(int i, ChnType ct) {
   auto& channels = ((ct == ChnType::CHN_OUT) ? down_channels_ : up_channels_);
@@ -194,8 +406,52 @@ inline void Node<CHN, type>::Dispatch(const msg_type& msg) {
   if (GetChannelNum(ChnType::CHN_OUT) == 0) {
     return;
   }
-  auto id = msg->id() % GetChannelNum(ChnType::CHN_OUT);
-  GetChannel(id, ChnType::CHN_OUT)->WriteMessage(msg);
+  auto id = DispatchIndex(msg);
+  WriteTo(GetChannel(id, ChnType::CHN_OUT), msg);
+}
+
+template <typename CHN, NodeType type>
+void Node<CHN, type>::WriteTo(CHN& channel, const msg_type& msg) {
+  if (channel->TryWriteMessage(msg)) {
+    return;
+  }
+  auto begin = NowNs();
+  bool written = false;
+  // the wait is also broken when a node sharing the channel is quiesced, and
+  // for good when the consumer is stopped.
+  while (!(written = channel->WriteMessage(msg))) {
+    if (is_stop_ || channel->GetQueue().WaitBroken()) {
+      break;
+    }
+  }
+  auto waited = NowNs() - begin;
+  blocked_ns_.fetch_add(waited, std::memory_order_relaxed);
+  ThreadBlockedNs() += waited;
+  if (!written && is_stop_) {
+    std::lock_guard<std::mutex> lg(stash_mutex_);
+    stashed_.push_back({channel, msg});
+  }
+}
+
+template <typename CHN, NodeType type>
+void Node<CHN, type>::DispatchStashed() {
+  std::vector<std::pair<CHN, msg_type>> stashed;
+  {
+    std::lock_guard<std::mutex> lg(stash_mutex_);
+    stashed.swap(stashed_);
+  }
+  for (auto& item : stashed) {
+    bool attached = false;
+    for (int i = 0; i < GetChannelNum(ChnType::CHN_OUT) && !attached; i++) {
+      attached = GetChannel(i, ChnType::CHN_OUT) == item.first;
+    }
+    // the channel may be disconnected during the quiescence.
+    if (attached) {
+      WriteTo(item.first, item.second);
+    } else {
+      Dispatch(item.second);
+    }
+  }
 }
 
 template <typename CHN, NodeType type>
@@ -211,14 +467,19 @@ void Node<CHN, type>::HandlerRelaying(CHN& channel) {
     Dispatch(msg);
     return;
   }
-  HandleMsg(msg);
+  Measure([&]() { HandleMsg(msg); });
 }
 
 template <typename CHN, NodeType type>
 void Node<CHN, type>::DoWork() {
+  uint64_t zero = 0;
+  start_ns_.compare_exchange_strong(zero, NowNs());
   ThreadAffinity();
   auto chn_index = IncThreads();
   auto& channel = GetChannel(chn_index, ChnType::CHN_IN);
+  if (type != NodeType::NODE_FULL_DUPLEX) {
+    DispatchStashed();
+  }
   if (type == NodeType::NODE_FULL_DUPLEX) {
     std::function<void(CHN&)> handler =
         std::bind(&Node::HandleWritting, this, std::placeholders::_1);
@@ -250,22 +511,33 @@ void Node<CHN, type>::ThreadAffinity() {
   int g_max_processor_id = sysconf(_SC_NPROCESSORS_CONF);
   std::unique_lock<std::mutex> lg(mutex_);
   processor_id++;
+  int cpu = processor_id % g_max_processor_id;
   cpu_set_t cpuset;
+  if (!cpus_.empty()) {
+    cpu = cpus_[bound_cnt_++ % cpus_.size()];
+  } else if (sched_getaffinity(0, sizeof(cpuset), &cpuset) == 0 &&
+             CPU_COUNT(&cpuset) < g_max_processor_id) {
+    // stay within the cores the process is pinned to.
+    int nth = processor_id % CPU_COUNT(&cpuset);
+    for (cpu = 0; cpu < g_max_processor_id; cpu++) {
+      if (CPU_ISSET(cpu, &cpuset) && nth-- == 0) {
+        break;
+      }
+    }
+  }
   pthread_t thread = pthread_self();
 
   /* Set affinity mask to include CPUs 0 to g_max_processor_id - 1*/
   CPU_ZERO(&cpuset);
-  CPU_SET(processor_id % g_max_processor_id, &cpuset);
+  CPU_SET(cpu, &cpuset);
   auto s = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpuset);
   if (s != 0) {
-    LOG(WARNING) << "failed to set affinity on "
-                 << processor_id % g_max_processor_id;
+    LOG(WARNING) << "failed to set affinity on " << cpu;
   } else {
     std::stringstream ss;
     ss << std::this_thread::get_id();
     ss >> tid_;
-    LOG(INFO) << GetName() << " bind thread " << tid_ << " to "
-              << processor_id % g_max_processor_id;
+    LOG(INFO) << GetName() << " bind thread " << tid_ << " to " << cpu;
   }
 }
 
@@ -84,6 +84,24 @@ void Collector::HandleTimeoutBuffer(Timer_ptr timeout) {
   Dispatch(buf);
 }
 
+void Collector::Flush() {
+  std::vector<bats::util::BatsMsg_ptr> msg_to_encode;
+  std::unique_lock<std::mutex> lg(mutex_);
+  for (auto& item : bats_buffer_map_) {
+    auto buf = item.second->GetBuf();
+    if (buf == nullptr || buf->FilledBytes() <= 0) {
+      continue;
+    }
+    buf->resize(buf->FilledBytes());
+    item.second->ResetBuf();
+    msg_to_encode.push_back(buf);
+  }
+  lg.unlock();
+  for (auto& b : msg_to_encode) {
+    Dispatch(b);
+  }
+}
+
 /**
  * @brief Get the Bats Endpoint object according to the address of decoder.
  *
@@ -204,9 +222,9 @@ inline void Collector::Dispatch(const msg_type& msg) {
 
   if (msg->NeedCoded()) {
     auto id = msg->id() % encode_channles_.size();
-    encode_channles_.at(id)->WriteMessage(msg);
+    WriteTo(encode_channles_.at(id), msg);
   } else {
-    udp_channel_->WriteMessage(msg);
+    WriteTo(udp_channel_, msg);
   }
 }
 
@@ -34,7 +34,8 @@ namespace src {
  */
 class Collector : public Node<MsgChannelPtr, NodeType::NODE_RELAY> {
  public:
-  Collector() : Node<MsgChannelPtr, NodeType::NODE_RELAY>("collector") {
+  explicit Collector(const std::string& name = "collector")
+      : Node<MsgChannelPtr, NodeType::NODE_RELAY>(name) {
     if (!Init()) {
       throw std::runtime_error("Collector Service init failed.");
     }
@@ -43,9 +44,27 @@ class Collector : public Node<MsgChannelPtr, NodeType::NODE_RELAY> {
   // Node
   void HandleMsg(const msg_type& msg) override;
   void Dispatch(const msg_type& msg) override;
+  // forward the partially filled buffers.
+  void Flush() override;
+  // the dispatching channels are cached, rebuild them after rewiring.
+  void AddChannel(MsgChannelPtr& channel,
+                  ChnType ct = ChnType::CHN_OUT) override {
+    Node::AddChannel(channel, ct);
+    ResetDispatchChannels();
+  }
+  void RemoveChannel(const MsgChannelPtr& channel,
+                     ChnType ct = ChnType::CHN_OUT) override {
+    Node::RemoveChannel(channel, ct);
+    ResetDispatchChannels();
+  }
 
  private:
   bool Init();
+  void ResetDispatchChannels() {
+    std::vector<MsgChannelPtr>().swap(encode_channles_);
+    udp_channel_ = nullptr;
+    dispath_chn_init_ = false;
+  }
   /**
    * @brief relay the timeout buffer to a downstream service.
    *
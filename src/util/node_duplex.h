@@ -12,7 +12,19 @@
 #ifndef SRC_EXAMPLE_APP_SRC_NODE_DUPLEX_H_
 #define SRC_EXAMPLE_APP_SRC_NODE_DUPLEX_H_
 
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "channel.h"
 #include "io/poll_data.h"
@@ -21,6 +33,15 @@
 
 class NodeDuplex;
 using NodeDuplexPtr = std::shared_ptr<NodeDuplex>;
+/**
+ * @brief The reaction of an ingress node when the downstream is overloaded.
+ *
+ */
+enum class Backpressure {
+  BLOCK,  // block the poller until the channel has room.
+  PAUSE,  // stop draining the fd, the kernel buffer absorbs the burst.
+  SHED,   // keep draining the fd and drop the msgs which are allowed to.
+};
 /**
  * @brief A duplex node which may act as udp or tcp service.
  *
@@ -33,7 +54,11 @@ class NodeDuplex
   typedef typename MsgChannelPtr::element_type::value_type msg_type;
   explicit NodeDuplex(const std::string& name)
       : Node<MsgChannelPtr, NodeType::NODE_FULL_DUPLEX>(name) {}
-  virtual ~NodeDuplex() {}
+  virtual ~NodeDuplex() {
+    for (auto& req : egress_reqs_) {
+      bats::io::Poller::Instance()->Unregister(req);
+    }
+  }
   // Duplex nodes use `up_channel` to recv data from poller and use
   // `down_channel` to store the data which is requested to be written to `fd`.
   void AddChannel(MsgChannelPtr& channel,
@@ -41,6 +66,12 @@ class NodeDuplex
     auto& channels = ((ct == ChnType::CHN_IN) ? down_channels_ : up_channels_);
     channels.push_back(channel);
   }
+  void RemoveChannel(const MsgChannelPtr& channel,
+                     ChnType ct = ChnType::CHN_OUT) override final {
+    auto& channels = ((ct == ChnType::CHN_IN) ? down_channels_ : up_channels_);
+    channels.erase(std::remove(channels.begin(), channels.end(), channel),
+                   channels.end());
+  }
   MsgChannelPtr& GetChannel(int i,
                             ChnType ct = ChnType::CHN_OUT) override final {
     auto& channels = ((ct == ChnType::CHN_IN) ? down_channels_ : up_channels_);
@@ -63,7 +94,28 @@ class NodeDuplex
     if (msg == nullptr) {
       return;
     }
-    HandleMsg(msg);
+    if (write_batch_ <= 1) {
+      Measure([&]() { HandleMsg(msg); });
+      return;
+    }
+    // each worker thread and reactor has its own batch
+    static thread_local std::vector<msg_type> batch;
+    batch.push_back(msg);
+    auto deadline = NowNs() + flush_us_ * 1000ULL;
+    while (static_cast<int>(batch.size()) < write_batch_ && !is_stop_) {
+      if (channel->TryReadMessage(msg)) {
+        if (msg != nullptr) {
+          batch.push_back(msg);
+        }
+      } else if (flush_us_ > 0 && NowNs() < deadline) {
+        std::this_thread::yield();
+      } else {
+        break;
+      }
+    }
+    Measure([&]() { FDWriteBatch(batch.data(), batch.size()); },
+            batch.size());
+    batch.clear();
   }
   /**
    * @brief do some processing for the received msg.
@@ -75,34 +127,414 @@ class NodeDuplex
     // write
     FDWrite(msg);
   }
+  /**
+   * @brief How the ingress reacts when its downstream channels run out of
+   * credits.
+   *
+   * @param policy
+   * @param shed_f Under `SHED`, decides whether a msg may be dropped. All msgs
+   * may be dropped if it's null.
+   */
+  void SetBackpressure(Backpressure policy,
+                       std::function<bool(const msg_type&)> shed_f = nullptr) {
+    backpressure_ = policy;
+    shed_f_ = std::move(shed_f);
+  }
+  uint64_t ShedCount() const { return shed_cnt_.load(); }
+  /**
+   * @brief Bound the reading of one poll callback, so a busy fd can't starve
+   * the other fds of its reactor. Once `packets` msgs or `bytes` bytes are
+   * read, the fd is re-armed and served again in the next loop.
+   *
+   * @param packets Must be positive.
+   * @param bytes 0 means no bound.
+   */
+  void SetReadBudget(int packets, int64_t bytes = 0) {
+    if (packets > 0) {
+      read_budget_packets_ = packets;
+    }
+    read_budget_bytes_ = std::max<int64_t>(bytes, 0);
+  }
+  /**
+   * @brief Write up to `msgs` msgs of a channel by one `FDWriteBatch`. A
+   * worker thread waits up to `flush_us` for the batch to fill, the poller
+   * writes what is queued without waiting.
+   *
+   * @param msgs 1 writes every msg by itself.
+   * @param flush_us
+   */
+  void SetWriteBatch(int msgs, int flush_us = 0) {
+    write_batch_ = std::max(msgs, 1);
+    flush_us_ = std::max(flush_us, 0);
+  }
+  uint64_t ReadBytes() const { return read_bytes_.load(); }
+  uint64_t ReadYields() const { return read_yields_.load(); }
+  uint64_t ReadErrors() const { return read_errors_.load(); }
+  bool IsPaused() const { return paused_.load(); }
+  /**
+   * @brief Dispatch the msg received from fd. It never blocks the poller when
+   * the policy is `PAUSE`, or `SHED` and the msg is allowed to be dropped.
+   *
+   * @param msg
+   */
+  void Dispatch(const msg_type& msg) override {
+    if (GetChannelNum(ChnType::CHN_OUT) == 0) {
+      return;
+    }
+    auto& channel = GetChannel(DispatchIndex(msg), ChnType::CHN_OUT);
+    if (backpressure_ == Backpressure::SHED && !channel->HasCredit() &&
+        (shed_f_ == nullptr || shed_f_(msg))) {
+      shed_cnt_++;
+      return;
+    }
+    if (backpressure_ == Backpressure::PAUSE) {
+      // a read may yield more msgs than the credits, e.g. a GSO packet, the
+      // ones beyond a full channel wait for the next read.
+      if (!channel->TryWriteMessage(msg)) {
+        std::lock_guard<std::mutex> lg(stash_mutex_);
+        stashed_.push_back({channel, msg});
+      }
+      return;
+    }
+    WriteTo(channel, msg);
+  }
   /**
    * @brief For udp or tun node, they are using `FDRecv` to get input data.
    * Other `relay` nodes no neeed to call this function.
    *
-   * @param node
+   * @param reactor The reactor of the poller to run `FDRecv` on, -1 to pick
+   * one by the fd. The fd of shard `i` goes to reactor `reactor + i`.
    * @return true
    * @return false
    */
-  inline bool RegisterToPoller() {
+  inline bool RegisterToPoller(int reactor = -1) {
     auto self = shared_from_this();
-    bats::io::PollRequest req;
-    req.fd = this->GetFd();
-    assert(req.fd > 0);
-    fcntl(req.fd, F_SETFL, O_NONBLOCK);
-    req.events = EPOLLIN | EPOLLET;  // level trigger
-    req.timeout_ms = 0;
-    req.callback = [self](const bats::io::PollResponse& rsp) {
-      auto& response = rsp;
-      if (response.events & EPOLLIN) {
-        while (true) {
-          auto ret = self->FDRecv();
-          if (ret < 0 && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
-            break;
+    poll_reqs_.clear();
+    error_runs_.assign(Shards(), 0);
+    bool ok = true;
+    for (int shard = 0; shard < Shards(); shard++) {
+      bats::io::PollRequest req;
+      req.fd = PollFd(shard);
+      req.reactor = reactor < 0 ? -1 : reactor + shard;
+      assert(req.fd > 0);
+      fcntl(req.fd, F_SETFL, O_NONBLOCK);
+      fcntl(ShardFd(shard), F_SETFL, O_NONBLOCK);
+      req.events = EPOLLIN | EPOLLET;  // level trigger
+      req.timeout_ms = 0;
+      req.callback = [self, shard](const bats::io::PollResponse& rsp) {
+        auto& response = rsp;
+        if (response.events & EPOLLIN) {
+          self->DrainFd(shard);
+        }
+      };
+      poll_reqs_.push_back(req);
+      ok = bats::io::Poller::Instance()->Register(req) && ok;
+    }
+    return ok;
+  }
+  /**
+   * @brief Write the msgs of the `CHN_IN` channels to the fd on the poller
+   * instead of worker threads. Each channel signals an eventfd when it turns
+   * non-empty, so one reactor waits on the sockets and the channels together.
+   * A callback writes no more msgs than the read budget and signals the
+   * eventfd again for the rest, like the ingress it yields to the other fds.
+   * Run the node with no thread then.
+   *
+   * @param reactor The reactor to run `FDWrite` on, -1 to pick by the fd.
+   * @return false Return false if an eventfd can't be created.
+   */
+  bool RegisterEgressToPoller(int reactor = -1) {
+    egress_reactor_ = reactor;
+    egress_on_poller_ = true;
+    return RegisterEgress();
+  }
+  /**
+   * @brief Stop the ingress of the node temporarily, and the egress if it
+   * runs on the poller.
+   *
+   * @return false Return false if the node isn't registered.
+   */
+  bool UnregisterFromPoller() {
+    bool registered = !egress_reqs_.empty();
+    for (auto& req : egress_reqs_) {
+      bats::io::Poller::Instance()->Unregister(req);
+    }
+    egress_reqs_.clear();
+    for (auto& req : poll_reqs_) {
+      registered = bats::io::Poller::Instance()->Unregister(req) || registered;
+    }
+    return registered;
+  }
+  /**
+   * @brief Restart what is stopped by `UnregisterFromPoller`. The egress is
+   * registered for the channels the node has now, and the shards stopped by
+   * `kMaxReadErrors` errors are read again.
+   *
+   * @return true
+   * @return false
+   */
+  bool ReregisterToPoller() {
+    if (poll_reqs_.empty() && !egress_on_poller_) {
+      return false;
+    }
+    bool ok = true;
+    if (egress_on_poller_) {
+      ok = RegisterEgress();
+    }
+    paused_ = false;
+    std::fill(error_runs_.begin(), error_runs_.end(), 0);
+    for (auto& req : poll_reqs_) {
+      ok = bats::io::Poller::Instance()->Register(req) && ok;
+    }
+    return ok;
+  }
+  /**
+   * @brief The key of the fd of this node on a warm restart, the successor
+   * takes the fd of the same key. An empty key means the fd is not handed off.
+   *
+   * @return std::string
+   */
+  virtual std::string HandoffKey() const { return ""; }
+  /**
+   * @brief The key of the fd of `shard`, the one of shard 0 is `HandoffKey`.
+   *
+   * @param shard
+   * @return std::string
+   */
+  std::string ShardHandoffKey(int shard) const {
+    auto key = HandoffKey();
+    if (key.empty() || shard == 0) {
+      return key;
+    }
+    return key + "#" + std::to_string(shard);
+  }
+
+ protected:
+  /**
+   * @brief Read the fd in batches until EAGAIN or the read budget is spent.
+   * Under `PAUSE`, read no more msgs than the downstream has credits for, and
+   * stop reading once it runs out of credits to leave the data in the kernel
+   * buffer. A shard failing `kMaxReadErrors` reads in a row is unregistered
+   * instead of being re-armed forever.
+   */
+  void DrainFd(int shard) {
+    int packets = 0;
+    int64_t bytes = 0;
+    // the stashed msgs go before the ones read now.
+    if (backpressure_ != Backpressure::PAUSE) {
+      DispatchStashed();
+    } else if (!TryDispatchStashed()) {
+      Pause();
+      return;
+    }
+    while (true) {
+      int credits = std::numeric_limits<int>::max();
+      if (backpressure_ == Backpressure::PAUSE) {
+        credits = Credits();
+        if (credits <= 0) {
+          Pause();
+          break;
+        }
+      }
+      if (packets >= read_budget_packets_ ||
+          (read_budget_bytes_ > 0 && bytes >= read_budget_bytes_)) {
+        // yield to the other fds of the reactor, it comes back next loop.
+        read_yields_.fetch_add(1, std::memory_order_relaxed);
+        bats::io::Poller::Instance()->Rearm(PollFd(shard));
+        break;
+      }
+      int got = 1;
+      int ret = 0;
+      int err = 0;
+      // the msgs are counted below.
+      Measure(
+          [&]() {
+            ret = FDRecvBatch(
+                shard, std::min(read_budget_packets_ - packets, credits), &got);
+            err = errno;
+          },
+          0);
+      if (ret < 0) {
+        if (err == EINTR) {
+          continue;
+        }
+        if (err != EAGAIN && err != EWOULDBLOCK) {
+          ReadError(shard, err);
+        }
+        break;
+      }
+      error_runs_[shard] = 0;
+      // 0 is a msg too, e.g. a dropped frame, it's bounded by the budget.
+      packets += std::max(got, 1);
+      bytes += ret;
+      read_bytes_.fetch_add(ret, std::memory_order_relaxed);
+      if (ret > 0) {
+        msgs_.fetch_add(got, std::memory_order_relaxed);
+      }
+    }
+  }
+  // count a failed read of `shard`, stop reading it after `kMaxReadErrors`
+  // in a row.
+  void ReadError(int shard, int err) {
+    read_errors_.fetch_add(1, std::memory_order_relaxed);
+    if (++error_runs_[shard] < kMaxReadErrors) {
+      // e.g. an ICMP error on udp, the data behind it is read next loop.
+      bats::io::Poller::Instance()->Rearm(PollFd(shard));
+      return;
+    }
+    // e.g. EIO or a closed fd, it would fail every loop.
+    LOG(ERROR) << GetName() << " stops reading fd " << ShardFd(shard)
+               << " after " << kMaxReadErrors
+               << " errors: " << strerror(err);
+    bats::io::Poller::Instance()->Unregister(poll_reqs_[shard]);
+  }
+  bool RegisterEgress() {
+    std::weak_ptr<NodeDuplex> weak = shared_from_this();
+    for (auto& chn : down_channels_) {
+      int fd = chn->EnableEventFd();
+      if (fd < 0) {
+        return false;
+      }
+      std::weak_ptr<QueueBasedChannel<msg_type>> weak_chn = chn;
+      bats::io::PollRequest req;
+      req.fd = fd;
+      req.events = EPOLLIN | EPOLLET;
+      req.reactor = egress_reactor_;
+      req.callback = [weak, weak_chn, fd](const bats::io::PollResponse&) {
+        auto self = weak.lock();
+        auto channel = weak_chn.lock();
+        if (!self || !channel) {
+          return;
+        }
+        uint64_t count = 0;
+        auto ret = read(fd, &count, sizeof(count));
+        (void)ret;
+        static thread_local std::vector<msg_type> batch;
+        msg_type msg;
+        int budget = self->read_budget_packets_;
+        int taken = 0;
+        bool more = true;
+        while (more) {
+          more = taken < budget && !self->is_stop_ &&
+                 channel->TryReadMessage(msg);
+          if (more) {
+            taken++;
+            if (msg != nullptr) {
+              batch.push_back(msg);
+            }
+          }
+          // the dequeued msgs are written even if the node stops
+          bool full = static_cast<int>(batch.size()) >= self->write_batch_;
+          if (!batch.empty() && (!more || full)) {
+            self->Measure(
+                [&]() { self->FDWriteBatch(batch.data(), batch.size()); },
+                batch.size());
+            batch.clear();
           }
         }
+        if (taken >= budget) {
+          // the rest is written in the next loop.
+          uint64_t one = 1;
+          ret = write(fd, &one, sizeof(one));
+          (void)ret;
+        }
+      };
+      if (!bats::io::Poller::Instance()->Register(req)) {
+        return false;
       }
-    };
-    return bats::io::Poller::Instance()->Register(req);
+      egress_reqs_.push_back(req);
+      // the msgs queued while it was unregistered signaled nothing.
+      uint64_t one = 1;
+      auto ret = write(fd, &one, sizeof(one));
+      (void)ret;
+    }
+    return true;
+  }
+  // the least credits of the up-channels.
+  int Credits() {
+    int credits = std::numeric_limits<int>::max();
+    for (auto& chn : up_channels_) {
+      credits = std::min(credits, chn->Credits());
+    }
+    return credits;
+  }
+  /**
+   * @brief Write the stashed msgs in their order without blocking, under
+   * `PAUSE`.
+   *
+   * @return false Return false if a channel is full and msgs are left.
+   */
+  bool TryDispatchStashed() {
+    std::vector<std::pair<MsgChannelPtr, msg_type>> stashed;
+    {
+      std::lock_guard<std::mutex> lg(stash_mutex_);
+      if (stashed_.empty()) {
+        return true;
+      }
+      stashed.swap(stashed_);
+    }
+    size_t done = 0;
+    for (; done < stashed.size(); done++) {
+      auto& item = stashed[done];
+      bool attached =
+          std::find(up_channels_.begin(), up_channels_.end(), item.first) !=
+          up_channels_.end();
+      if (!attached) {
+        // the channel was disconnected during a quiescence.
+        Dispatch(item.second);
+      } else if (!item.first->TryWriteMessage(item.second)) {
+        break;
+      }
+    }
+    if (done == stashed.size()) {
+      return true;
+    }
+    std::lock_guard<std::mutex> lg(stash_mutex_);
+    stashed_.insert(stashed_.begin(), stashed.begin() + done, stashed.end());
+    return false;
+  }
+  /**
+   * @brief Wait for the credits of all the starved channels. Re-registering
+   * the fd re-arms the edge trigger, so the poller reports the data which was
+   * left in the kernel buffer.
+   */
+  void Pause() {
+    if (paused_.exchange(true)) {
+      return;
+    }
+    std::weak_ptr<NodeDuplex> weak = shared_from_this();
+    bool waiting = false;
+    for (auto& chn : up_channels_) {
+      if (chn->HasCredit()) {
+        continue;
+      }
+      waiting = true;
+      chn->OnCredit([weak]() {
+        auto self = weak.lock();
+        if (self && !self->is_stop_ && self->paused_.exchange(false)) {
+          self->Unpause();
+        }
+      });
+    }
+    // the channels were drained in between, no callback would resume it.
+    if (!waiting && paused_.exchange(false)) {
+      Unpause();
+    }
+  }
+  /**
+   * @brief Write the stashed msgs, which may wait for no more data on the fd,
+   * then re-register the fds stopped by `Pause`.
+   */
+  void Unpause() {
+    if (!TryDispatchStashed()) {
+      Pause();
+      return;
+    }
+    for (size_t shard = 0; shard < poll_reqs_.size(); shard++) {
+      if (error_runs_[shard] < kMaxReadErrors) {
+        bats::io::Poller::Instance()->Register(poll_reqs_[shard]);
+      }
+    }
   }
 
  private:
@@ -123,6 +555,27 @@ class NodeDuplex
    * @return int
    */
   virtual int FDWrite(const msg_type& msg) = 0;
+
+  // one per shard
+  std::vector<bats::io::PollRequest> poll_reqs_;
+  std::vector<bats::io::PollRequest> egress_reqs_;
+  bool egress_on_poller_ = false;
+  int egress_reactor_ = -1;
+  Backpressure backpressure_ = Backpressure::PAUSE;
+  std::function<bool(const msg_type&)> shed_f_ = nullptr;
+  std::atomic<bool> paused_ = {false};
+  std::atomic<uint64_t> shed_cnt_ = {0};
+  int write_batch_ = 1;
+  int flush_us_ = 0;
+  int read_budget_packets_ = kDefaultReadBudget;
+  int64_t read_budget_bytes_ = 0;
+  std::atomic<uint64_t> read_bytes_ = {0};
+  std::atomic<uint64_t> read_yields_ = {0};
+  std::atomic<uint64_t> read_errors_ = {0};
+  // the failed reads in a row of each shard
+  std::vector<int> error_runs_;
+  static const int kDefaultReadBudget = 64;
+  static const int kMaxReadErrors = 16;
 };
 
 #endif  // SRC_EXAMPLE_APP_SRC_NODE_DUPLEX_H_
@@ -24,7 +24,8 @@ using BatsEncoder_ptr = std::shared_ptr<bats::BatsEncoder>;
 class Encoder : public Node<MsgChannelPtr, NodeType::NODE_RELAY>,
                 public std::enable_shared_from_this<Encoder> {
  public:
-  Encoder() : Node<MsgChannelPtr, NodeType::NODE_RELAY>("encoder") {
+  explicit Encoder(const std::string& name = "encoder")
+      : Node<MsgChannelPtr, NodeType::NODE_RELAY>(name) {
     encode_ = std::make_shared<bats::BatsEncoder>();
     // used to reserve header room for coded msg.
     encode_->encodingInfo().mtu = 1500;
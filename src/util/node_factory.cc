@@ -0,0 +1,86 @@
+/**
+ * @file node_factory.cc
+ * @author peng lei (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-11-22
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include "node_factory.h"
+
+#include <glog/logging.h>
+
+#include <memory>
+#include <string>
+
+#include "node_collector.h"
+#include "node_encoder.h"
+#include "node_tun.h"
+#include "node_udp.h"
+#include "util/settings.h"
+
+void RegisterBuiltinNodes() {
+  auto factory = NodeFactory::Instance();
+  factory->Register("tun", [](const std::string& name,
+                              const std::string& section) {
+    bats::util::Settings& settings = bats::util::Settings::getInstance();
+    auto ifname = settings.getValue<std::string>(section + ".ifname", "tun0");
+    auto address =
+        settings.getValue<std::string>(section + ".address", "10.0.0.1");
+    // IFF_MULTI_QUEUE queues, each polled by its own reactor
+    auto queues = settings.getValue<int>(section + ".queues", 1);
+    // TSO packets through IFF_VNET_HDR, write batching coalesces them
+    auto offload = settings.getValue<int>(section + ".offload", 0) != 0;
+    auto tun = std::make_shared<bats::src::Tun>(ifname, address, queues,
+                                                offload, name);
+    auto mtu = settings.getValue<int>(section + ".mtu", 0);
+    if (mtu > 0) {
+      tun->SetMtu(mtu);
+    }
+    auto txqueuelen = settings.getValue<int>(section + ".txqueuelen", 0);
+    if (txqueuelen > 0) {
+      tun->SetTxQueueLen(txqueuelen);
+    }
+    // multishot io_uring reads and batched writes, read/write without them
+    if (settings.getValue<int>(section + ".uring", 0) != 0) {
+      tun->SetUring(true);
+    }
+    return NodeHandle(tun);
+  });
+  factory->Register("udp", [](const std::string& name,
+                              const std::string& section) {
+    bats::util::Settings& settings = bats::util::Settings::getInstance();
+    auto port = settings.getValue<int>(section + ".port", 8888);
+    // reuseport sockets, each polled by its own reactor
+    auto sockets = settings.getValue<int>(section + ".sockets", 1);
+    auto udp = std::make_shared<bats::src::Udp>(port, sockets, name);
+    auto steer = settings.getValue<std::string>(section + ".steer", "hash");
+    if (steer == "cpu") {
+      udp->SteerByCpu();
+    } else if (steer != "hash") {
+      LOG(ERROR) << "unknown steering [" << steer << "] of " << section;
+    }
+    // msgs per recvmmsg/sendmmsg, and the wait of a sender for a full batch
+    auto batch = settings.getValue<int>(section + ".batch", 32);
+    auto flush_us = settings.getValue<int>(section + ".flush_us", 0);
+    udp->SetBatch(batch, flush_us);
+    // UDP_SEGMENT and UDP_GRO, left off if the kernel lacks them
+    udp->SetOffload(settings.getValue<int>(section + ".gso", 0) != 0,
+                    settings.getValue<int>(section + ".gro", 0) != 0);
+    // multishot io_uring recvs, recvmmsg without them or with gro
+    if (settings.getValue<int>(section + ".uring", 0) != 0) {
+      udp->SetUring(true);
+    }
+    return NodeHandle(udp);
+  });
+  factory->Register("collector", [](const std::string& name,
+                                    const std::string& section) {
+    return NodeHandle(std::make_shared<bats::src::Collector>(name));
+  });
+  factory->Register("encoder", [](const std::string& name,
+                                  const std::string& section) {
+    return NodeHandle(std::make_shared<bats::src::Encoder>(name));
+  });
+}
@@ -0,0 +1,91 @@
+/**
+ * @file node_factory.h
+ * @author peng lei (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-11-22
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef SRC_EXAMPLE_APP_SRC_NODE_FACTORY_H_
+#define SRC_EXAMPLE_APP_SRC_NODE_FACTORY_H_
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "node_handle.h"
+
+/**
+ * @brief A registry of node creators, keyed by the node type which is used in
+ * the topology configuration.
+ *
+ */
+class NodeFactory {
+ public:
+  /**
+   * @brief Create a node named `name`. `section` is the settings section of
+   * the node, the creator may read its own parameters from it, e.g.
+   * `<section>.port`.
+   */
+  using Creator = std::function<NodeHandle(const std::string& name,
+                                           const std::string& section)>;
+
+  static NodeFactory* Instance() {
+    static NodeFactory* ins = nullptr;
+    if (!ins) {
+      static std::once_flag flag;
+      std::call_once(flag, [&]() { ins = new (std::nothrow) NodeFactory(); });
+    }
+    return ins;
+  }
+  /**
+   * @brief Register a creator of a node type.
+   *
+   * @param type
+   * @param creator
+   * @return false Return false if the type is already registered.
+   */
+  bool Register(const std::string& type, Creator creator) {
+    std::lock_guard<std::mutex> lg(mutex_);
+    return creators_.emplace(type, std::move(creator)).second;
+  }
+  /**
+   * @brief Create a node of `type`.
+   *
+   * @param type
+   * @param name
+   * @param section
+   * @return NodeHandle An invalid handle if the type is unknown.
+   */
+  NodeHandle Create(const std::string& type, const std::string& name,
+                    const std::string& section) {
+    Creator creator = nullptr;
+    {
+      std::lock_guard<std::mutex> lg(mutex_);
+      auto itr = creators_.find(type);
+      if (itr == creators_.end()) {
+        return NodeHandle();
+      }
+      creator = itr->second;
+    }
+    return creator(name, section);
+  }
+
+ private:
+  NodeFactory() = default;
+  std::mutex mutex_;
+  std::unordered_map<std::string, Creator> creators_;
+  DISALLOW_COPY_AND_ASSIGN(NodeFactory)
+};
+
+/**
+ * @brief Register the nodes shipped with the framework: `tun`, `udp`,
+ * `collector` and `encoder`.
+ *
+ */
+void RegisterBuiltinNodes();
+
+#endif  // SRC_EXAMPLE_APP_SRC_NODE_FACTORY_H_
@@ -0,0 +1,273 @@
+/**
+ * @file node_handle.h
+ * @author peng lei (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-11-22
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef SRC_EXAMPLE_APP_SRC_NODE_HANDLE_H_
+#define SRC_EXAMPLE_APP_SRC_NODE_HANDLE_H_
+
+#include <memory>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "channel.h"
+#include "node.h"
+#include "node_duplex.h"
+
+/**
+ * @brief A type-erased reference to a node. It lets the topology be wired
+ * without knowing the concrete node types at compile time. Every node kind,
+ * source, sink, relay or duplex, is driven through the same interface, so no
+ * caller has to cast a node by its `NodeType`.
+ *
+ */
+class NodeHandle {
+ public:
+  NodeHandle() = default;
+  /**
+   * @brief Refer to a node which is owned by someone else.
+   *
+   * @tparam NODE
+   * @param node
+   */
+  template <typename NODE>
+  explicit NodeHandle(NODE* node)
+      : self_(std::make_shared<Model<NODE>>(node, nullptr)) {}
+  /**
+   * @brief Refer to a node and share the ownership of it.
+   *
+   * @tparam NODE
+   * @param node
+   */
+  template <typename NODE>
+  explicit NodeHandle(const std::shared_ptr<NODE>& node)
+      : self_(std::make_shared<Model<NODE>>(node.get(), node)) {}
+
+  friend std::ostream& operator<<(std::ostream& os, const NodeHandle& node) {
+    return node.self_->Print(os);
+  }
+  bool Valid() const { return self_ != nullptr; }
+  const std::string& GetName() const { return self_->GetName(); }
+  NodeType Type() const { return self_->Type(); }
+  void AddChannel(MsgChannelPtr& channel, ChnType ct) {
+    self_->AddChannel(channel, ct);
+  }
+  void RemoveChannel(const MsgChannelPtr& channel, ChnType ct) {
+    self_->RemoveChannel(channel, ct);
+  }
+  MsgChannelPtr& GetChannel(int i, ChnType ct) {
+    return self_->GetChannel(i, ct);
+  }
+  int GetChannelNum(ChnType ct) const { return self_->GetChannelNum(ct); }
+  void SetDispatchPolicy(DispatchPolicy policy) {
+    self_->SetDispatchPolicy(policy);
+  }
+  void SetCpuSet(const std::vector<int>& cpus) { self_->SetCpuSet(cpus); }
+  NodeStats Stats() const { return self_->Stats(); }
+  int Threads() const { return self_->Threads(); }
+  /**
+   * @brief Stop the node for good and break the waits on its channels.
+   *
+   */
+  void Stop() { self_->Stop(); }
+  /**
+   * @brief The entry of the worker threads of the node.
+   *
+   */
+  void DoWork() { self_->DoWork(); }
+  /**
+   * @brief Register a duplex node to the poller.
+   *
+   * @return false Return false if it's not a duplex node or it failed.
+   */
+  bool RegisterToPoller(int reactor = -1) {
+    return self_->RegisterToPoller(reactor);
+  }
+  /**
+   * @brief Run the egress of a duplex node on the poller, see
+   * `NodeDuplex::RegisterEgressToPoller`.
+   */
+  bool RegisterEgressToPoller(int reactor = -1) {
+    return self_->RegisterEgressToPoller(reactor);
+  }
+  /**
+   * @brief See `NodeDuplex::SetReadBudget`, no-op for other nodes.
+   */
+  void SetReadBudget(int packets, int64_t bytes = 0) {
+    self_->SetReadBudget(packets, bytes);
+  }
+  /**
+   * @brief Stop the workers and the ingress of the node, see `Node::Quiesce`.
+   *
+   * @return true Return true if the ingress was registered to the poller.
+   */
+  bool Quiesce() { return self_->Quiesce(); }
+  /**
+   * @brief Make the node ready for new workers, and restart the ingress.
+   *
+   * @param repoll Whether to register the ingress to the poller again.
+   */
+  void Resume(bool repoll) { self_->Resume(repoll); }
+  void Flush() { self_->Flush(); }
+  /**
+   * @brief Append the msgs stashed by a quiescence, see `Node::TakeStashed`.
+   */
+  void TakeStashed(std::vector<std::pair<MsgChannelPtr, BaseMsg_ptr>>& msgs) {
+    self_->TakeStashed(msgs);
+  }
+  /**
+   * @brief Stop reading the fd of a duplex node, its writing goes on.
+   *
+   */
+  void StopIngress() { self_->StopIngress(); }
+  /**
+   * @brief The fds of a duplex node to be handed off on a warm restart, one
+   * per shard.
+   *
+   * @param fds The keys and the fds are appended, see
+   * `NodeDuplex::ShardHandoffKey`.
+   */
+  void HandoffFds(std::vector<std::pair<std::string, int>>& fds) const {
+    self_->HandoffFds(fds);
+  }
+  /**
+   * @brief The fds a duplex node reads, 1 for other nodes.
+   *
+   * @return int
+   */
+  int Shards() const { return self_->Shards(); }
+
+ private:
+  struct Concept {
+    virtual ~Concept() = default;
+    virtual const std::string& GetName() const = 0;
+    virtual NodeType Type() const = 0;
+    virtual void AddChannel(MsgChannelPtr& channel, ChnType ct) = 0;
+    virtual void RemoveChannel(const MsgChannelPtr& channel, ChnType ct) = 0;
+    virtual MsgChannelPtr& GetChannel(int i, ChnType ct) = 0;
+    virtual int GetChannelNum(ChnType ct) const = 0;
+    virtual void SetDispatchPolicy(DispatchPolicy policy) = 0;
+    virtual void SetCpuSet(const std::vector<int>& cpus) = 0;
+    virtual NodeStats Stats() const = 0;
+    virtual int Threads() const = 0;
+    virtual void Stop() = 0;
+    virtual std::ostream& Print(std::ostream& os) const = 0;
+    virtual void DoWork() = 0;
+    virtual bool RegisterToPoller(int reactor) = 0;
+    virtual bool RegisterEgressToPoller(int reactor) = 0;
+    virtual void SetReadBudget(int packets, int64_t bytes) = 0;
+    virtual bool Quiesce() = 0;
+    virtual void Resume(bool repoll) = 0;
+    virtual void Flush() = 0;
+    virtual void TakeStashed(
+        std::vector<std::pair<MsgChannelPtr, BaseMsg_ptr>>& msgs) = 0;
+    virtual void StopIngress() = 0;
+    virtual void HandoffFds(
+        std::vector<std::pair<std::string, int>>& fds) const = 0;
+    virtual int Shards() const = 0;
+  };
+
+  template <typename NODE>
+  struct Model : public Concept {
+    Model(NODE* node, std::shared_ptr<void> owner)
+        : node_(node), owner_(std::move(owner)) {}
+    const std::string& GetName() const override { return node_->GetName(); }
+    NodeType Type() const override { return node_->Type(); }
+    void AddChannel(MsgChannelPtr& channel, ChnType ct) override {
+      node_->AddChannel(channel, ct);
+    }
+    void RemoveChannel(const MsgChannelPtr& channel, ChnType ct) override {
+      node_->RemoveChannel(channel, ct);
+    }
+    MsgChannelPtr& GetChannel(int i, ChnType ct) override {
+      return node_->GetChannel(i, ct);
+    }
+    int GetChannelNum(ChnType ct) const override {
+      return node_->GetChannelNum(ct);
+    }
+    void SetDispatchPolicy(DispatchPolicy policy) override {
+      node_->SetDispatchPolicy(policy);
+    }
+    void SetCpuSet(const std::vector<int>& cpus) override {
+      node_->SetCpuSet(cpus);
+    }
+    NodeStats Stats() const override { return node_->Stats(); }
+    int Threads() const override { return node_->Threads(); }
+    void Stop() override { node_->Stop(); }
+    std::ostream& Print(std::ostream& os) const override {
+      return os << *node_;
+    }
+    void DoWork() override { node_->DoWork(); }
+    bool RegisterToPoller(int reactor) override {
+      if constexpr (std::is_base_of<NodeDuplex, NODE>::value) {
+        return node_->RegisterToPoller(reactor);
+      }
+      return false;
+    }
+    bool RegisterEgressToPoller(int reactor) override {
+      if constexpr (std::is_base_of<NodeDuplex, NODE>::value) {
+        return node_->RegisterEgressToPoller(reactor);
+      }
+      return false;
+    }
+    void SetReadBudget(int packets, int64_t bytes) override {
+      if constexpr (std::is_base_of<NodeDuplex, NODE>::value) {
+        node_->SetReadBudget(packets, bytes);
+      }
+    }
+    bool Quiesce() override {
+      node_->Quiesce();
+      // the ingress of a duplex node runs on the poller thread.
+      auto duplex = dynamic_cast<NodeDuplex*>(node_);
+      return duplex != nullptr && duplex->UnregisterFromPoller();
+    }
+    void Resume(bool repoll) override {
+      node_->Resume();
+      auto duplex = dynamic_cast<NodeDuplex*>(node_);
+      if (repoll && duplex != nullptr) {
+        duplex->ReregisterToPoller();
+      }
+    }
+    void Flush() override { node_->Flush(); }
+    void TakeStashed(
+        std::vector<std::pair<MsgChannelPtr, BaseMsg_ptr>>& msgs) override {
+      auto stashed = node_->TakeStashed();
+      msgs.insert(msgs.end(), stashed.begin(), stashed.end());
+    }
+    void StopIngress() override {
+      auto duplex = dynamic_cast<NodeDuplex*>(node_);
+      if (duplex != nullptr) {
+        duplex->UnregisterFromPoller();
+      }
+    }
+    void HandoffFds(
+        std::vector<std::pair<std::string, int>>& fds) const override {
+      auto duplex = dynamic_cast<const NodeDuplex*>(node_);
+      if (duplex == nullptr || duplex->HandoffKey().empty()) {
+        return;
+      }
+      for (int shard = 0; shard < duplex->Shards(); shard++) {
+        fds.push_back({duplex->ShardHandoffKey(shard), duplex->ShardFd(shard)});
+      }
+    }
+    int Shards() const override {
+      auto duplex = dynamic_cast<const NodeDuplex*>(node_);
+      return duplex == nullptr ? 1 : duplex->Shards();
+    }
+
+    NODE* node_ = nullptr;
+    std::shared_ptr<void> owner_ = nullptr;
+  };
+
+  std::shared_ptr<Concept> self_ = nullptr;
+};
+
+#endif  // SRC_EXAMPLE_APP_SRC_NODE_HANDLE_H_
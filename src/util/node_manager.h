@@ -10,15 +10,33 @@
  */
 #ifndef SRC_EXAMPLE_APP_SRC_NODE_MANAGER_H_
 #define SRC_EXAMPLE_APP_SRC_NODE_MANAGER_H_
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
 #include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include "channel.h"
 #include "node.h"
 #include "node_duplex.h"
+#include "node_factory.h"
+#include "node_handle.h"
+#include "process_supervisor.h"
+#include "topology_server.h"
+#include "warm_restart.h"
+#include "util/settings.h"
 /**
  * @brief a global instance which manage all the nodes.
  * All nodes and the connections between them build a topology network.
@@ -71,9 +89,79 @@ class NodeManager {
    */
   template <typename CHN, NodeType type>
   bool RunAsThreads(Node<CHN, type>& node, int num = 1);
+  /**
+   * @brief Type-erased versions of `Connect` and `RunAsThreads`.
+   *
+   * @param capacity The capacity of the channel if a new one is created.
+   */
+  bool Connect(NodeHandle up, NodeHandle down, bool reuse_chn = true,
+               int capacity = 100);
+  bool RunAsThreads(NodeHandle node, int num = 1);
+  /**
+   * @brief Runtime reconfiguration. `Connect` and `RunAsThreads` can be called
+   * at runtime too. Only the nodes at both ends of the changed edges are
+   * quiesced (workers joined, ingress unregistered) and restarted, the rest of
+   * the pipeline keeps forwarding. The msgs queued in kept channels survive.
+   *
+   * Remove the edge between `up` and `down`, the msgs queued in the channel
+   * are dropped if no other edge uses it.
+   */
+  bool Disconnect(const std::string& up, const std::string& down);
+  /**
+   * @brief Move the channel between `up` and `old_down` to `new_down`. `up` is
+   * not interrupted and the queued msgs are consumed by `new_down`.
+   */
+  bool SwapConsumer(const std::string& up, const std::string& old_down,
+                    const std::string& new_down);
+  /**
+   * @brief Stop a node and remove all the edges of it.
+   */
+  bool RemoveNode(const std::string& name);
+  /**
+   * @brief Build and run the topology described in the settings file.
+   *
+   * [poller]         ; optional, a running poller must match it
+   * reactors=2        ; epoll threads, optional
+   * cpus=0,1          ; optional, the reactors are pinned round robin
+   * backend=epoll     ; or `io_uring`, which falls back to epoll if unusable
+   * busy_poll_us=50   ; optional, spin this long after activity before sleep
+   * socket_busy_poll_us=50  ; optional, SO_BUSY_POLL of the sockets
+   * slow_callback_us=1000   ; optional, log the poll callbacks slower than it
+   * [topology]
+   * node_count=2
+   * edge_count=1
+   * [node0]
+   * type=tun          ; a type registered in `NodeFactory`
+   * name=tun          ; referred by the edges, default `node0`
+   * threads=1
+   * cpus=2,3          ; optional
+   * dispatch=id       ; `id`, `round_robin` or `flow`
+   * reactor=0         ; optional, the reactor of a duplex node
+   * read_budget=64    ; optional, msgs a duplex node reads per poll callback
+   * read_budget_bytes=0  ; optional, bytes per poll callback, 0 for no bound
+   * egress=poller     ; optional, a duplex node writes its fd on the reactor
+   *                   ; instead of a thread, `threads` is ignored
+   * [edge0]
+   * from=tun
+   * to=collector
+   * channel=queue
+   * capacity=100
+   * reuse=1
+   *
+   * @return true
+   * @return false Return false if the description is invalid or a node fails
+   * to be created, connected or run. The nodes of the description are stopped
+   * and removed then, the ones running before are left as they were.
+   */
+  bool LoadTopology();
   /**
    * @brief Verify the topology. (make sure that it has no loop and connectness)
+   * Errors: cycles, nodes unreachable from any ingress, nodes without
+   * producers and channels without a running consumer.
+   * It also estimates the capacity of each stage from its threads and the
+   * measured service time, and warns about the bottleneck stages.
    *
+   * @return false Return false if the topology is invalid.
    */
   bool Verify();
   /**
@@ -81,13 +169,183 @@ class NodeManager {
    *
    */
   void View();
+  /**
+   * @brief Export the topology annotated with the queue depth and the msgs/s
+   * of each edge, and the msgs/s and busy percentage of each node. The rates
+   * are averaged since the previous export.
+   *
+   * @param format `dot` (Graphviz) or `json`.
+   * @return std::string
+   */
+  std::string Export(const std::string& format);
+  /**
+   * @brief Serve `Export` on a unix socket and/or dump it to
+   * `<prefix>.dot|json` on a signal. Empty `path` or zero `signo` disables
+   * the corresponding way.
+   *
+   * @return true
+   * @return false
+   */
+  bool ServeTopology(const std::string& path, int signo = SIGUSR1,
+                     const std::string& prefix = "/tmp/topology");
+  /**
+   * @brief Multi-process mode. Place a group of nodes in a worker process,
+   * `body` builds and runs them on the `NodeManager` of that process. Link the
+   * groups with `ShmRing`s through `ShmSender` and `ShmReceiver` nodes, the
+   * rings are created before `StartProcesses`. e.g.
+   *
+   * auto ring = ShmRing::Create("to_encoder", 4096);
+   * manager->AddProcess("encoder", {2, 3}, [ring]() {
+   *   auto rx = std::make_shared<ShmReceiver>(ring);
+   *   ...
+   * });
+   * manager->StartProcesses();
+   * // build the I/O nodes of this process and connect them to a ShmSender.
+   *
+   * @param name
+   * @param cpus The cores of the worker process.
+   * @param body
+   * @return true
+   * @return false
+   */
+  bool AddProcess(const std::string& name, const std::vector<int>& cpus,
+                  std::function<void()> body);
+  /**
+   * @brief Fork the supervisor of the worker processes. It must be called
+   * before any node, or the poller, starts its threads. A crashed worker is
+   * restarted by the supervisor without touching this process.
+   *
+   * @return true
+   * @return false
+   */
+  bool StartProcesses();
+  /**
+   * @brief Warm restart, the running process. Wait for the successor on a
+   * unix socket in a background thread. Once it connects, the ingress of the
+   * duplex nodes is stopped, the nodes flush their buffers, and the pipeline
+   * drains for up to `drain_ms`. Then the workers are stopped, and the fds of
+   * the duplex nodes and the msgs left in the channels are handed off.
+   * `on_done` is called after the handoff, usually to exit.
+   *
+   * @param path
+   * @param on_done
+   * @param drain_ms
+   * @return true
+   * @return false
+   */
+  bool ServeHandoff(const std::string& path, std::function<void()> on_done,
+                    int drain_ms = 100);
+  /**
+   * @brief Warm restart, the successor. Call it before creating the nodes,
+   * the duplex nodes then take over the fds of the predecessor.
+   *
+   * @param path
+   * @return false Return false if there is no predecessor.
+   */
+  bool Takeover(const std::string& path);
+  /**
+   * @brief Put the msgs handed off by the predecessor back to the channels of
+   * the same `ChannelKey`. Call it after the topology is connected in the
+   * same order.
+   *
+   * @param maker Rebuild the msgs of derived types, see `WarmRestart`.
+   * @return int The number of restored msgs.
+   */
+  int RestoreQueued(WarmRestart::MsgMaker maker = nullptr);
 
  private:
   NodeManager() = default;
   virtual ~NodeManager() = default;
-  std::unordered_map<std::string, std::pair<NodeType, void*>> node_list_;
+  struct NodeEntry {
+    NodeType type;
+    NodeHandle handle;
+    int threads = 0;
+    std::vector<std::thread> workers;
+    // the workers which have not returned from `DoWork`.
+    std::shared_ptr<std::atomic_int> active =
+        std::make_shared<std::atomic_int>(0);
+  };
+  // a channel between two nodes, recorded by `Connect`.
+  struct Edge {
+    std::string up;
+    std::string down;
+    MsgChannelPtr channel;
+    // the ends may not be running yet.
+    NodeHandle up_node;
+    NodeHandle down_node;
+  };
+  struct Snapshot {
+    NodeType type;
+    int threads = 0;
+    double msgs_per_sec = 0;
+    double busy = 0;
+  };
+  struct EdgeSnapshot {
+    std::string up;
+    std::string down;
+    std::string channel;
+    int depth = 0;
+    int capacity = 0;
+    double msgs_per_sec = 0;
+  };
+  void TakeSnapshot(std::map<std::string, Snapshot>& nodes,
+                    std::vector<EdgeSnapshot>& edges);
+  static const char* TypeName(NodeType type);
+  // `LoadTopology`, which may throw. `names` gets the nodes once they are
+  // all created, before any of them is connected.
+  bool BuildTopology(std::vector<std::string>* names);
+  // stop the nodes in `names` and remove their edges, whether they run or
+  // are only connected.
+  void RollBack(const std::vector<std::string>& names);
+  // `s` as a quoted string of json, or of dot if `json` is false.
+  static std::string Quote(const std::string& s, bool json);
+  void SpawnWorkers(NodeEntry& entry, int num);
+  bool ConnectLocked(NodeHandle& up, NodeHandle& down, bool reuse_chn,
+                     int capacity);
+  /**
+   * @brief Quiesce the running nodes in `names`, call `f` and restart the
+   * nodes which are still registered after it.
+   */
+  void Reconfigure(const std::vector<std::string>& names,
+                   const std::function<void()>& f);
+  /**
+   * @brief Stop the running nodes in `names` and join their workers.
+   *
+   * @return The quiesced nodes and whether their ingress was registered.
+   */
+  std::vector<std::pair<std::string, bool>> QuiesceNodes(
+      const std::vector<std::string>& names);
+  /**
+   * @brief Detach the channel of an edge which is erased from `edge_list_`
+   * from the ends which have no other edge on it.
+   */
+  void DetachEdge(Edge& edge);
+  bool Handoff(int sock, int drain_ms);
+  /**
+   * @brief The key of the queued msgs of a channel on a warm restart. The
+   * channels of the same `up:down` pair are told apart by their order.
+   */
+  std::string ChannelKey(const MsgChannelPtr& chn);
+  // The utilization above which a stage is reported as a bottleneck.
+  const double kBottleneckUtilization = 0.8;
+
+  std::unordered_map<std::string, NodeEntry> node_list_;
+  std::unordered_map<std::string, NodeType> connected_;
+  std::vector<Edge> edge_list_;
+  // counters of the previous export, used to compute the rates.
+  std::mutex export_mutex_;
+  uint64_t last_export_ns_ = 0;
+  std::unordered_map<std::string, NodeStats> last_node_stats_;
+  std::unordered_map<std::string, uint64_t> last_chn_cnt_;
+  TopologyServer_ptr topology_server_ = nullptr;
+  ProcessSupervisor_ptr supervisor_ = nullptr;
+  int handoff_fd_ = -1;
+  std::thread handoff_thread_;
+  // nodes created from the topology settings.
+  std::vector<NodeHandle> owned_nodes_;
   std::vector<MsgChannelPtr> channel_list_;
-  std::vector<std::thread> worker_list_;
+  // guards the node and edge lists against runtime reconfiguration.
+  std::recursive_mutex topology_mutex_;
   std::atomic_bool stop_ = {false};
   DISALLOW_COPY_AND_ASSIGN(NodeManager)
 };
@@ -95,6 +353,22 @@ class NodeManager {
 template <typename CHN, NodeType uptype, NodeType downtype>
 bool NodeManager::Connect(Node<CHN, uptype>& up, Node<CHN, downtype>& down,
                           bool reuse_chn) {
+  return Connect(NodeHandle(&up), NodeHandle(&down), reuse_chn);
+}
+
+inline bool NodeManager::Connect(NodeHandle up, NodeHandle down,
+                                 bool reuse_chn, int capacity) {
+  std::lock_guard<std::recursive_mutex> lg(topology_mutex_);
+  bool ok = true;
+  // no-op for the nodes which are not running yet.
+  Reconfigure({up.GetName(), down.GetName()}, [&]() {
+    ok = ConnectLocked(up, down, reuse_chn, capacity);
+  });
+  return ok;
+}
+
+inline bool NodeManager::ConnectLocked(NodeHandle& up, NodeHandle& down,
+                                       bool reuse_chn, int capacity) {
   std::string flow;
   auto qname = up.GetName() + ":" + down.GetName();
   // verify the connection.
@@ -108,22 +382,25 @@ bool NodeManager::Connect(Node<CHN, uptype>& up, Node<CHN, downtype>& down,
         "sink");
   }
   // ---up---[node]---down---
-  if (uptype == NodeType::NODE_SOURCE || uptype == NodeType::NODE_RELAY) {
+  if (up.Type() == NodeType::NODE_SOURCE || up.Type() == NodeType::NODE_RELAY) {
     flow = up.GetName() + "[out] ---(";
   } else {
     flow = up.GetName() + "[in] ---(";
   }
 
   // checking the exsit channels
+  MsgChannelPtr edge_chn = nullptr;
   if (reuse_chn) {
     if (up.GetChannelNum(ChnType::CHN_OUT) != 0) {
       auto& selected_chn = up.GetChannel(0, ChnType::CHN_OUT);
       down.AddChannel(selected_chn, ChnType::CHN_IN);
       flow += selected_chn->Id();
+      edge_chn = selected_chn;
     } else if (down.GetChannelNum(ChnType::CHN_IN) != 0) {
       auto& selected_chn = down.GetChannel(0, ChnType::CHN_IN);
       up.AddChannel(selected_chn, ChnType::CHN_OUT);
       flow += selected_chn->Id();
+      edge_chn = selected_chn;
     }
   }
 
@@ -132,16 +409,20 @@ bool NodeManager::Connect(Node<CHN, uptype>& up, Node<CHN, downtype>& down,
                          down.GetChannelNum(ChnType::CHN_IN) ==
                      0)) {
     typedef typename MsgChannelPtr::element_type MsgChannelType;
-    auto selected_chn = std::make_shared<MsgChannelType>(qname);
+    auto selected_chn = std::make_shared<MsgChannelType>(qname, capacity);
     up.AddChannel(selected_chn, ChnType::CHN_OUT);
     down.AddChannel(selected_chn, ChnType::CHN_IN);
     flow += selected_chn->Id();
     channel_list_.push_back(selected_chn);
+    edge_chn = selected_chn;
   }
+  edge_list_.push_back({up.GetName(), down.GetName(), edge_chn, up, down});
+  connected_[up.GetName()] = up.Type();
+  connected_[down.GetName()] = down.Type();
 
   flow += " ";
   flow += qname;
-  if (downtype == NodeType::NODE_FULL_DUPLEX) {
+  if (down.Type() == NodeType::NODE_FULL_DUPLEX) {
     flow += ")-->[out]";
   } else {
     flow += ")-->[in]";
@@ -153,13 +434,22 @@ bool NodeManager::Connect(Node<CHN, uptype>& up, Node<CHN, downtype>& down,
 
 template <typename CHN, NodeType type>
 bool NodeManager::RunAsThreads(Node<CHN, type>& node, int num) {
-  if (type == NodeType::NODE_FULL_DUPLEX && num > 1) {
-    throw std::runtime_error("Duplex node can only bind one thread.");
+  return RunAsThreads(NodeHandle(&node), num);
+}
+
+inline bool NodeManager::RunAsThreads(NodeHandle node, int num) {
+  std::lock_guard<std::recursive_mutex> lg(topology_mutex_);
+  // a duplex node runs up to one egress thread per fd it has, and per input
+  // channel: the threads sharing a channel would reorder its flows.
+  if (node.Type() == NodeType::NODE_FULL_DUPLEX && num > node.Shards()) {
+    throw std::runtime_error("Duplex node can only bind one thread per fd.");
   }
-  auto itr = node_list_.find(node.GetName());
-  if (itr == node_list_.end()) {
-    node_list_.insert({node.GetName(), {type, (void*)&node}});
-  } else {
+  if (node.Type() == NodeType::NODE_FULL_DUPLEX && num > 1 &&
+      num > node.GetChannelNum(ChnType::CHN_IN)) {
+    throw std::runtime_error(
+        "Duplex node can only bind one thread per input channel.");
+  }
+  if (node_list_.count(node.GetName()) != 0) {
     throw std::runtime_error("Duplicate node!");
   }
 
@@ -169,78 +459,900 @@ bool NodeManager::RunAsThreads(Node<CHN, type>& node, int num) {
     throw std::runtime_error("node has no available channels.");
   }
 
+  auto& entry = node_list_[node.GetName()];
+  entry.type = node.Type();
+  entry.handle = node;
+  entry.threads = num;
+  SpawnWorkers(entry, num);
+  return true;
+}
+
+inline void NodeManager::SpawnWorkers(NodeEntry& entry, int num) {
+  auto node = entry.handle;
+  auto active = entry.active;
   for (int i = 0; i < num; i++) {
-    worker_list_.emplace_back(std::thread(&Node<CHN, type>::DoWork, &node));
+    (*active)++;
+    entry.workers.emplace_back(std::thread([node, active]() mutable {
+      node.DoWork();
+      (*active)--;
+    }));
   }
+}
+
+inline void NodeManager::Reconfigure(const std::vector<std::string>& names,
+                                     const std::function<void()>& f) {
+  std::lock_guard<std::recursive_mutex> lg(topology_mutex_);
+  auto quiesced = QuiesceNodes(names);
+  f();
+  for (auto& item : quiesced) {
+    auto itr = node_list_.find(item.first);
+    if (itr == node_list_.end()) {
+      continue;
+    }
+    auto& entry = itr->second;
+    entry.handle.Resume(item.second);
+    // a source node has no up-channel, its workers read something else.
+    auto ct = entry.type == NodeType::NODE_SOURCE ? ChnType::CHN_OUT
+                                                  : ChnType::CHN_IN;
+    if (entry.handle.GetChannelNum(ct) <= 0) {
+      LOG(WARNING) << item.first << " has no channel left, keep it idle";
+      continue;
+    }
+    SpawnWorkers(entry, entry.threads);
+  }
+}
+
+inline std::vector<std::pair<std::string, bool>> NodeManager::QuiesceNodes(
+    const std::vector<std::string>& names) {
+  std::vector<std::pair<std::string, bool>> quiesced;
+  for (auto& name : names) {
+    auto itr = node_list_.find(name);
+    if (itr == node_list_.end() || stop_ ||
+        std::find_if(quiesced.begin(), quiesced.end(), [&](auto& q) {
+          return q.first == name;
+        }) != quiesced.end()) {
+      continue;
+    }
+    quiesced.push_back({name, itr->second.handle.Quiesce()});
+  }
+  for (auto& item : quiesced) {
+    auto& entry = node_list_[item.first];
+    // a worker may enter a wait right after the first interruption.
+    while (*entry.active > 0) {
+      item.second |= entry.handle.Quiesce();
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    for (auto& th : entry.workers) {
+      if (th.joinable()) {
+        th.join();
+      }
+    }
+    entry.workers.clear();
+  }
+  return quiesced;
+}
+
+inline bool NodeManager::Disconnect(const std::string& up,
+                                    const std::string& down) {
+  std::lock_guard<std::recursive_mutex> lg(topology_mutex_);
+  auto itr = std::find_if(edge_list_.begin(), edge_list_.end(),
+                          [&](const Edge& e) {
+                            return e.up == up && e.down == down;
+                          });
+  if (itr == edge_list_.end()) {
+    LOG(WARNING) << "no edge " << up << " --> " << down;
+    return false;
+  }
+  Reconfigure({up, down}, [&]() {
+    auto edge = *itr;
+    edge_list_.erase(itr);
+    DetachEdge(edge);
+    LOG(INFO) << up << " --X--> " << down;
+  });
   return true;
 }
 
-bool NodeManager::Verify() { return true; }
-void NodeManager::View() {
-  LOG(INFO) << "==================== Node view (" << node_list_.size()
-            << ") ===================";
+inline void NodeManager::DetachEdge(Edge& edge) {
+  bool up_shared = false;
+  bool down_shared = false;
+  bool used = false;
+  for (auto& e : edge_list_) {
+    if (e.channel != edge.channel) {
+      continue;
+    }
+    used = true;
+    up_shared |= e.up == edge.up;
+    down_shared |= e.down == edge.down;
+  }
+  // a reused channel stays with the end which still has other edges on it.
+  if (!up_shared) {
+    edge.up_node.RemoveChannel(edge.channel, ChnType::CHN_OUT);
+  }
+  if (!down_shared) {
+    edge.down_node.RemoveChannel(edge.channel, ChnType::CHN_IN);
+  }
+  if (!used) {
+    channel_list_.erase(std::remove(channel_list_.begin(),
+                                    channel_list_.end(), edge.channel),
+                        channel_list_.end());
+  }
+}
+
+inline bool NodeManager::SwapConsumer(const std::string& up,
+                                      const std::string& old_down,
+                                      const std::string& new_down) {
+  std::lock_guard<std::recursive_mutex> lg(topology_mutex_);
+  auto itr = std::find_if(edge_list_.begin(), edge_list_.end(),
+                          [&](const Edge& e) {
+                            return e.up == up && e.down == old_down;
+                          });
+  if (itr == edge_list_.end() || node_list_.count(new_down) == 0) {
+    LOG(WARNING) << "can't swap " << up << " --> " << old_down << " to "
+                 << new_down;
+    return false;
+  }
+  // `up` keeps writing to the same channel, so it is not quiesced.
+  Reconfigure({old_down, new_down}, [&]() {
+    auto& new_node = node_list_[new_down].handle;
+    itr->down_node.RemoveChannel(itr->channel, ChnType::CHN_IN);
+    new_node.AddChannel(itr->channel, ChnType::CHN_IN);
+    itr->down = new_down;
+    itr->down_node = new_node;
+    connected_[new_down] = new_node.Type();
+    LOG(INFO) << up << " ---(" << itr->channel->Id() << ")--> " << new_down
+              << " (was " << old_down << ")";
+  });
+  return true;
+}
+
+inline bool NodeManager::RemoveNode(const std::string& name) {
+  std::lock_guard<std::recursive_mutex> lg(topology_mutex_);
+  if (node_list_.count(name) == 0) {
+    return false;
+  }
+  std::vector<std::string> affected = {name};
+  for (auto& e : edge_list_) {
+    if (e.up == name) {
+      affected.push_back(e.down);
+    } else if (e.down == name) {
+      affected.push_back(e.up);
+    }
+  }
+  Reconfigure(affected, [&]() {
+    std::vector<Edge> removed;
+    for (auto& e : edge_list_) {
+      if (e.up == name || e.down == name) {
+        removed.push_back(e);
+      }
+    }
+    edge_list_.erase(std::remove_if(edge_list_.begin(), edge_list_.end(),
+                                    [&](const Edge& e) {
+                                      return e.up == name || e.down == name;
+                                    }),
+                     edge_list_.end());
+    for (auto& e : removed) {
+      DetachEdge(e);
+    }
+    node_list_.erase(name);
+    connected_.erase(name);
+    LOG(INFO) << "node " << name << " is removed";
+  });
+  return true;
+}
+
+inline bool NodeManager::LoadTopology() {
+  std::lock_guard<std::recursive_mutex> lg(topology_mutex_);
+  std::vector<std::string> names;
+  bool ok = false;
+  // the nodes throw if they fail to initialize or are run twice.
+  try {
+    ok = BuildTopology(&names);
+  } catch (const std::exception& e) {
+    LOG(ERROR) << "load topology failed, " << e.what();
+  }
+  if (!ok) {
+    RollBack(names);
+  }
+  return ok;
+}
+
+inline void NodeManager::RollBack(const std::vector<std::string>& names) {
+  std::lock_guard<std::recursive_mutex> lg(topology_mutex_);
+  for (auto& name : names) {
+    // quiesced, unregistered from the poller and disconnected.
+    RemoveNode(name);
+  }
+  auto built = [&](const std::string& name) {
+    return std::find(names.begin(), names.end(), name) != names.end();
+  };
+  std::vector<Edge> removed;
+  for (auto& e : edge_list_) {
+    if (built(e.up) || built(e.down)) {
+      removed.push_back(e);
+    }
+  }
+  edge_list_.erase(std::remove_if(edge_list_.begin(), edge_list_.end(),
+                                  [&](const Edge& e) {
+                                    return built(e.up) || built(e.down);
+                                  }),
+                   edge_list_.end());
+  for (auto& e : removed) {
+    DetachEdge(e);
+  }
+  for (auto& name : names) {
+    connected_.erase(name);
+  }
+  owned_nodes_.erase(std::remove_if(owned_nodes_.begin(), owned_nodes_.end(),
+                                    [&](const NodeHandle& handle) {
+                                      return built(handle.GetName());
+                                    }),
+                     owned_nodes_.end());
+  if (!names.empty()) {
+    LOG(INFO) << "the " << names.size() << " nodes of the topology are removed";
+  }
+}
+
+inline bool NodeManager::BuildTopology(std::vector<std::string>* names) {
+  bats::util::Settings& settings = bats::util::Settings::getInstance();
+  auto node_count = settings.getValue<int>("topology.node_count", 0);
+  auto edge_count = settings.getValue<int>("topology.edge_count", 0);
+  if (node_count <= 0) {
+    LOG(ERROR) << "no node in the topology settings";
+    return false;
+  }
+
+  // the reactors are set before the poller is used, a running poller is
+  // only kept if it has the reactors the settings ask for.
+  auto reactors = settings.getValue<std::string>("poller.reactors", "");
+  auto reactor_cpus = settings.getValue<std::string>("poller.cpus", "");
+  auto backend = settings.getValue<std::string>("poller.backend", "");
+  if (!reactors.empty() || !reactor_cpus.empty() || !backend.empty()) {
+    std::vector<int> reactor_cpu_set;
+    if (!reactor_cpus.empty()) {
+      for (auto& cpu : bats::util::split(reactor_cpus, ",")) {
+        reactor_cpu_set.push_back(bats::util::Stoi(cpu));
+      }
+    }
+    if (backend != "" && backend != "epoll" && backend != "io_uring") {
+      LOG(ERROR) << "unknown poller backend [" << backend << "]";
+      return false;
+    }
+    if (!bats::io::Poller::Configure(
+            reactors.empty() ? 1 : bats::util::Stoi(reactors),
+            reactor_cpu_set,
+            backend == "io_uring" ? bats::io::PollBackendType::IO_URING
+                                  : bats::io::PollBackendType::EPOLL)) {
+      LOG(ERROR) << "the poller settings can't be applied, the poller is "
+                    "running with others";
+      return false;
+    }
+  }
+  auto busy_poll_us = settings.getValue<int>("poller.busy_poll_us", -1);
+  auto socket_busy_poll_us =
+      settings.getValue<int>("poller.socket_busy_poll_us", -1);
+  if (busy_poll_us >= 0 || socket_busy_poll_us >= 0) {
+    bats::io::Poller::Instance()->SetBusyPoll(
+        std::max(busy_poll_us, 0), std::max(socket_busy_poll_us, 0));
+  }
+  auto slow_callback_us = settings.getValue<int>("poller.slow_callback_us", -1);
+  if (slow_callback_us >= 0) {
+    bats::io::Poller::Instance()->SetSlowCallback(slow_callback_us);
+  }
+
+  struct NodeSpec {
+    NodeHandle handle;
+    int threads = 1;
+    int reactor = -1;
+    bool egress_on_poller = false;
+  };
+  std::unordered_map<std::string, NodeSpec> nodes;
+  std::vector<std::string> order;
+  for (int i = 0; i < node_count; i++) {
+    auto section = "node" + std::to_string(i);
+    auto type = settings.getValue<std::string>(section + ".type", "");
+    auto name = settings.getValue<std::string>(section + ".name", section);
+    auto handle = NodeFactory::Instance()->Create(type, name, section);
+    if (!handle.Valid()) {
+      LOG(ERROR) << "unknown node type [" << type << "] of " << section;
+      return false;
+    }
+    // a running node of the name would be taken down on a failure.
+    if (nodes.count(name) != 0 || node_list_.count(name) != 0 ||
+        connected_.count(name) != 0) {
+      LOG(ERROR) << "duplicate node name [" << name << "]";
+      return false;
+    }
+    auto cpus = settings.getValue<std::string>(section + ".cpus", "");
+    if (!cpus.empty()) {
+      std::vector<int> cpu_set;
+      for (auto& cpu : bats::util::split(cpus, ",")) {
+        cpu_set.push_back(bats::util::Stoi(cpu));
+      }
+      handle.SetCpuSet(cpu_set);
+    }
+    auto dispatch = settings.getValue<std::string>(section + ".dispatch", "id");
+    if (dispatch == "round_robin") {
+      handle.SetDispatchPolicy(DispatchPolicy::DISPATCH_ROUND_ROBIN);
+    } else if (dispatch == "flow") {
+      handle.SetDispatchPolicy(DispatchPolicy::DISPATCH_BY_FLOW);
+    } else if (dispatch != "id") {
+      LOG(ERROR) << "unknown dispatch policy [" << dispatch << "] of "
+                 << section;
+      return false;
+    }
+    NodeSpec spec;
+    spec.handle = handle;
+    spec.threads = settings.getValue<int>(section + ".threads", 1);
+    spec.reactor = settings.getValue<int>(section + ".reactor", -1);
+    auto budget = settings.getValue<int>(section + ".read_budget", 0);
+    auto budget_bytes =
+        settings.getValue<int>(section + ".read_budget_bytes", 0);
+    if (budget > 0 || budget_bytes > 0) {
+      handle.SetReadBudget(budget, budget_bytes);
+    }
+    auto egress = settings.getValue<std::string>(section + ".egress", "thread");
+    if (egress == "poller" && handle.Type() == NodeType::NODE_FULL_DUPLEX) {
+      spec.egress_on_poller = true;
+      spec.threads = 0;
+    } else if (egress != "thread") {
+      LOG(ERROR) << "unknown egress [" << egress << "] of " << section;
+      return false;
+    }
+    nodes[name] = spec;
+    order.push_back(name);
+  }
+
+  // every edge is checked before the first is connected.
+  struct EdgeSpec {
+    std::string from;
+    std::string to;
+    int capacity = 100;
+    bool reuse = true;
+  };
+  std::vector<EdgeSpec> edges;
+  for (int i = 0; i < edge_count; i++) {
+    auto section = "edge" + std::to_string(i);
+    auto from = settings.getValue<std::string>(section + ".from", "");
+    auto to = settings.getValue<std::string>(section + ".to", "");
+    auto channel =
+        settings.getValue<std::string>(section + ".channel", "queue");
+    auto capacity = settings.getValue<int>(section + ".capacity", 100);
+    auto reuse = settings.getValue<int>(section + ".reuse", 1);
+    if (nodes.count(from) == 0 || nodes.count(to) == 0) {
+      LOG(ERROR) << section << " refers to an unknown node " << from << " -> "
+                 << to;
+      return false;
+    }
+    if (channel != "queue") {
+      LOG(ERROR) << "unsupported channel type [" << channel << "] of "
+                 << section;
+      return false;
+    }
+    if (nodes[from].handle.Type() == NodeType::NODE_SINK ||
+        nodes[to].handle.Type() == NodeType::NODE_SOURCE) {
+      LOG(ERROR) << section << " goes out of a sink or into a source " << from
+                 << " -> " << to;
+      return false;
+    }
+    edges.push_back({from, to, capacity, reuse != 0});
+  }
+
+  *names = order;
+  for (auto& name : order) {
+    owned_nodes_.push_back(nodes[name].handle);
+  }
+  for (auto& edge : edges) {
+    if (!Connect(nodes[edge.from].handle, nodes[edge.to].handle, edge.reuse,
+                 edge.capacity)) {
+      LOG(ERROR) << "failed to connect " << edge.from << " -> " << edge.to;
+      return false;
+    }
+  }
+
+  for (auto& name : order) {
+    auto& spec = nodes[name];
+    if (!RunAsThreads(spec.handle, spec.threads)) {
+      LOG(ERROR) << "failed to run " << name;
+      return false;
+    }
+    if (spec.handle.Type() == NodeType::NODE_FULL_DUPLEX &&
+        !spec.handle.RegisterToPoller(spec.reactor)) {
+      LOG(ERROR) << "failed to register " << name << " to poller";
+      return false;
+    }
+    if (spec.egress_on_poller &&
+        !spec.handle.RegisterEgressToPoller(spec.reactor)) {
+      LOG(ERROR) << "failed to register the egress of " << name
+                 << " to poller";
+      return false;
+    }
+  }
+  return true;
+}
+
+inline bool NodeManager::Verify() {
+  std::lock_guard<std::recursive_mutex> lg(topology_mutex_);
+  bool ok = true;
+  // A duplex node is split into its ingress `name[out]` and its egress
+  // `name[in]`, msgs never flow from one to the other inside the node.
+  auto vertex = [this](const std::string& name, ChnType ct) {
+    auto itr = connected_.find(name);
+    if (itr == connected_.end() || itr->second != NodeType::NODE_FULL_DUPLEX) {
+      return name;
+    }
+    return name + ((ct == ChnType::CHN_OUT) ? "[out]" : "[in]");
+  };
+  std::unordered_map<std::string, std::vector<std::string>> graph;
+  std::unordered_map<std::string, int> producers;
+  for (auto& edge : edge_list_) {
+    auto down = vertex(edge.down, ChnType::CHN_IN);
+    graph[vertex(edge.up, ChnType::CHN_OUT)].push_back(down);
+    // every vertex is a key, so the traversals below never insert.
+    graph[down];
+    if (node_list_.count(edge.up) != 0) {
+      producers[edge.down]++;
+    }
+    if (node_list_.count(edge.down) == 0) {
+      LOG(ERROR) << "channel " << edge.up << ":" << edge.down
+                 << " is not consumed, " << edge.down << " is not running";
+      ok = false;
+    }
+  }
+  for (auto& item : connected_) {
+    if (node_list_.count(item.first) == 0) {
+      LOG(ERROR) << "node " << item.first << " is connected but not running";
+      ok = false;
+    }
+  }
+
+  // cycles, 0: unvisited, 1: on the dfs stack, 2: done.
+  std::unordered_map<std::string, int> color;
+  std::function<bool(const std::string&)> has_cycle =
+      [&](const std::string& v) {
+        color[v] = 1;
+        for (auto& next : graph.at(v)) {
+          if (color[next] == 1) {
+            LOG(ERROR) << "cycle detected at " << v << " --> " << next;
+            return true;
+          }
+          if (color[next] == 0 && has_cycle(next)) {
+            return true;
+          }
+        }
+        color[v] = 2;
+        return false;
+      };
+  for (auto& item : graph) {
+    if (color[item.first] == 0 && has_cycle(item.first)) {
+      ok = false;
+      break;
+    }
+  }
+
+  // reachability from the ingress nodes.
+  std::unordered_map<std::string, bool> reached;
+  std::vector<std::string> pending;
   for (auto& item : node_list_) {
-    void* node = item.second.second;
-    MsgRelayNode* rnode = nullptr;
-    NodeDuplex* dnode = nullptr;
-    switch (item.second.first) {
-      case NodeType::NODE_RELAY:
-        rnode = static_cast<MsgRelayNode*>(node);
-        break;
-      case NodeType::NODE_FULL_DUPLEX:
-        dnode = static_cast<NodeDuplex*>(node);
-        break;
-      default:
-        break;
+    if (item.second.type == NodeType::NODE_SOURCE ||
+        item.second.type == NodeType::NODE_FULL_DUPLEX) {
+      pending.push_back(vertex(item.first, ChnType::CHN_OUT));
+    }
+  }
+  while (!pending.empty()) {
+    auto v = pending.back();
+    pending.pop_back();
+    if (reached[v]) {
+      continue;
+    }
+    reached[v] = true;
+    auto itr = graph.find(v);
+    if (itr == graph.end()) {
+      continue;
+    }
+    for (auto& next : itr->second) {
+      pending.push_back(next);
     }
-    if (rnode) {
-      LOG(INFO) << *rnode;
+  }
+  for (auto& item : node_list_) {
+    auto type = item.second.type;
+    if (type == NodeType::NODE_SOURCE || type == NodeType::NODE_FULL_DUPLEX) {
+      continue;
+    }
+    if (producers[item.first] == 0) {
+      LOG(ERROR) << "node " << item.first << " has no running producer";
+      ok = false;
+    } else if (!reached[item.first]) {
+      LOG(ERROR) << "node " << item.first << " is unreachable from ingress";
+      ok = false;
+    }
+  }
+
+  // capacity of each stage: threads / average service time.
+  double min_capacity = 0;
+  std::string bottleneck;
+  for (auto& item : node_list_) {
+    auto stats = item.second.handle.Stats();
+    if (stats.msgs == 0 || stats.busy_ns == 0) {
+      continue;
+    }
+    auto threads = std::max(item.second.threads, 1);
+    double service_us = static_cast<double>(stats.busy_ns) / stats.msgs / 1e3;
+    double capacity = threads * 1e6 / service_us;
+    double utilization = 0;
+    double blocked = 0;
+    if (stats.running_ns != 0) {
+      utilization = static_cast<double>(stats.busy_ns) /
+                    (static_cast<double>(stats.running_ns) * threads);
+      blocked = static_cast<double>(stats.blocked_ns) /
+                (static_cast<double>(stats.running_ns) * threads);
+    }
+    // the time blocked on full channels is the downstream's bottleneck.
+    LOG(INFO) << "stage " << item.first << " threads " << threads
+              << " service " << service_us << "us capacity " << capacity
+              << " msg/s utilization " << utilization * 100 << "% blocked "
+              << blocked * 100 << "%";
+    if (utilization > kBottleneckUtilization) {
+      LOG(WARNING) << "stage " << item.first << " is saturated, "
+                   << "more threads are needed";
     }
-    if (dnode) {
-      LOG(INFO) << *dnode;
+    if (bottleneck.empty() || capacity < min_capacity) {
+      min_capacity = capacity;
+      bottleneck = item.first;
     }
   }
+  if (!bottleneck.empty()) {
+    LOG(INFO) << "bottleneck stage " << bottleneck << " capacity "
+              << min_capacity << " msg/s";
+  }
+  return ok;
+}
+inline void NodeManager::View() {
+  std::lock_guard<std::recursive_mutex> lg(topology_mutex_);
+  LOG(INFO) << "==================== Node view (" << node_list_.size()
+            << ") ===================";
+  for (auto& item : node_list_) {
+    auto stats = item.second.handle.Stats();
+    LOG(INFO) << item.second.handle << "\ttype: "
+              << TypeName(item.second.type) << "\tmsgs: " << stats.msgs;
+  }
   LOG(INFO) << "==================== Channel view (" << channel_list_.size()
             << ") ===================";
   for (auto& chn : channel_list_) {
-    LOG(INFO) << *chn;
+    LOG(INFO) << "Channel: " << chn->Id() << "\tdepth: "
+              << chn->GetQueue().Size() << "/" << chn->GetQueue().Capacity();
+  }
+}
+
+inline const char* NodeManager::TypeName(NodeType type) {
+  switch (type) {
+    case NodeType::NODE_SOURCE:
+      return "source";
+    case NodeType::NODE_SINK:
+      return "sink";
+    case NodeType::NODE_FULL_DUPLEX:
+      return "duplex";
+    case NodeType::NODE_RELAY:
+      return "relay";
+  }
+  return "unknown";
+}
+
+inline std::string NodeManager::Quote(const std::string& s, bool json) {
+  std::string out = "\"";
+  for (unsigned char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20) {
+      // dot has no escape for the control chars, they are dropped
+      if (json) {
+        char hex[8];
+        snprintf(hex, sizeof(hex), "\\u%04x", c);
+        out += hex;
+      }
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+inline void NodeManager::TakeSnapshot(std::map<std::string, Snapshot>& nodes,
+                                      std::vector<EdgeSnapshot>& edges) {
+  std::lock_guard<std::recursive_mutex> topology_lg(topology_mutex_);
+  std::lock_guard<std::mutex> lg(export_mutex_);
+  auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::steady_clock::now().time_since_epoch())
+                 .count();
+  double interval_ns = static_cast<double>(now - last_export_ns_);
+  bool has_last = last_export_ns_ != 0 && interval_ns > 0;
+  last_export_ns_ = now;
+
+  for (auto& item : node_list_) {
+    auto& snapshot = nodes[item.first];
+    snapshot.type = item.second.type;
+    snapshot.threads = item.second.threads;
+    auto stats = item.second.handle.Stats();
+    auto& last = last_node_stats_[item.first];
+    if (has_last) {
+      snapshot.msgs_per_sec = (stats.msgs - last.msgs) * 1e9 / interval_ns;
+      snapshot.busy = (stats.busy_ns - last.busy_ns) /
+                      (interval_ns * std::max(snapshot.threads, 1));
+    } else if (stats.running_ns != 0) {
+      snapshot.msgs_per_sec = stats.msgs * 1e9 / stats.running_ns;
+      snapshot.busy = static_cast<double>(stats.busy_ns) /
+                      (stats.running_ns * std::max(snapshot.threads, 1));
+    }
+    last = stats;
+  }
+
+  std::unordered_map<std::string, uint64_t> chn_cnt;
+  for (auto& edge : edge_list_) {
+    auto& queue = edge.channel->GetQueue();
+    EdgeSnapshot snapshot;
+    snapshot.up = edge.up;
+    snapshot.down = edge.down;
+    snapshot.channel = edge.channel->Id();
+    snapshot.depth = queue.Size();
+    snapshot.capacity = queue.Capacity();
+    auto cnt = queue.Dequeued();
+    auto itr = last_chn_cnt_.find(edge.channel->Id());
+    if (has_last && itr != last_chn_cnt_.end()) {
+      snapshot.msgs_per_sec = (cnt - itr->second) * 1e9 / interval_ns;
+    }
+    chn_cnt[edge.channel->Id()] = cnt;
+    edges.push_back(snapshot);
+  }
+  last_chn_cnt_.swap(chn_cnt);
+}
+
+inline std::string NodeManager::Export(const std::string& format) {
+  std::map<std::string, Snapshot> nodes;
+  std::vector<EdgeSnapshot> edges;
+  TakeSnapshot(nodes, edges);
+
+  std::stringstream ss;
+  ss.setf(std::ios::fixed);
+  ss.precision(1);
+  if (format == "dot") {
+    ss << "digraph topology {\n  rankdir=LR;\n";
+    for (auto& item : nodes) {
+      auto& node = item.second;
+      auto name = Quote(item.first, false);
+      ss << "  " << name << " [shape="
+         << (node.type == NodeType::NODE_FULL_DUPLEX ? "box" : "ellipse")
+         << ", label=\"" << name.substr(1, name.size() - 2) << "\\nthreads "
+         << node.threads << "\\n" << node.msgs_per_sec << " msg/s\\nbusy "
+         << node.busy * 100 << "%\"];\n";
+    }
+    for (auto& item : edges) {
+      ss << "  " << Quote(item.up, false) << " -> " << Quote(item.down, false)
+         << " [label=\"" << item.depth << "/" << item.capacity << "\\n"
+         << item.msgs_per_sec << " msg/s\"";
+      if (item.depth >= item.capacity) {
+        ss << ", color=red";
+      }
+      ss << "];\n";
+    }
+    ss << "}\n";
+    return ss.str();
+  }
+
+  ss << "{\"nodes\":[";
+  bool first = true;
+  for (auto& item : nodes) {
+    auto& node = item.second;
+    ss << (first ? "" : ",") << "{\"name\":" << Quote(item.first, true)
+       << ",\"type\":\"" << TypeName(node.type)
+       << "\",\"threads\":" << node.threads
+       << ",\"msgs_per_sec\":" << node.msgs_per_sec
+       << ",\"busy_pct\":" << node.busy * 100 << "}";
+    first = false;
+  }
+  ss << "],\"edges\":[";
+  first = true;
+  for (auto& item : edges) {
+    ss << (first ? "" : ",") << "{\"from\":" << Quote(item.up, true)
+       << ",\"to\":" << Quote(item.down, true)
+       << ",\"channel\":" << Quote(item.channel, true)
+       << ",\"depth\":" << item.depth
+       << ",\"capacity\":" << item.capacity
+       << ",\"msgs_per_sec\":" << item.msgs_per_sec << "}";
+    first = false;
+  }
+  ss << "]}\n";
+  return ss.str();
+}
+
+inline bool NodeManager::ServeTopology(const std::string& path, int signo,
+                                       const std::string& prefix) {
+  if (topology_server_ == nullptr) {
+    topology_server_ = std::make_shared<TopologyServer>(
+        [this](const std::string& format) { return Export(format); });
+  }
+  bool ok = true;
+  if (!path.empty()) {
+    ok = topology_server_->Listen(path) && ok;
+  }
+  if (signo != 0) {
+    ok = topology_server_->DumpOnSignal(signo, prefix) && ok;
+  }
+  return ok;
+}
+
+inline bool NodeManager::AddProcess(const std::string& name,
+                                    const std::vector<int>& cpus,
+                                    std::function<void()> body) {
+  std::lock_guard<std::recursive_mutex> lg(topology_mutex_);
+  if (supervisor_ == nullptr) {
+    supervisor_ = std::make_shared<ProcessSupervisor>();
+  }
+  return supervisor_->Add(name, cpus, body);
+}
+
+inline bool NodeManager::StartProcesses() {
+  {
+    std::lock_guard<std::recursive_mutex> lg(topology_mutex_);
+    if (supervisor_ == nullptr) {
+      return false;
+    }
+    // the workers are forked from a copy of this process.
+    if (!node_list_.empty()) {
+      throw std::runtime_error("start the processes before running nodes.");
+    }
+  }
+  // no lock may be held across the fork.
+  return supervisor_->Start();
+}
+
+inline bool NodeManager::ServeHandoff(const std::string& path,
+                                      std::function<void()> on_done,
+                                      int drain_ms) {
+  std::lock_guard<std::recursive_mutex> lg(topology_mutex_);
+  if (handoff_fd_ >= 0 || (handoff_fd_ = WarmRestart::Listen(path)) < 0) {
+    return false;
+  }
+  LOG(INFO) << "wait for the successor on " << path;
+  auto listen_fd = handoff_fd_;
+  handoff_thread_ = std::thread([this, listen_fd, path, on_done, drain_ms]() {
+    int sock = -1;
+    while ((sock = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC)) < 0 &&
+           errno == EINTR) {
+    }
+    if (sock < 0) {
+      // closed by `Shutdown`.
+      return;
+    }
+    auto ok = Handoff(sock, drain_ms);
+    close(sock);
+    unlink(path.c_str());
+    if (ok && on_done) {
+      on_done();
+    }
+  });
+  return true;
+}
+
+inline bool NodeManager::Handoff(int sock, int drain_ms) {
+  std::lock_guard<std::recursive_mutex> lg(topology_mutex_);
+  LOG(INFO) << "hand off to the successor";
+  std::vector<std::string> names;
+  for (auto& item : node_list_) {
+    item.second.handle.StopIngress();
+    item.second.handle.Flush();
+    names.push_back(item.first);
+  }
+  // let the msgs in flight reach the fds.
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(drain_ms);
+  while (std::chrono::steady_clock::now() < deadline) {
+    bool empty = true;
+    for (auto& chn : channel_list_) {
+      empty &= chn->GetQueue().Empty();
+    }
+    if (empty) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  QuiesceNodes(names);
+
+  // the msgs a producer was writing when it was quiesced.
+  std::vector<std::pair<MsgChannelPtr, BaseMsg_ptr>> stashed;
+  for (auto& item : node_list_) {
+    item.second.handle.TakeStashed(stashed);
+  }
+  WarmRestart::MsgList msgs;
+  for (auto& chn : channel_list_) {
+    auto key = ChannelKey(chn);
+    MsgChannelPtr::element_type::value_type msg;
+    while (chn->GetQueue().TryDequeue(msg)) {
+      msgs.push_back({key, msg});
+    }
+    for (auto& item : stashed) {
+      if (item.first == chn) {
+        msgs.push_back({key, item.second});
+      }
+    }
   }
+  WarmRestart::FdList fds;
+  for (auto& item : node_list_) {
+    item.second.handle.HandoffFds(fds);
+  }
+  return WarmRestart::Send(sock, fds, msgs);
+}
+
+inline std::string NodeManager::ChannelKey(const MsgChannelPtr& chn) {
+  auto& name = chn->GetQueue().GetName();
+  int nth = 0;
+  for (auto& other : channel_list_) {
+    if (other == chn) {
+      break;
+    }
+    nth += other->GetQueue().GetName() == name;
+  }
+  return nth == 0 ? name : name + "#" + std::to_string(nth);
+}
+
+inline bool NodeManager::Takeover(const std::string& path) {
+  return WarmRestart::Instance()->Receive(path);
+}
+
+inline int NodeManager::RestoreQueued(WarmRestart::MsgMaker maker) {
+  std::lock_guard<std::recursive_mutex> lg(topology_mutex_);
+  int restored = 0;
+  for (auto& chn : channel_list_) {
+    auto name = ChannelKey(chn);
+    for (auto& msg : WarmRestart::Instance()->TakeMsgs(name, maker)) {
+      if (!chn->TryWriteMessage(msg)) {
+        LOG(WARNING) << "channel " << name << " is full, drop restored msgs";
+        break;
+      }
+      restored++;
+    }
+  }
+  LOG(INFO) << "restored " << restored << " queued msgs";
+  return restored;
 }
 
 inline void NodeManager::Shutdown() {
   if (stop_.exchange(true)) {
     return;
   }
+  if (handoff_fd_ >= 0) {
+    // break the accept of the handoff thread.
+    shutdown(handoff_fd_, SHUT_RDWR);
+    if (handoff_thread_.get_id() == std::this_thread::get_id()) {
+      handoff_thread_.detach();
+    } else if (handoff_thread_.joinable()) {
+      handoff_thread_.join();
+    }
+    close(handoff_fd_);
+    handoff_fd_ = -1;
+  }
+  if (topology_server_) {
+    topology_server_->Stop();
+  }
+  if (supervisor_) {
+    supervisor_->Stop();
+  }
   // reset the flag for services.
   for (auto& item : node_list_) {
-    void* node = item.second.second;
-    MsgRelayNode* rnode = nullptr;
-    NodeDuplex* dnode = nullptr;
-    switch (item.second.first) {
-      case NodeType::NODE_RELAY:
-        rnode = static_cast<MsgRelayNode*>(node);
-        break;
-      case NodeType::NODE_FULL_DUPLEX:
-        dnode = static_cast<NodeDuplex*>(node);
-        break;
-      default:
-        break;
-    }
-    if (rnode) {
-      rnode->Stop();
-    }
-    if (dnode) {
-      dnode->Stop();
-    }
+    item.second.handle.Stop();
   }
   // worker exit
-  for (auto& th : worker_list_) {
-    if (th.joinable()) {
-      th.join();
+  std::lock_guard<std::recursive_mutex> lg(topology_mutex_);
+  for (auto& item : node_list_) {
+    for (auto& th : item.second.workers) {
+      if (th.joinable()) {
+        th.join();
+      }
     }
+    item.second.workers.clear();
   }
   std::vector<MsgChannelPtr>().swap(channel_list_);
-  std::vector<std::thread>().swap(worker_list_);
+  std::vector<NodeHandle>().swap(owned_nodes_);
+  std::vector<Edge>().swap(edge_list_);
   SYSLOG(INFO) << "release all resource!";
 }
 
@@ -0,0 +1,157 @@
+/**
+ * @file node_ordered.h
+ * @author peng lei (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-11-20
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef SRC_EXAMPLE_APP_SRC_NODE_ORDERED_H_
+#define SRC_EXAMPLE_APP_SRC_NODE_ORDERED_H_
+
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "channel.h"
+#include "node.h"
+#include "reorder_buffer.h"
+
+/**
+ * @brief Order-preserving parallel mode for a relay node.
+ *
+ * Every message read from an up-channel gets a stage sequence number while the
+ * channel is still locked. Workers run `HandleMsg` concurrently, the messages a
+ * worker dispatches are collected and committed to a reorder buffer, which
+ * re-emits them to the down-channels in ingress order.
+ *
+ * Without a key function the order is kept globally per up-channel. With a key
+ * function messages are split into `lanes` and only the order inside a lane is
+ * kept, so a slow flow doesn't hold back the others.
+ *
+ * Usage:
+ *   Ordered<bats::src::Encoder> encoder;
+ *   NodeManager::Instance()->RunAsThreads(encoder, 4);
+ *
+ * @tparam NODE A relay node.
+ */
+template <typename NODE>
+class Ordered : public NODE {
+ public:
+  typedef typename NODE::msg_type msg_type;
+  typedef std::vector<msg_type> Batch;
+  typedef std::function<uint64_t(const msg_type&)> KeyFunc;
+
+  template <typename... Args>
+  explicit Ordered(Args&&... args) : NODE(std::forward<Args>(args)...) {
+    static_assert(std::is_base_of<MsgRelayNode, NODE>::value,
+                  "Only relay nodes can run in ordered mode.");
+  }
+  virtual ~Ordered() = default;
+  /**
+   * @brief Keep the order per flow instead of globally. Must be called before
+   * the node runs.
+   *
+   * @param key Maps a message to its flow.
+   * @param lanes The number of independent reorder lanes.
+   */
+  void SetFlowKey(KeyFunc key, int lanes) {
+    key_f_ = std::move(key);
+    lane_num_ = (key_f_ && lanes > 0) ? lanes : 1;
+  }
+  /**
+   * @brief The max number of in flight messages per lane.
+   *
+   * @param window
+   */
+  void SetWindow(int window) { window_ = window; }
+
+  void DoWork() override {
+    uint64_t zero = 0;
+    this->start_ns_.compare_exchange_strong(zero, this->NowNs());
+    this->ThreadAffinity();
+    auto chn_index = this->IncThreads();
+    auto& channel = this->GetChannel(chn_index, ChnType::CHN_IN);
+    auto& lanes = GetLanes(chn_index);
+    while (!this->is_stop_) {
+      msg_type msg = nullptr;
+      Lane* lane = nullptr;
+      uint64_t seq = 0;
+      channel->ReadMessage(msg, [&](const msg_type& m) {
+        lane = lanes[key_f_ ? key_f_(m) % lanes.size() : 0].get();
+        seq = lane->ingress++;
+      });
+      if (msg == nullptr) {
+        continue;
+      }
+
+      Batch batch;
+      batch_ = &batch;
+      if (unlikely(this->StopSignal(msg))) {
+        LOG(INFO) << this->GetName() << " received stop signal";
+        this->Dispatch(msg);
+      } else {
+        this->Measure([&]() { this->HandleMsg(msg); });
+      }
+      batch_ = nullptr;
+      // a message without output still has to advance the sequence.
+      lane->reorder.Commit(seq, std::move(batch));
+    }
+  }
+  /**
+   * @brief Collect the output of the current message. Messages dispatched by
+   * other threads, e.g. timers, are not part of the ingress order and go out
+   * directly.
+   *
+   * @param msg
+   */
+  void Dispatch(const msg_type& msg) override {
+    if (batch_ != nullptr) {
+      batch_->push_back(msg);
+      return;
+    }
+    NODE::Dispatch(msg);
+  }
+
+ private:
+  struct Lane {
+    Lane(int window, typename ReorderBuffer<Batch>::Emitter emit)
+        : reorder(window, std::move(emit)) {}
+    // only written in the dequeue critical section of the up-channel.
+    uint64_t ingress = 0;
+    ReorderBuffer<Batch> reorder;
+  };
+  typedef std::vector<std::unique_ptr<Lane>> Lanes;
+
+  Lanes& GetLanes(int chn_index) {
+    std::unique_lock<std::mutex> lg(this->mutex_);
+    auto& lanes = lanes_[chn_index];
+    if (lanes.empty()) {
+      for (int i = 0; i < lane_num_; i++) {
+        lanes.emplace_back(new Lane(window_, [this](Batch& batch) {
+          for (auto& msg : batch) {
+            NODE::Dispatch(msg);
+          }
+        }));
+      }
+    }
+    return lanes;
+  }
+
+  KeyFunc key_f_ = nullptr;
+  int lane_num_ = 1;
+  int window_ = 1024;
+  // one set of lanes per up-channel.
+  std::unordered_map<int, Lanes> lanes_;
+  static thread_local Batch* batch_;
+};
+
+template <typename NODE>
+thread_local typename Ordered<NODE>::Batch* Ordered<NODE>::batch_ = nullptr;
+
+#endif  // SRC_EXAMPLE_APP_SRC_NODE_ORDERED_H_
@@ -11,6 +11,7 @@
 #include "node_tun.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <glog/logging.h>
 #include <linux/if.h>
@@ -21,10 +22,13 @@
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "rtnetlink.h"
 #include "util.h"
 #include "util/net_msg.h"
+#include "util/warm_restart.h"
 
 namespace bats {
 namespace src {
@@ -33,57 +37,267 @@ const char TUN_DEVICE[] = "/dev/net/tun";
 
 bool Tun::Init() {
   SYSLOG(INFO) << "tun init";
-  if ((fd_ = open(TUN_DEVICE, O_RDWR)) < 0) {
-    LOG(INFO) << "Opening " << TUN_DEVICE << " failed";
+  fds_.clear();
+  bool taken = false;
+  for (int shard = 0; shard < queues_; shard++) {
+    // the device is kept up by the fd of the predecessor.
+    int fd = WarmRestart::Instance()->TakeFd(ShardHandoffKey(shard));
+    if (fd >= 0) {
+      LOG(INFO) << "take over " << ifname_ << " fd " << fd;
+      taken = true;
+    } else {
+      fd = Open(shard);
+    }
+    if (fd < 0) {
+      for (auto opened : fds_) {
+        close(opened);
+      }
+      fds_.clear();
+      return false;
+    }
+    fds_.push_back(fd);
+  }
+  fd_ = fds_[0];
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  if (ioctl(fd_, TUNGETIFF, (void*)&ifr) == 0) {
+    vnet_hdr_ = ifr.ifr_flags & IFF_VNET_HDR;
+  }
+  if (taken) {
+    is_stop_ = false;
+    return true;
+  }
+  // setting address, "10.0.0.1" or "10.0.0.1/16", "fd00::1/64"
+  int masklen = 0;
+  std::string ip;
+  int default_masklen =
+      base::util::Rtnetlink::MaxPrefixLen(ipaddr_) == 128 ? 64 : 24;
+  base::util::Rtnetlink rtnl;
+  if (!base::util::Rtnetlink::ParseAddress(ipaddr_, &ip, &masklen,
+                                           default_masklen) ||
+      !rtnl.AddAddress(ifname_, ip, masklen) || !rtnl.SetLink(ifname_, true)) {
+    for (auto fd : fds_) {
+      close(fd);
+    }
+    fds_.clear();
+    fd_ = -1;
     return false;
   }
+  base::util::Rtnetlink::SetRpFilter(ifname_, 0);
+  is_stop_ = false;
+  return true;
+}
+
+bool Tun::SetMtu(int mtu) {
+  return base::util::Rtnetlink().SetLink(ifname_, false, mtu);
+}
+
+bool Tun::SetTxQueueLen(int len) {
+  return base::util::Rtnetlink().SetLink(ifname_, false, 0, len);
+}
+
+int Tun::Open(int shard) {
+  int fd = open(TUN_DEVICE, O_RDWR);
+  if (fd < 0) {
+    LOG(INFO) << "Opening " << TUN_DEVICE << " failed";
+    return -1;
+  }
 
   struct ifreq ifr;
   memset(&ifr, 0, sizeof(ifr));
   ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
-  strncpy(ifr.ifr_name, name_.c_str(), IFNAMSIZ);
+  // every queue attaches to the same device
+  if (queues_ > 1) {
+    ifr.ifr_flags |= IFF_MULTI_QUEUE;
+  }
+  if (offload_) {
+    ifr.ifr_flags |= IFF_VNET_HDR;
+  }
+  strncpy(ifr.ifr_name, ifname_.c_str(), IFNAMSIZ);
 
-  if (ioctl(fd_, TUNSETIFF, (void*)&ifr) < 0) {
-    LOG(INFO) << "ioctl " << name_ << " failed";
-    close(fd_);
-    return false;
+  if (ioctl(fd, TUNSETIFF, (void*)&ifr) < 0) {
+    LOG(INFO) << "ioctl " << ifname_ << " queue " << shard << " failed, "
+              << strerror(errno);
+    close(fd);
+    return -1;
   }
-  // setting address
-  int masklen = 24;
-  auto mask =
-      bats::util::IntToIpString(htonl((uint32_t)NETMASK_VALUE(32 - masklen)));
-  bats::util::exe_shell("ifconfig %s %s netmask %s", name_.c_str(),
-                        ipaddr_.c_str(), mask.c_str());
-  bats::util::exe_shell("echo 0 > /proc/sys/net/ipv4/conf/%s/rp_filter",
-                        name_.c_str());
-  bats::util::exe_shell("ifconfig %s up", name_.c_str());
-  is_stop_ = false;
+  // the kernel may hand over TCP packets of up to 64KB with partial checksums.
+  // Not TSO6, the node carries ipv4 only and the ipv6 ones are segmented by
+  // the kernel as without offloads.
+  unsigned offloads = TUN_F_CSUM | TUN_F_TSO4;
+  if (offload_ && ioctl(fd, TUNSETOFFLOAD, offloads) < 0) {
+    LOG(WARNING) << "tun " << ifname_ << " offload failed, " << strerror(errno);
+  }
+  return fd;
+}
+
+int Tun::FDRecv() { return Recv(fd_); }
+
+int Tun::FDRecvBatch(int shard, int max_msgs, int* msgs) {
+  if (!rx_rings_.empty()) {
+    return RecvUring(shard, max_msgs, msgs);
+  }
+  *msgs = 1;
+  return Recv(fds_[shard]);
+}
+
+bool Tun::SetUring(bool enable) {
+  rx_rings_.clear();
+  uring_tx_ = false;
+  if (!enable) {
+    return true;
+  }
+  int buffers = vnet_hdr_ ? kUringGsoPackets : kUringPackets;
+  rx_rings_.resize(fds_.size());
+  for (size_t shard = 0; shard < fds_.size(); shard++) {
+    auto& ring = rx_rings_[shard];
+    ring.reader = bats::io::UringReader::Make(fds_[shard], false, buffers);
+    if (!ring.reader) {
+      LOG(WARNING) << "tun io_uring reads unsupported, read is used";
+      rx_rings_.clear();
+      return false;
+    }
+    for (int bid = 0; bid < buffers; bid++) {
+      if (vnet_hdr_) {
+        ring.bufs.emplace_back(base::util::kVnetHdrLen +
+                               base::util::kMaxGsoPacket);
+        ring.reader->Provide(bid, ring.bufs[bid].data(), ring.bufs[bid].size());
+      } else {
+        ring.msgs.push_back(std::make_shared<bats::util::NetMsg>());
+        ring.reader->Provide(bid, ring.msgs[bid]->begin(),
+                             ring.msgs[bid]->size());
+      }
+    }
+  }
+  uring_tx_ = true;
   return true;
 }
 
-int Tun::FDRecv() {
+int Tun::PollFd(int shard) const {
+  return rx_rings_.empty() ? fds_[shard] : rx_rings_[shard].reader->RingFd();
+}
+
+int Tun::RecvUring(int shard, int max_msgs, int* msgs) {
+  auto& ring = rx_rings_[shard];
+  int bytes = 0;
+  int ret = ring.reader->Read(max_msgs, [&](int bid, int len) {
+    if (vnet_hdr_) {
+      // the segments are copied out, the buffer goes back at once
+      auto& buf = ring.bufs[bid];
+      bytes += DispatchGso(buf.data(), len);
+      ring.reader->Provide(bid, buf.data(), buf.size());
+      return;
+    }
+    // the msg read is handed on, a new one takes its place in the ring
+    auto msg = std::move(ring.msgs[bid]);
+    auto& next = ring.msgs[bid];
+    next = std::make_shared<bats::util::NetMsg>();
+    ring.reader->Provide(bid, next->begin(), next->size());
+    bytes += DispatchPacket(msg, len);
+  });
+  *msgs = std::max(ret, 0);
+  return ret < 0 ? ret : bytes;
+}
+
+int Tun::TxFd(const char* packet, int len) const {
+  if (fds_.size() == 1) {
+    return fd_;
+  }
+  // a truncated packet hashes to 0, the first queue
+  return fds_[base::util::IpFlowHash(packet, len) % fds_.size()];
+}
+
+int Tun::Recv(int fd) {
+  if (vnet_hdr_) {
+    return RecvGso(fd);
+  }
   auto msg = std::make_shared<bats::util::NetMsg>();
-  int ret = read(fd_, (char*)msg->begin(), msg->size());
+  int ret = read(fd, (char*)msg->begin(), msg->size());
   if (ret < 0) {
     return ret;
   }
-  msg->resize(ret);
+  return DispatchPacket(msg, ret);
+}
+
+int Tun::DispatchPacket(const msg_type& msg, int len) {
+  msg->resize(len);
   msg->decode();
   // handle IPv4 packet
   if (!msg->IsIPv4()) {
     SYSLOG(INFO) << "Tun drop none ipv4 msg";
     return 0;
   }
-  if (ret >= 0) {
+  Dispatch(msg);
+  return len;
+}
+
+int Tun::RecvGso(int fd) {
+  // a reactor thread reads one queue at a time
+  thread_local std::vector<char> buf(base::util::kVnetHdrLen +
+                                     base::util::kMaxGsoPacket);
+  int ret = read(fd, buf.data(), buf.size());
+  if (ret < 0) {
+    return ret;
+  }
+  return DispatchGso(buf.data(), ret);
+}
+
+int Tun::DispatchGso(const char* buf, int len) {
+  if (len < base::util::kVnetHdrLen + MIN_IPHEADER_LEN) {
+    return 0;
+  }
+  base::util::VnetHdr hdr;
+  memcpy(&hdr, buf, sizeof(hdr));
+  const char* packet = buf + base::util::kVnetHdrLen;
+  if ((packet[0] >> 4) != 0x4) {
+    SYSLOG(INFO) << "Tun drop none ipv4 msg";
+    return 0;
+  }
+  std::vector<std::shared_ptr<bats::util::NetMsg>> segs;
+  int num = base::util::GsoSegment(
+      hdr, packet, len - base::util::kVnetHdrLen, [&segs](int seg_len) {
+        segs.push_back(std::make_shared<bats::util::NetMsg>(seg_len));
+        return (char*)segs.back()->begin();
+      });
+  if (num < 0) {
+    LOG(WARNING) << "Tun drop gso packet, type " << (int)hdr.gso_type;
+    return 0;
+  }
+  for (auto& msg : segs) {
+    msg->decode();
     Dispatch(msg);
   }
-  return ret;
+  return len;
 }
 
 int Tun::FDWrite(const msg_type& msg) {
   if (!msg) {
     return -1;
   }
+  thread_local std::vector<base::util::TunFrame> frames;
+  frames.clear();
+  ParseFrames(msg, &frames);
+  WriteFrames(frames);
+  return msg->size();
+}
+
+int Tun::FDWriteBatch(const msg_type* msgs, int num) {
+  // the segments of a flow across the msgs are coalesced
+  thread_local std::vector<base::util::TunFrame> frames;
+  frames.clear();
+  int written = 0;
+  for (int i = 0; i < num; i++) {
+    if (msgs[i]) {
+      ParseFrames(msgs[i], &frames);
+      written++;
+    }
+  }
+  WriteFrames(frames);
+  return written;
+}
+
+void Tun::ParseFrames(const msg_type& msg,
+                      std::vector<base::util::TunFrame>* frames) const {
   char* data = (char*)msg->begin();
   char* frame_start = data;
   while (true) {
@@ -106,17 +320,85 @@ int Tun::FDWrite(const msg_type& msg) {
                 << frame_size;
       break;
     }
-    int ret = write(fd_, frame_start, frame_size);
-    if (ret < 0) {
-      LOG(INFO) << ("write errors");
-    }
+    frames->push_back({frame_start, static_cast<int>(frame_size)});
     frame_start += frame_size;
     int remain_bytes = msg->size() - (frame_start - data);
     if (remain_bytes <= 20) {
       break;
     }
   }
-  return msg->size();
+}
+
+void Tun::WriteFrames(const std::vector<base::util::TunFrame>& frames) {
+  auto writer = uring_tx_ ? bats::io::UringWriter::ThreadLocal() : nullptr;
+  if (!vnet_hdr_) {
+    // the iovs live until the flush, no reallocation after the reserve
+    thread_local std::vector<struct iovec> iovs;
+    iovs.clear();
+    iovs.reserve(frames.size());
+    for (auto& frame : frames) {
+      int fd = TxFd(frame.data, frame.len);
+      if (writer != nullptr) {
+        iovs.push_back({(void*)frame.data, static_cast<size_t>(frame.len)});
+        writer->Writev(fd, &iovs.back(), 1);
+        continue;
+      }
+      int ret = write(fd, frame.data, frame.len);
+      if (ret < 0) {
+        LOG(INFO) << ("write errors");
+      }
+    }
+    if (writer != nullptr) {
+      writer->Flush();
+    }
+    return;
+  }
+  // a run takes a frame at least, so there are no more writes than frames
+  thread_local std::vector<GsoWrite> writes;
+  if (writes.size() < frames.size()) {
+    writes.resize(frames.size());
+  }
+  int num = 0;
+  for (size_t i = 0; i < frames.size();) {
+    int run = base::util::GroRunLength(&frames[i], frames.size() - i);
+    auto& gso = writes[num++];
+    BuildGso(&frames[i], run, &gso);
+    i += run;
+    if (writer != nullptr) {
+      writer->Writev(gso.fd, gso.iovs, gso.iovcnt);
+      continue;
+    }
+    if (writev(gso.fd, gso.iovs, gso.iovcnt) < 0) {
+      LOG(INFO) << "write errors, " << strerror(errno);
+    }
+  }
+  if (writer != nullptr) {
+    writer->Flush();
+  }
+}
+
+void Tun::BuildGso(const base::util::TunFrame* frames, int num,
+                   GsoWrite* write) const {
+  auto iovs = write->iovs;
+  write->vnet = base::util::VnetHdr();
+  iovs[0].iov_base = &write->vnet;
+  iovs[0].iov_len = sizeof(write->vnet);
+  write->iovcnt = 2;
+  if (num == 1) {
+    iovs[1].iov_base = (void*)frames[0].data;
+    iovs[1].iov_len = frames[0].len;
+  } else {
+    // the headers of the first segment and the payloads of all
+    int hlen =
+        base::util::GroBuildHeader(frames, num, &write->vnet, write->head);
+    iovs[1].iov_base = write->head;
+    iovs[1].iov_len = hlen;
+    for (int i = 0; i < num; i++, write->iovcnt++) {
+      iovs[write->iovcnt].iov_base = (void*)(frames[i].data + hlen);
+      iovs[write->iovcnt].iov_len = frames[i].len - hlen;
+    }
+  }
+  write->fd = TxFd(frames[0].data, frames[0].len);
 }
 
 }  // namespace src
@@ -11,34 +11,152 @@
 
 #ifndef SRC_EXAMPLE_APP_SRC_NODE_TUN_H_
 #define SRC_EXAMPLE_APP_SRC_NODE_TUN_H_
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "channel.h"
+#include "io/uring_io.h"
 #include "node.h"
 #include "node_duplex.h"
+#include "tun_offload.h"
 
 namespace bats {
 namespace src {
 
 /**
- * @brief A tun service.
+ * @brief A tun service. With more than one queue the device is opened with
+ * `IFF_MULTI_QUEUE`, the kernel spreads the flows over the queues and each
+ * queue is read on its own reactor.
+ *
+ * A flow keeps its order on the way out if a single thread writes it: run
+ * one thread per input channel, e.g. `queues` channels each connected with
+ * `reuse_chn` false, and dispatch to them with `DISPATCH_BY_FLOW` upstream.
+ *
+ * With `offload` the device is opened with `IFF_VNET_HDR` and TSO enabled for
+ * ipv4: a read returns a GSO packet of up to 64KB which is segmented into
+ * msgs of single packets, and the segments of a TCP flow in a batch of msgs
+ * are coalesced into one write.
+ *
+ * The node is named after the interface unless `name` is given.
  *
  */
 class Tun : public NodeDuplex {
  public:
-  Tun(const std::string& ifname, const std::string& ip)
-      : NodeDuplex(ifname), ipaddr_(ip) {
+  Tun(const std::string& ifname, const std::string& ip, int queues = 1,
+      bool offload = false, const std::string& name = "")
+      : NodeDuplex(name.empty() ? ifname : name),
+        ifname_(ifname),
+        ipaddr_(ip),
+        queues_(std::max(queues, 1)),
+        offload_(offload) {
     if (!Init()) {
       throw std::runtime_error("TUN node init failed.");
     }
   }
-  virtual ~Tun() {}
+  virtual ~Tun() {
+    // `fd_` is the first one, closed by `FullDuplex`
+    for (size_t i = 1; i < fds_.size(); i++) {
+      close(fds_[i]);
+    }
+  }
 
   // FullDuplex
   int FDRecv() override;
   int FDWrite(const msg_type& msg) override;
+  int FDRecvBatch(int shard, int max_msgs, int* msgs) override;
+  int FDWriteBatch(const msg_type* msgs, int num) override;
+  int Shards() const override { return fds_.size(); }
+  int ShardFd(int shard) const override { return fds_[shard]; }
+  int PollFd(int shard) const override;
   bool Init() override;
+  std::string HandoffKey() const override { return "tun:" + ifname_; }
+  /**
+   * @brief Whether the packets carry a vnet header, a device taken over keeps
+   * the flags of its predecessor.
+   *
+   */
+  bool Offload() const { return vnet_hdr_; }
+  /**
+   * @brief Set the mtu of the device, through rtnetlink like the address.
+   *
+   * @param mtu
+   * @return false
+   */
+  bool SetMtu(int mtu);
+  /**
+   * @brief Set the length of the transmit queue of the device.
+   *
+   * @param len
+   * @return false
+   */
+  bool SetTxQueueLen(int len);
+  /**
+   * @brief Read each queue by a multishot io_uring read into a ring of
+   * provided buffers, and submit the writes of a batch by one
+   * `io_uring_enter` instead of a `write` each. The poller watches the rings
+   * of the queues. Call it before the node is registered to the poller.
+   *
+   * @param enable
+   * @return false Return false if the kernel lacks multishot reads (linux
+   * 6.7), the queues are read by `read` then. The writes fall back to
+   * `writev` on a thread without io_uring.
+   */
+  bool SetUring(bool enable);
 
  private:
+  // the buffers a queue lends to its io_uring reader, a buffer `i` is
+  // `msgs[i]` or `bufs[i]` with the vnet header.
+  struct RxRing {
+    std::unique_ptr<bats::io::UringReader> reader;
+    std::vector<msg_type> msgs;
+    std::vector<std::vector<char>> bufs;
+  };
+  // a TSO write, its iovs point to `vnet`, `head` and the frames
+  struct GsoWrite {
+    base::util::VnetHdr vnet;
+    char head[base::util::kMaxGroHeader];
+    struct iovec iovs[base::util::kMaxGroSegments + 2];
+    int iovcnt = 0;
+    int fd = -1;
+  };
+  // open the queue `shard` of the device
+  int Open(int shard);
+  int Recv(int fd);
+  // read a GSO packet and dispatch its segments
+  int RecvGso(int fd);
+  // dispatch the packet of `len` bytes read into `msg`
+  int DispatchPacket(const msg_type& msg, int len);
+  // dispatch the segments of the GSO packet of `len` bytes read into `buf`
+  int DispatchGso(const char* buf, int len);
+  // take the reads of the io_uring reader of `shard`
+  int RecvUring(int shard, int max_msgs, int* msgs);
+  // append the ip packets in `msg` to `frames`
+  void ParseFrames(const msg_type& msg,
+                   std::vector<base::util::TunFrame>* frames) const;
+  void WriteFrames(const std::vector<base::util::TunFrame>& frames);
+  // build a TSO packet coalesced from `num` frames, or a single one
+  void BuildGso(const base::util::TunFrame* frames, int num,
+                GsoWrite* write) const;
+  // the queue to write a packet of `len` bytes to, all the packets of a flow
+  // go to the same one.
+  int TxFd(const char* packet, int len) const;
+
+  std::string ifname_;
   std::string ipaddr_;
+  int queues_ = 1;
+  std::vector<int> fds_;
+  bool offload_ = false;
+  bool vnet_hdr_ = false;
+  // per queue with `SetUring`, empty otherwise
+  std::vector<RxRing> rx_rings_;
+  bool uring_tx_ = false;
+  static const int kUringPackets = 256;
+  static const int kUringGsoPackets = 16;
   DISALLOW_COPY_AND_ASSIGN(Tun)
 };
 
@@ -12,19 +12,50 @@
 
 #include <arpa/inet.h>
 #include <glog/logging.h>
+#include <linux/filter.h>
+#include <netinet/udp.h>
+#include <sched.h>
 #include <stdint.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <cstring>
+
 #include "protocol.h"
 #include "util.h"
 #include "util/bats_msg.h"
+#include "util/warm_restart.h"
 namespace bats {
 namespace src {
 
 bool Udp::Init() {
-  if ((fd_ = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-    return false;
+  fds_.clear();
+  for (int shard = 0; shard < sockets_; shard++) {
+    int fd = Open(shard);
+    if (fd < 0) {
+      for (auto opened : fds_) {
+        close(opened);
+      }
+      fds_.clear();
+      return false;
+    }
+    fds_.push_back(fd);
+  }
+  fd_ = fds_[0];
+  is_stop_ = false;
+  return true;
+}
+
+int Udp::Open(int shard) {
+  // the socket is still bound, no datagram is lost in between.
+  int fd = WarmRestart::Instance()->TakeFd(ShardHandoffKey(shard));
+  if (fd >= 0) {
+    LOG(INFO) << "take over socket " << fd << " on port " << port_;
+    return fd;
+  }
+  if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+    return -1;
   }
   struct sockaddr_in servaddr;
   memset(&servaddr, 0, sizeof(servaddr));
@@ -33,26 +64,56 @@ bool Udp::Init() {
   servaddr.sin_addr.s_addr = INADDR_ANY;
   servaddr.sin_port = htons(port_);
   int64_t temp = 1L;
-  if (setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &temp, sizeof(int)) < 0) {
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &temp, sizeof(int)) < 0) {
     LOG(ERROR) << "setsockopt error " << strerror(errno);
-    return false;
+    close(fd);
+    return -1;
   }
 
-  if (setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT, &temp, sizeof(int)) < 0) {
+  // the sockets of the node share the port
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &temp, sizeof(int)) < 0) {
     LOG(ERROR) << "setsockopt error " << strerror(errno);
-    return false;
+    close(fd);
+    return -1;
   }
 
   // Bind the socket with the server address
-  if (bind(fd_, (const struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
+  if (bind(fd, (const struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
     LOG(ERROR) << "bind error " << strerror(errno);
+    close(fd);
+    return -1;
+  }
+  LOG(INFO) << "bind socket " << fd << " on port " << port_;
+  return fd;
+}
+
+bool Udp::SteerByCpu() {
+  struct sock_filter code[] = {
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0,
+       static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)},
+      {BPF_ALU | BPF_MOD | BPF_K, 0, 0, static_cast<uint32_t>(fds_.size())},
+      {BPF_RET | BPF_A, 0, 0, 0},
+  };
+  struct sock_fprog prog;
+  prog.len = sizeof(code) / sizeof(code[0]);
+  prog.filter = code;
+  // the program serves the whole group, the index is the order of binding.
+  if (setsockopt(fds_[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                 sizeof(prog)) < 0) {
+    LOG(ERROR) << "attach reuseport program error " << strerror(errno);
     return false;
   }
-  LOG(INFO) << "bind socket " << fd_ << " on port " << port_;
-  is_stop_ = false;
   return true;
 }
 
+int Udp::TxFd() const {
+  if (fds_.size() == 1) {
+    return fd_;
+  }
+  int cpu = sched_getcpu();
+  return fds_[(cpu < 0 ? 0 : cpu) % fds_.size()];
+}
+
 int Udp::FDRecv() {
   auto msg = std::make_shared<bats::util::BatsMsg>();
   int ret = recvfrom(fd_, (char*)msg->begin(), msg->size(), 0, NULL, NULL);
@@ -64,7 +125,303 @@ int Udp::FDRecv() {
   return ret;
 }
 
-int Udp::FDWrite(const msg_type& msg) {
+void Udp::SetBatch(int msgs, int flush_us) {
+  batch_ = std::min(std::max(msgs, 1), kMaxBatch);
+  SetWriteBatch(batch_, flush_us);
+  ResizePool();
+}
+
+void Udp::SetOffload(bool gso, bool gro) {
+  for (auto fd : fds_) {
+    // a 0 segment size probes the option without segmenting every send
+    int zero = 0;
+    if (gso && setsockopt(fd, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) < 0) {
+      LOG(WARNING) << "udp gso unsupported, " << strerror(errno);
+      gso = false;
+    }
+    int value = gro ? 1 : 0;
+    if (setsockopt(fd, SOL_UDP, UDP_GRO, &value, sizeof(value)) < 0 && gro) {
+      LOG(WARNING) << "udp gro unsupported, " << strerror(errno);
+      gro = false;
+    }
+  }
+  gso_ = gso;
+  gro_ = gro;
+  for (auto& pool : rx_pools_) {
+    pool.seg_len = 0;
+    if (gro && pool.uring) {
+      LOG(WARNING) << "udp io_uring reads are off with gro";
+      pool.uring.reset();
+      pool.uring_msgs.clear();
+    }
+  }
+  ResizePool();
+}
+
+void Udp::ResizePool() {
+  // with GRO a read takes up to `kGroSegments` msgs, so fewer reads are made
+  // at once to bound the pool.
+  rx_segs_ = gro_ ? kGroSegments : 1;
+  int reads = gro_ ? std::max(batch_ / 8, 1) : batch_;
+  rx_pools_.resize(fds_.size());
+  for (auto& pool : rx_pools_) {
+    pool.msgs.resize(reads * rx_segs_);
+    pool.hdrs.resize(reads);
+    pool.iovs.resize(reads * rx_segs_);
+    pool.ctrl.resize(gro_ ? reads * CMSG_SPACE(sizeof(int)) : 0);
+    pool.overflow.resize(gro_ ? reads * kGroBytes : 0);
+    for (auto& msg : pool.msgs) {
+      if (!msg) {
+        msg = std::make_shared<bats::util::BatsMsg>();
+      }
+    }
+  }
+}
+
+bool Udp::SetUring(bool enable) {
+  for (auto& pool : rx_pools_) {
+    pool.uring.reset();
+    pool.uring_msgs.clear();
+  }
+  if (!enable) {
+    return true;
+  }
+  if (gro_) {
+    LOG(WARNING) << "udp io_uring reads need gro off";
+    return false;
+  }
+  for (size_t shard = 0; shard < fds_.size(); shard++) {
+    auto& pool = rx_pools_[shard];
+    pool.uring = bats::io::UringReader::Make(fds_[shard], true, kUringBuffers);
+    if (!pool.uring) {
+      LOG(WARNING) << "udp io_uring reads unsupported, recvmmsg is used";
+      SetUring(false);
+      return false;
+    }
+    pool.uring_msgs.resize(kUringBuffers);
+    for (int bid = 0; bid < kUringBuffers; bid++) {
+      auto& msg = pool.uring_msgs[bid];
+      msg = std::make_shared<bats::util::BatsMsg>();
+      pool.uring->Provide(bid, msg->begin(), msg->size());
+    }
+  }
+  return true;
+}
+
+int Udp::PollFd(int shard) const {
+  auto& pool = rx_pools_[shard];
+  return pool.uring ? pool.uring->RingFd() : fds_[shard];
+}
+
+int Udp::FDRecvBatch(int shard, int max_msgs, int* msgs) {
+  auto& pool = rx_pools_[shard];
+  if (pool.uring) {
+    int bytes = 0;
+    int ret = pool.uring->Read(max_msgs, [&](int bid, int len) {
+      // the msg read is handed on, a new one takes its place in the ring
+      auto msg = std::move(pool.uring_msgs[bid]);
+      auto& next = pool.uring_msgs[bid];
+      next = std::make_shared<bats::util::BatsMsg>();
+      pool.uring->Provide(bid, next->begin(), next->size());
+      bytes += len;
+      if (len > 0) {
+        msg->resize(len);
+        msg->decode();
+        Dispatch(msg);
+      }
+    });
+    *msgs = std::max(ret, 0);
+    return ret < 0 ? ret : bytes;
+  }
+  int reads = std::min(std::max(max_msgs, 1),
+                       static_cast<int>(pool.hdrs.size()));
+  for (int i = 0; i < reads; i++) {
+    for (int j = i * rx_segs_; j < (i + 1) * rx_segs_; j++) {
+      auto& msg = pool.msgs[j];
+      pool.iovs[j].iov_base = msg->begin();
+      pool.iovs[j].iov_len = pool.seg_len > 0
+                                 ? std::min(pool.seg_len, msg->size())
+                                 : msg->size();
+    }
+    if (pool.seg_len > 0) {
+      // the iovs fit to smaller segments would truncate a later datagram
+      // of larger ones, the last takes the rest of it.
+      auto& last = pool.iovs[(i + 1) * rx_segs_ - 1];
+      last.iov_base = &pool.overflow[i * kGroBytes];
+      last.iov_len = kGroBytes;
+    }
+    auto& hdr = pool.hdrs[i].msg_hdr;
+    memset(&pool.hdrs[i], 0, sizeof(mmsghdr));
+    hdr.msg_iov = &pool.iovs[i * rx_segs_];
+    hdr.msg_iovlen = rx_segs_;
+    if (gro_) {
+      hdr.msg_control = &pool.ctrl[i * CMSG_SPACE(sizeof(int))];
+      hdr.msg_controllen = CMSG_SPACE(sizeof(int));
+    }
+  }
+  int ret = recvmmsg(fds_[shard], pool.hdrs.data(), reads, 0, nullptr);
+  if (ret < 0) {
+    *msgs = 0;
+    return ret;
+  }
+  int bytes = 0;
+  int num = 0;
+  for (int i = 0; i < ret; i++) {
+    auto& hdr = pool.hdrs[i].msg_hdr;
+    int len = pool.hdrs[i].msg_len;
+    bytes += len;
+    if (hdr.msg_flags & MSG_TRUNC) {
+      LOG(WARNING) << "udp datagram of " << len << " bytes is truncated";
+      continue;
+    }
+    // a datagram which wasn't coalesced is a single segment
+    int seg = len;
+    for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+        memcpy(&seg, CMSG_DATA(cmsg), sizeof(int));
+      }
+    }
+    if (len > 0 && seg > 0) {
+      DispatchRead(pool, i, len, seg);
+      num += (len + seg - 1) / seg;
+    }
+  }
+  *msgs = std::max(num, ret);
+  return bytes;
+}
+
+void Udp::DispatchRead(RxPool& pool, int hdr, int len, int seg) {
+  int first = hdr * rx_segs_;
+  int iov_len = pool.iovs[first].iov_len;
+  if (seg == iov_len || (seg == len && len <= iov_len)) {
+    // every segment is in its own msg already
+    for (int off = 0, i = first; off < len; off += seg, i++) {
+      auto msg = std::move(pool.msgs[i]);
+      pool.msgs[i] = std::make_shared<bats::util::BatsMsg>();
+      msg->resize(std::min(seg, len - off));
+      if (pool.iovs[i].iov_base != msg->begin()) {
+        // the segment of the overflow iov
+        memcpy(msg->begin(), pool.iovs[i].iov_base, msg->size());
+      }
+      msg->decode();
+      Dispatch(msg);
+    }
+    return;
+  }
+  // the segments straddle the iovs, copy them out and fit the iovs to the
+  // segment size for the next reads. The pool msgs are kept.
+  gro_copies_.fetch_add(1, std::memory_order_relaxed);
+  for (int off = 0; off < len; off += seg) {
+    int size = std::min(seg, len - off);
+    auto msg = std::make_shared<bats::util::BatsMsg>();
+    msg->resize(size);
+    for (int done = 0; done < size;) {
+      int pos = off + done;
+      // the iovs are of `iov_len` but the overflow one
+      int index = std::min(pos / iov_len, rx_segs_ - 1);
+      auto& iov = pool.iovs[first + index];
+      int skip = pos - index * iov_len;
+      int n = std::min(size - done, static_cast<int>(iov.iov_len) - skip);
+      memcpy(msg->begin() + done, static_cast<char*>(iov.iov_base) + skip, n);
+      done += n;
+    }
+    msg->decode();
+    Dispatch(msg);
+  }
+  if (seg != len && seg <= pool.msgs[first]->size()) {
+    pool.seg_len = seg;
+  }
+}
+
+int Udp::FDWriteBatch(const msg_type* msgs, int num) {
+  mmsghdr hdrs[kMaxBatch];
+  iovec iovs[kMaxBatch];
+  // the first msg of each hdr
+  int firsts[kMaxBatch + 1];
+  alignas(cmsghdr) char ctrl[kMaxBatch][CMSG_SPACE(sizeof(uint16_t))];
+  int fd = TxFd();
+  int written = 0;
+  while (num > 0) {
+    int n = std::min(num, kMaxBatch);
+    bool gso = gso_.load(std::memory_order_relaxed);
+    int h = 0;
+    int run_bytes = 0;
+    for (int i = 0; i < n; i++) {
+      auto& msg = msgs[i];
+      EncodeHeader(msg);
+      iovs[i].iov_base = msg->begin();
+      iovs[i].iov_len = msg->size();
+      if (gso && h > 0) {
+        // a run is msgs of one size to one address, the last may be shorter
+        auto& run = hdrs[h - 1].msg_hdr;
+        auto& dst = msg->encodeInfo().dst_addr;
+        auto run_dst = static_cast<const sockaddr_in*>(run.msg_name);
+        size_t seg = iovs[firsts[h - 1]].iov_len;
+        if (run.msg_iovlen < kGroSegments && iovs[i - 1].iov_len == seg &&
+            iovs[i].iov_len <= seg && run_bytes + msg->size() <= kGsoBytes &&
+            dst.sin_addr.s_addr == run_dst->sin_addr.s_addr &&
+            dst.sin_port == run_dst->sin_port) {
+          run.msg_iovlen++;
+          run_bytes += msg->size();
+          continue;
+        }
+      }
+      memset(&hdrs[h], 0, sizeof(mmsghdr));
+      hdrs[h].msg_hdr.msg_name = &msg->encodeInfo().dst_addr;
+      hdrs[h].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+      hdrs[h].msg_hdr.msg_iov = &iovs[i];
+      hdrs[h].msg_hdr.msg_iovlen = 1;
+      firsts[h++] = i;
+      run_bytes = msg->size();
+    }
+    firsts[h] = n;
+    // the kernel cuts a run of msgs back into datagrams
+    for (int k = 0; k < h; k++) {
+      auto& hdr = hdrs[k].msg_hdr;
+      if (hdr.msg_iovlen <= 1) {
+        continue;
+      }
+      hdr.msg_control = ctrl[k];
+      hdr.msg_controllen = sizeof(ctrl[k]);
+      auto cmsg = CMSG_FIRSTHDR(&hdr);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      uint16_t seg = iovs[firsts[k]].iov_len;
+      memcpy(CMSG_DATA(cmsg), &seg, sizeof(seg));
+    }
+    int sent = 0;
+    while (sent < h) {
+      int ret = sendmmsg(fd, hdrs + sent, h - sent, 0);
+      if (ret < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (hdrs[sent].msg_hdr.msg_controllen > 0 &&
+            (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP)) {
+          // e.g. no checksum offload on the route, send them one by one.
+          LOG(WARNING) << "udp gso failed, " << strerror(errno);
+          gso_ = false;
+          return written +
+                 FDWriteBatch(msgs + firsts[sent], num - firsts[sent]);
+        }
+        // the failed msgs are dropped as `sendto` did, the rest still go.
+        sent++;
+        continue;
+      }
+      for (int k = sent; k < sent + ret; k++) {
+        written += firsts[k + 1] - firsts[k];
+      }
+      sent += ret;
+    }
+    msgs += n;
+    num -= n;
+  }
+  return written;
+}
+
+void Udp::EncodeHeader(const msg_type& msg) {
   // =========== init protocol header =============
   struct BatsHeader* proto_hdr = (struct BatsHeader*)msg->begin();
   if (msg->NeedCoded()) {
@@ -79,7 +436,11 @@ int Udp::FDWrite(const msg_type& msg) {
     proto_hdr->pac_type = 0;  // raw packet.
     proto_hdr->flow_id = htonll(msg->encodeInfo().flow_id);
   }
-  return sendto(fd_, (char*)msg->begin(), msg->size(), 0,
+}
+
+int Udp::FDWrite(const msg_type& msg) {
+  EncodeHeader(msg);
+  return sendto(TxFd(), (char*)msg->begin(), msg->size(), 0,
                 (struct sockaddr*)&msg->encodeInfo().dst_addr,
                 sizeof(sockaddr_in));
 }
@@ -11,32 +11,148 @@
 
 #ifndef SRC_EXAMPLE_APP_SRC_NODE_UDP_H_
 #define SRC_EXAMPLE_APP_SRC_NODE_UDP_H_
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
 #include "channel.h"
+#include "io/uring_io.h"
 #include "node.h"
 #include "node_duplex.h"
+#include "util/bats_msg.h"
 
 namespace bats {
 namespace src {
 /**
  * @brief A udp service which is used to send protocol data to an endpoint.
+ * The port may be served by several `SO_REUSEPORT` sockets, each read on its
+ * own reactor, so the ingress scales with the cores.
  *
  */
 class Udp : public NodeDuplex {
  public:
-  explicit Udp(uint16_t port) : NodeDuplex("UDP"), port_(port) {
+  explicit Udp(uint16_t port, int sockets = 1,
+               const std::string& name = "UDP")
+      : NodeDuplex(name), port_(port), sockets_(std::max(sockets, 1)) {
     if (!Init()) {
       throw std::runtime_error("UDP node init failed.");
     }
+    SetBatch(kDefaultBatch);
+  }
+  virtual ~Udp() {
+    // `fd_` is the first one, closed by `FullDuplex`
+    for (size_t i = 1; i < fds_.size(); i++) {
+      close(fds_[i]);
+    }
   }
-  virtual ~Udp() {}
 
   // FullDuplex
   int FDRecv() override;
   int FDWrite(const msg_type& msg) override;
+  int FDRecvBatch(int shard, int max_msgs, int* msgs) override;
+  int Shards() const override { return fds_.size(); }
+  int ShardFd(int shard) const override { return fds_[shard]; }
+  int PollFd(int shard) const override;
+  int FDWriteBatch(const msg_type* msgs, int num) override;
   bool Init() override;
+  /**
+   * @brief Receive up to `msgs` datagrams by one `recvmmsg` and send up to
+   * `msgs` by one `sendmmsg`, see `SetWriteBatch` for `flush_us`.
+   *
+   * @param msgs Capped at `kMaxBatch`.
+   * @param flush_us
+   */
+  void SetBatch(int msgs, int flush_us = 0);
+  /**
+   * @brief Send a burst of equal msgs to one address as one `UDP_SEGMENT`
+   * buffer, and read the datagrams the kernel coalesced with `UDP_GRO` in one
+   * go. Either is left off if the kernel lacks it. Call it before the node is
+   * registered to the poller.
+   *
+   * @param gso
+   * @param gro
+   */
+  void SetOffload(bool gso, bool gro);
+  /**
+   * @brief Read each socket by a multishot io_uring recv into a ring of
+   * provided msgs instead of `recvmmsg`, a datagram costs no syscall and no
+   * copy. The poller watches the ring. Not with GRO, whose segment size comes
+   * in a cmsg, and the sends stay on `sendmmsg`. Call it after `SetOffload`
+   * and before the node is registered to the poller.
+   *
+   * @param enable
+   * @return false Return false if the kernel lacks it, the sockets are read
+   * by `recvmmsg` then.
+   */
+  bool SetUring(bool enable);
+  /**
+   * @brief Steer a datagram to the socket of the cpu which received it,
+   * `cpu % sockets`, by a classic BPF program of the reuseport group. Pin the
+   * reactor of each socket to that cpu to keep a flow on one core. Without
+   * it the kernel picks the socket by the hash of the flow.
+   *
+   * @return false Return false if the kernel rejects the program.
+   */
+  bool SteerByCpu();
+  uint64_t GroCopies() const { return gro_copies_.load(); }
+  std::string HandoffKey() const override {
+    return "udp:" + std::to_string(port_);
+  }
 
  private:
+  // fill the protocol header of an outgoing msg
+  static void EncodeHeader(const msg_type& msg);
+  // open the socket of `shard` or take it over from the predecessor
+  int Open(int shard);
+  // the socket to send on, the one of the current cpu
+  int TxFd() const;
+  // size the pools of `FDRecvBatch` after the batch or offload changed
+  void ResizePool();
+
+  // The msgs `recvmmsg` fills, only those consumed are replaced. A read owns
+  // `rx_segs_` msgs in a row, one per segment of a coalesced datagram. Each
+  // socket has its own, they are read on different reactors.
+  struct RxPool {
+    std::vector<std::shared_ptr<bats::util::BatsMsg>> msgs;
+    std::vector<mmsghdr> hdrs;
+    std::vector<iovec> iovs;
+    std::vector<char> ctrl;
+    // `kGroBytes` for the last iov of each read once `seg_len` is set, the
+    // iovs of a read never hold less than a datagram.
+    std::vector<char> overflow;
+    // the iov length of a msg, the last GRO segment size so that the
+    // segments land in their own msgs. 0 for the whole msg.
+    int seg_len = 0;
+    // the reader of `SetUring`, the buffer `i` of its ring is `uring_msgs[i]`
+    std::unique_ptr<bats::io::UringReader> uring;
+    std::vector<std::shared_ptr<bats::util::BatsMsg>> uring_msgs;
+  };
+  // dispatch the `len` bytes read into the iovs of the `hdr`th read, cut in
+  // segments of `seg` bytes
+  void DispatchRead(RxPool& pool, int hdr, int len, int seg);
+
   uint16_t port_ = 0;
+  int sockets_ = 1;
+  std::vector<int> fds_;
+  int batch_ = 1;
+  std::atomic<bool> gso_ = {false};
+  bool gro_ = false;
+  std::vector<RxPool> rx_pools_;
+  int rx_segs_ = 1;
+  // the coalesced reads which didn't fit the iovs and were copied
+  std::atomic<uint64_t> gro_copies_ = {0};
+  static const int kDefaultBatch = 32;
+  static const int kMaxBatch = 64;
+  // the most segments of a GSO send or a GRO read
+  static const int kGroSegments = 64;
+  static const int kGroBytes = 65535;
+  static const int kGsoBytes = 65000;
+  // the msgs a socket lends to its io_uring reader
+  static const int kUringBuffers = 256;
   DISALLOW_COPY_AND_ASSIGN(Udp)
 };
 
@@ -0,0 +1,227 @@
+/**
+ * @file process_supervisor.cc
+ * @author peng lei (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-11-25
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include "process_supervisor.h"
+
+#include <glog/logging.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+
+#include "node_manager.h"
+
+bool ProcessSupervisor::Add(const std::string& name,
+                            const std::vector<int>& cpus, Body body) {
+  if (Running() || !body) {
+    return false;
+  }
+  for (auto& w : workers_) {
+    if (w.name == name) {
+      LOG(ERROR) << "duplicate worker process " << name;
+      return false;
+    }
+  }
+  Worker worker;
+  worker.name = name;
+  worker.cpus = cpus;
+  worker.body = body;
+  worker.backoff_ms = kMinBackoffMs;
+  workers_.push_back(worker);
+  return true;
+}
+
+bool ProcessSupervisor::Start() {
+  if (Running() || workers_.empty()) {
+    return false;
+  }
+  // the signals are taken by `sigtimedwait` in the supervisor, block them
+  // before forking so none is lost in between.
+  sigset_t set, old;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &set, &old);
+  owner_pid_ = getpid();
+  auto pid = fork();
+  if (pid == 0) {
+    Supervise();
+  }
+  sigprocmask(SIG_SETMASK, &old, nullptr);
+  if (pid < 0) {
+    LOG(ERROR) << "fork supervisor failed, " << strerror(errno);
+    return false;
+  }
+  supervisor_pid_ = pid;
+  LOG(INFO) << "supervisor " << pid << " runs " << workers_.size()
+            << " worker processes";
+  return true;
+}
+
+void ProcessSupervisor::Stop() {
+  if (!Running() || getpid() != owner_pid_) {
+    return;
+  }
+  kill(supervisor_pid_, SIGTERM);
+  int status = 0;
+  while (waitpid(supervisor_pid_, &status, 0) < 0 && errno == EINTR) {
+  }
+  LOG(INFO) << "supervisor " << supervisor_pid_ << " exited";
+  supervisor_pid_ = -1;
+}
+
+void ProcessSupervisor::Supervise() {
+  // the workers go down with the process which owns the I/O nodes.
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() != owner_pid_) {
+    _exit(0);
+  }
+  prctl(PR_SET_NAME, "supervisor");
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGCHLD);
+
+  for (auto& w : workers_) {
+    Spawn(w);
+  }
+  while (true) {
+    auto now = NowMs();
+    uint64_t wait_ms = 1000;
+    for (auto& w : workers_) {
+      if (w.pid < 0) {
+        auto left = w.respawn_ms > now ? w.respawn_ms - now : 0;
+        wait_ms = std::min(wait_ms, left);
+      }
+    }
+    struct timespec ts;
+    ts.tv_sec = wait_ms / 1000;
+    ts.tv_nsec = (wait_ms % 1000) * 1000000L;
+    auto sig = sigtimedwait(&set, nullptr, &ts);
+    if (sig == SIGTERM || sig == SIGINT) {
+      break;
+    }
+    int status = 0;
+    pid_t pid = 0;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      auto itr = std::find_if(workers_.begin(), workers_.end(),
+                              [pid](const Worker& w) { return w.pid == pid; });
+      if (itr == workers_.end()) {
+        continue;
+      }
+      now = NowMs();
+      if (WIFSIGNALED(status)) {
+        LOG(ERROR) << "worker " << itr->name << " killed by signal "
+                   << WTERMSIG(status);
+      } else {
+        LOG(ERROR) << "worker " << itr->name << " exited with "
+                   << WEXITSTATUS(status);
+      }
+      // a worker which keeps crashing is restarted slower and slower.
+      if (now - itr->started_ms >= kStableMs) {
+        itr->backoff_ms = kMinBackoffMs;
+      } else {
+        itr->backoff_ms = std::min(itr->backoff_ms * 2, kMaxBackoffMs);
+      }
+      itr->pid = -1;
+      itr->respawn_ms = now + itr->backoff_ms;
+    }
+    now = NowMs();
+    for (auto& w : workers_) {
+      if (w.pid < 0 && now >= w.respawn_ms) {
+        w.restarts++;
+        LOG(INFO) << "restart worker " << w.name << " (" << w.restarts << ")";
+        Spawn(w);
+      }
+    }
+  }
+
+  for (auto& w : workers_) {
+    if (w.pid > 0) {
+      kill(w.pid, SIGTERM);
+    }
+  }
+  auto deadline = NowMs() + kStopTimeoutMs;
+  for (auto& w : workers_) {
+    if (w.pid <= 0) {
+      continue;
+    }
+    int status = 0;
+    while (waitpid(w.pid, &status, WNOHANG) == 0) {
+      if (NowMs() >= deadline) {
+        LOG(WARNING) << "kill worker " << w.name;
+        kill(w.pid, SIGKILL);
+        waitpid(w.pid, &status, 0);
+        break;
+      }
+      usleep(10000);
+    }
+  }
+  _exit(0);
+}
+
+bool ProcessSupervisor::Spawn(Worker& worker) {
+  worker.started_ms = NowMs();
+  auto pid = fork();
+  if (pid == 0) {
+    RunWorker(worker);
+  }
+  if (pid < 0) {
+    LOG(ERROR) << "fork worker " << worker.name << " failed, "
+               << strerror(errno);
+    worker.respawn_ms = NowMs() + worker.backoff_ms;
+    return false;
+  }
+  worker.pid = pid;
+  LOG(INFO) << "worker " << worker.name << " runs as " << pid;
+  return true;
+}
+
+void ProcessSupervisor::RunWorker(const Worker& worker) {
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  prctl(PR_SET_NAME, worker.name.substr(0, 15).c_str());
+  if (!worker.cpus.empty()) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (auto cpu : worker.cpus) {
+      CPU_SET(cpu, &cpuset);
+    }
+    // the threads of the nodes inherit it.
+    if (sched_setaffinity(0, sizeof(cpuset), &cpuset) != 0) {
+      LOG(WARNING) << "failed to pin worker " << worker.name << ", "
+                   << strerror(errno);
+    }
+  }
+  // SIGTERM stays blocked, the node threads inherit the mask and only this
+  // thread takes it.
+  worker.body();
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGINT);
+  int sig = 0;
+  sigwait(&set, &sig);
+  NodeManager::CleanUp();
+  _exit(0);
+}
+
+uint64_t ProcessSupervisor::NowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
@@ -0,0 +1,93 @@
+/**
+ * @file process_supervisor.h
+ * @author peng lei (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-11-25
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef SRC_UTIL_PROCESS_SUPERVISOR_H_
+#define SRC_UTIL_PROCESS_SUPERVISOR_H_
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "macros.h"
+
+/**
+ * @brief Run groups of nodes in worker processes. `Start` forks a supervisor
+ * process while the caller is still single-threaded, the supervisor forks the
+ * workers and restarts a worker which exits abnormally, with a backoff. The
+ * calling process, which usually keeps the TUN/UDP nodes, is never touched
+ * by a worker crash.
+ *
+ * A worker calls its body, which builds and runs the nodes of the group on
+ * the `NodeManager` of that process, then waits for SIGTERM and cleans up.
+ */
+class ProcessSupervisor {
+ public:
+  using Body = std::function<void()>;
+  ProcessSupervisor() = default;
+  ~ProcessSupervisor() { Stop(); }
+  /**
+   * @brief Add a worker process.
+   *
+   * @param name
+   * @param cpus The worker is pinned to `cpus`, no pinning if it's empty.
+   * @param body
+   * @return false Return false if it's started or the name is used.
+   */
+  bool Add(const std::string& name, const std::vector<int>& cpus, Body body);
+  /**
+   * @brief Fork the supervisor. Call it before any thread is started.
+   *
+   * @return true
+   * @return false
+   */
+  bool Start();
+  /**
+   * @brief Stop the workers and the supervisor.
+   *
+   */
+  void Stop();
+  bool Running() const { return supervisor_pid_ > 0; }
+
+ private:
+  struct Worker {
+    std::string name;
+    std::vector<int> cpus;
+    Body body;
+    pid_t pid = -1;
+    int restarts = 0;
+    uint64_t started_ms = 0;
+    uint64_t backoff_ms = 0;
+    uint64_t respawn_ms = 0;
+  };
+  [[noreturn]] void Supervise();
+  bool Spawn(Worker& worker);
+  [[noreturn]] static void RunWorker(const Worker& worker);
+  static uint64_t NowMs();
+
+  std::vector<Worker> workers_;
+  pid_t supervisor_pid_ = -1;
+  // only the process which started the supervisor may stop it.
+  pid_t owner_pid_ = -1;
+  // a worker which lived this long is restarted without backoff.
+  const uint64_t kStableMs = 10000;
+  const uint64_t kMinBackoffMs = 100;
+  const uint64_t kMaxBackoffMs = 5000;
+  // the time for workers to exit before they are killed.
+  const uint64_t kStopTimeoutMs = 3000;
+  DISALLOW_COPY_AND_ASSIGN(ProcessSupervisor)
+};
+
+using ProcessSupervisor_ptr = std::shared_ptr<ProcessSupervisor>;
+
+#endif  // SRC_UTIL_PROCESS_SUPERVISOR_H_
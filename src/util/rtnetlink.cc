@@ -0,0 +1,245 @@
+/**
+ * @file rtnetlink.cc
+ * @author peng lei (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-11-29
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include "rtnetlink.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <linux/if_addr.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace base {
+namespace util {
+
+namespace {
+
+const int kRequestLen = 256;
+// the wait for the ack of a request, a lost one fails it instead of hanging
+const int kAckTimeoutMs = 1000;
+
+struct AddrRequest {
+  struct nlmsghdr hdr;
+  struct ifaddrmsg ifa;
+  char attrs[kRequestLen];
+};
+
+struct LinkRequest {
+  struct nlmsghdr hdr;
+  struct ifinfomsg ifi;
+  char attrs[kRequestLen];
+};
+
+void AddAttr(struct nlmsghdr* hdr, uint16_t type, const void* data,
+             uint16_t len) {
+  auto rta = reinterpret_cast<struct rtattr*>(reinterpret_cast<char*>(hdr) +
+                                              NLMSG_ALIGN(hdr->nlmsg_len));
+  rta->rta_type = type;
+  rta->rta_len = RTA_LENGTH(len);
+  memcpy(RTA_DATA(rta), data, len);
+  hdr->nlmsg_len = NLMSG_ALIGN(hdr->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+}  // namespace
+
+Rtnetlink::Rtnetlink() {
+  fd_ = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (fd_ < 0) {
+    LOG(ERROR) << "rtnetlink socket failed, " << strerror(errno);
+    return;
+  }
+  struct sockaddr_nl addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  if (bind(fd_, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    LOG(ERROR) << "rtnetlink bind failed, " << strerror(errno);
+    close(fd_);
+    fd_ = -1;
+    return;
+  }
+  struct timeval tv = {kAckTimeoutMs / 1000, (kAckTimeoutMs % 1000) * 1000};
+  setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+Rtnetlink::~Rtnetlink() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+bool Rtnetlink::AddAddress(const std::string& ifname, const std::string& ip,
+                           int prefixlen) {
+  int index = if_nametoindex(ifname.c_str());
+  bool v6 = ip.find(':') != std::string::npos;
+  struct in_addr addr;
+  struct in6_addr addr6;
+  bool valid = v6 ? inet_pton(AF_INET6, ip.c_str(), &addr6) == 1
+                  : inet_pton(AF_INET, ip.c_str(), &addr) == 1;
+  if (index == 0 || !valid || prefixlen < 0 || prefixlen > MaxPrefixLen(ip)) {
+    LOG(ERROR) << "invalid address " << ip << "/" << prefixlen << " of "
+               << ifname;
+    return false;
+  }
+  AddrRequest req;
+  memset(&req, 0, sizeof(req));
+  req.hdr.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifa));
+  req.hdr.nlmsg_type = RTM_NEWADDR;
+  req.hdr.nlmsg_flags =
+      NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_REPLACE;
+  req.ifa.ifa_family = v6 ? AF_INET6 : AF_INET;
+  req.ifa.ifa_prefixlen = prefixlen;
+  req.ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+  req.ifa.ifa_index = index;
+  if (v6) {
+    AddAttr(&req.hdr, IFA_LOCAL, &addr6, sizeof(addr6));
+    AddAttr(&req.hdr, IFA_ADDRESS, &addr6, sizeof(addr6));
+  } else {
+    AddAttr(&req.hdr, IFA_LOCAL, &addr, sizeof(addr));
+    AddAttr(&req.hdr, IFA_ADDRESS, &addr, sizeof(addr));
+  }
+  if (!v6 && prefixlen < 31) {
+    uint32_t host_mask = prefixlen == 0 ? ~0U : ~0U >> prefixlen;
+    struct in_addr brd;
+    brd.s_addr = addr.s_addr | htonl(host_mask);
+    AddAttr(&req.hdr, IFA_BROADCAST, &brd, sizeof(brd));
+  }
+  if (!Request(&req, req.hdr.nlmsg_len)) {
+    LOG(ERROR) << "add address " << ip << "/" << prefixlen << " to " << ifname
+               << " failed, " << strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool Rtnetlink::SetLink(const std::string& ifname, bool up, int mtu,
+                        int txqueuelen) {
+  int index = if_nametoindex(ifname.c_str());
+  if (index == 0) {
+    LOG(ERROR) << "no interface " << ifname;
+    return false;
+  }
+  LinkRequest req;
+  memset(&req, 0, sizeof(req));
+  req.hdr.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+  req.hdr.nlmsg_type = RTM_NEWLINK;
+  req.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+  req.ifi.ifi_family = AF_UNSPEC;
+  req.ifi.ifi_index = index;
+  if (up) {
+    req.ifi.ifi_flags = IFF_UP;
+    req.ifi.ifi_change = IFF_UP;
+  }
+  if (mtu > 0) {
+    uint32_t value = mtu;
+    AddAttr(&req.hdr, IFLA_MTU, &value, sizeof(value));
+  }
+  if (txqueuelen > 0) {
+    uint32_t value = txqueuelen;
+    AddAttr(&req.hdr, IFLA_TXQLEN, &value, sizeof(value));
+  }
+  if (!Request(&req, req.hdr.nlmsg_len)) {
+    LOG(ERROR) << "set link " << ifname << " failed, " << strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool Rtnetlink::ParseAddress(const std::string& text, std::string* ip,
+                             int* prefixlen, int default_prefixlen) {
+  auto slash = text.find('/');
+  *ip = text.substr(0, slash);
+  if (slash == std::string::npos) {
+    *prefixlen = default_prefixlen;
+    return true;
+  }
+  auto len = text.substr(slash + 1);
+  char* end = nullptr;
+  errno = 0;
+  long value = strtol(len.c_str(), &end, 10);
+  if (len.empty() || *end != '\0' || errno != 0 || value < 0 ||
+      value > MaxPrefixLen(*ip)) {
+    LOG(ERROR) << "invalid prefix length of " << text;
+    return false;
+  }
+  *prefixlen = static_cast<int>(value);
+  return true;
+}
+
+int Rtnetlink::MaxPrefixLen(const std::string& ip) {
+  return ip.find(':') != std::string::npos ? 128 : 32;
+}
+
+bool Rtnetlink::SetRpFilter(const std::string& ifname, int value) {
+  auto path = "/proc/sys/net/ipv4/conf/" + ifname + "/rp_filter";
+  int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOG(WARNING) << "open " << path << " failed, " << strerror(errno);
+    return false;
+  }
+  auto text = std::to_string(value);
+  bool ok = write(fd, text.c_str(), text.size()) ==
+            static_cast<ssize_t>(text.size());
+  if (!ok) {
+    LOG(WARNING) << "write " << path << " failed, " << strerror(errno);
+  }
+  close(fd);
+  return ok;
+}
+
+bool Rtnetlink::Request(void* req, uint32_t len) {
+  if (fd_ < 0) {
+    errno = EBADF;
+    return false;
+  }
+  auto hdr = static_cast<struct nlmsghdr*>(req);
+  hdr->nlmsg_seq = ++seq_;
+  struct sockaddr_nl kernel;
+  memset(&kernel, 0, sizeof(kernel));
+  kernel.nl_family = AF_NETLINK;
+  if (sendto(fd_, req, len, 0, (struct sockaddr*)&kernel, sizeof(kernel)) <
+      0) {
+    return false;
+  }
+  char buf[4096];
+  while (true) {
+    int ret = recv(fd_, buf, sizeof(buf), 0);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        errno = ETIMEDOUT;
+      }
+      return false;
+    }
+    for (auto msg = reinterpret_cast<struct nlmsghdr*>(buf);
+         NLMSG_OK(msg, static_cast<uint32_t>(ret));
+         msg = NLMSG_NEXT(msg, ret)) {
+      if (msg->nlmsg_seq != seq_ || msg->nlmsg_type != NLMSG_ERROR) {
+        continue;
+      }
+      auto err = static_cast<struct nlmsgerr*>(NLMSG_DATA(msg));
+      // an ack is an error of 0
+      errno = -err->error;
+      return err->error == 0;
+    }
+  }
+}
+
+}  // namespace util
+}  // namespace base
@@ -0,0 +1,92 @@
+/**
+ * @file rtnetlink.h
+ * @author peng lei (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-11-29
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef SRC_UTIL_RTNETLINK_H_
+#define SRC_UTIL_RTNETLINK_H_
+
+#include <stdint.h>
+
+#include <string>
+
+namespace base {
+namespace util {
+
+/**
+ * @brief Configure network interfaces through a rtnetlink socket, without
+ * forking `ip` or `ifconfig`. Every request waits for the ack of the kernel,
+ * for a second at most.
+ *
+ */
+class Rtnetlink {
+ public:
+  Rtnetlink();
+  ~Rtnetlink();
+  Rtnetlink(const Rtnetlink&) = delete;
+  Rtnetlink& operator=(const Rtnetlink&) = delete;
+
+  bool Valid() const { return fd_ >= 0; }
+  /**
+   * @brief Add an address to the interface, an ipv4 one with the broadcast
+   * address of the prefix. An existing one is replaced.
+   *
+   * @param ifname
+   * @param ip e.g. "10.0.0.1" or "fd00::1"
+   * @param prefixlen e.g. 24 for the netmask 255.255.255.0
+   * @return false Return false if the address is invalid or the kernel
+   * rejected it.
+   */
+  bool AddAddress(const std::string& ifname, const std::string& ip,
+                  int prefixlen);
+  /**
+   * @brief Change the attributes of a link in one request.
+   *
+   * @param ifname
+   * @param up Bring the link up, or leave its state.
+   * @param mtu 0 to leave it.
+   * @param txqueuelen 0 to leave it.
+   * @return false
+   */
+  bool SetLink(const std::string& ifname, bool up, int mtu = 0,
+               int txqueuelen = 0);
+  /**
+   * @brief Set `/proc/sys/net/ipv4/conf/<ifname>/rp_filter`.
+   *
+   * @param ifname
+   * @param value 0 for no source validation, 1 for strict, 2 for loose.
+   * @return false
+   */
+  static bool SetRpFilter(const std::string& ifname, int value);
+  /**
+   * @brief Split "10.0.0.1/16" into the address and the prefix length.
+   *
+   * @param text The address, with an optional prefix length.
+   * @param ip
+   * @param prefixlen `default_prefixlen` if `text` has none.
+   * @param default_prefixlen
+   * @return false Return false if the prefix length isn't a number of 0 to
+   * 32, or to 128 for an ipv6 address.
+   */
+  static bool ParseAddress(const std::string& text, std::string* ip,
+                           int* prefixlen, int default_prefixlen);
+  // 128 for an ipv6 address, 32 otherwise
+  static int MaxPrefixLen(const std::string& ip);
+
+ private:
+  // send a request of `len` bytes and wait for its ack
+  bool Request(void* req, uint32_t len);
+
+  int fd_ = -1;
+  uint32_t seq_ = 0;
+};
+
+}  // namespace util
+}  // namespace base
+
+#endif  // SRC_UTIL_RTNETLINK_H_
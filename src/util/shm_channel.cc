@@ -0,0 +1,189 @@
+/**
+ * @file shm_channel.cc
+ * @author peng lei (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-11-25
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include "shm_channel.h"
+
+#include <glog/logging.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <new>
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) &&
+                  std::atomic<uint32_t>::is_always_lock_free,
+              "futex needs a plain 32-bit word.");
+
+// The producer and the consumer wait on different words. A waiter registers
+// itself before it rechecks the ring, so the other side only makes the wake
+// syscall when someone may be sleeping.
+struct ShmRing::Header {
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;
+  std::atomic<uint32_t> data_seq;
+  std::atomic<uint32_t> space_seq;
+  std::atomic<uint32_t> data_waiters;
+  std::atomic<uint32_t> space_waiters;
+};
+
+struct ShmRing::Slot {
+  uint32_t len;
+  uint32_t type;
+  uint32_t signal;
+  uint32_t id;
+  uint32_t seq;
+  uint32_t meta_len;
+  // followed by `len` bytes of data and `meta_len` bytes of the fields of a
+  // derived msg type.
+  octet* Data() { return reinterpret_cast<octet*>(this + 1); }
+};
+
+namespace {
+void FutexWait(std::atomic<uint32_t>* word, uint32_t expected,
+               int timeout_ms) {
+  struct timespec ts;
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+  // the mapping is shared between processes, so no FUTEX_PRIVATE_FLAG.
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected,
+          &ts, nullptr, 0);
+}
+
+void FutexWake(std::atomic<uint32_t>* word) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, 1,
+          nullptr, nullptr, 0);
+}
+}  // namespace
+
+std::shared_ptr<ShmRing> ShmRing::Create(const std::string& name, int slots,
+                                         int slot_size) {
+  if (slots <= 0 || slot_size <= 0) {
+    LOG(ERROR) << "invalid ring size " << slots << "x" << slot_size;
+    return nullptr;
+  }
+  // keep every slot header aligned.
+  auto stride = (sizeof(Slot) + slot_size + 7) & ~size_t(7);
+  auto len = sizeof(Header) + stride * slots;
+  auto mem = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    LOG(ERROR) << "map ring " << name << " failed, " << strerror(errno);
+    return nullptr;
+  }
+  return std::shared_ptr<ShmRing>(
+      new ShmRing(name, mem, len, slots, slot_size));
+}
+
+ShmRing::ShmRing(const std::string& name, void* mem, size_t len, int slots,
+                 int slot_size)
+    : name_(name), mem_(mem), len_(len), slots_(slots), slot_size_(slot_size) {
+  header_ = new (mem_) Header();
+  header_->head = 0;
+  header_->tail = 0;
+  header_->data_seq = 0;
+  header_->space_seq = 0;
+  header_->data_waiters = 0;
+  header_->space_waiters = 0;
+}
+
+ShmRing::~ShmRing() {
+  if (mem_) {
+    munmap(mem_, len_);
+  }
+}
+
+ShmRing::Slot* ShmRing::SlotAt(uint64_t index) const {
+  auto stride = (sizeof(Slot) + slot_size_ + 7) & ~size_t(7);
+  auto base = static_cast<char*>(mem_) + sizeof(Header);
+  return reinterpret_cast<Slot*>(base + stride * (index % slots_));
+}
+
+int ShmRing::Size() const {
+  return static_cast<int>(header_->head.load() - header_->tail.load());
+}
+
+bool ShmRing::Write(const BaseMsg& msg, int timeout_ms) {
+  auto meta_len = msg.metaSize();
+  if (meta_len < 0 || msg.size() + meta_len > slot_size_) {
+    LOG(WARNING) << "msg of " << msg.size() << "+" << meta_len
+                 << " bytes exceeds the slot of " << name_;
+    return false;
+  }
+  auto head = header_->head.load(std::memory_order_relaxed);
+  if (head - header_->tail.load() >= (uint64_t)slots_) {
+    header_->space_waiters++;
+    auto seq = header_->space_seq.load();
+    if (head - header_->tail.load() >= (uint64_t)slots_) {
+      FutexWait(&header_->space_seq, seq, timeout_ms);
+    }
+    header_->space_waiters--;
+    if (head - header_->tail.load() >= (uint64_t)slots_) {
+      return false;
+    }
+  }
+  auto slot = SlotAt(head);
+  slot->len = msg.size();
+  slot->type = msg.type();
+  slot->signal = msg.signal();
+  slot->id = msg.id();
+  slot->seq = msg.seq();
+  slot->meta_len = meta_len;
+  std::copy(msg.Data().begin(), msg.Data().end(), slot->Data());
+  if (meta_len > 0) {
+    msg.saveMeta(slot->Data() + slot->len);
+  }
+  // publish the slot after its content.
+  header_->head.store(head + 1);
+  header_->data_seq++;
+  if (header_->data_waiters.load() > 0) {
+    FutexWake(&header_->data_seq);
+  }
+  return true;
+}
+
+bool ShmRing::Read(BaseMsg_ptr& msg, const MsgMaker& maker, int timeout_ms) {
+  auto tail = header_->tail.load(std::memory_order_relaxed);
+  if (header_->head.load() == tail) {
+    header_->data_waiters++;
+    auto seq = header_->data_seq.load();
+    if (header_->head.load() == tail) {
+      FutexWait(&header_->data_seq, seq, timeout_ms);
+    }
+    header_->data_waiters--;
+    if (header_->head.load() == tail) {
+      return false;
+    }
+  }
+  auto slot = SlotAt(tail);
+  msg = maker(slot->len);
+  msg->resize(slot->len);
+  msg->type() = static_cast<MSG_TYPE>(slot->type);
+  msg->signal() = static_cast<MSG_SIGNAL>(slot->signal);
+  msg->id() = slot->id;
+  msg->seq() = slot->seq;
+  std::copy(slot->Data(), slot->Data() + slot->len, msg->Data().begin());
+  bool ok = msg->loadMeta(slot->Data() + slot->len, slot->meta_len);
+  if (!ok) {
+    LOG(ERROR) << "drop a msg of " << name_ << ", the fields of "
+               << slot->meta_len << " bytes don't fit the msg type";
+    msg = nullptr;
+  }
+  // a worker which dies before this point reads the slot again on restart.
+  header_->tail.store(tail + 1);
+  header_->space_seq++;
+  if (header_->space_waiters.load() > 0) {
+    FutexWake(&header_->space_seq);
+  }
+  return ok;
+}
@@ -0,0 +1,171 @@
+/**
+ * @file shm_channel.h
+ * @author peng lei (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-11-25
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef SRC_UTIL_SHM_CHANNEL_H_
+#define SRC_UTIL_SHM_CHANNEL_H_
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "channel.h"
+#include "macros.h"
+#include "msg.h"
+#include "node.h"
+
+/**
+ * @brief A single-producer single-consumer ring of fixed-size slots in a
+ * shared mapping. It's created before the worker processes are forked, so a
+ * restarted worker attaches to the same ring and resumes from the last slot
+ * it consumed. The fields of a derived msg type cross the ring through
+ * `BaseMsg::saveMeta` and `BaseMsg::loadMeta`, so the reader must make the
+ * same type by its `MsgMaker`.
+ *
+ */
+class ShmRing {
+ public:
+  /**
+   * @brief Make a msg object to receive `len` bytes.
+   */
+  using MsgMaker = std::function<BaseMsg_ptr(int len)>;
+  /**
+   * @brief Create a ring.
+   *
+   * @param name
+   * @param slots The number of slots.
+   * @param slot_size The max length of a msg.
+   * @return std::shared_ptr<ShmRing> Return nullptr if mapping failed.
+   */
+  static std::shared_ptr<ShmRing> Create(const std::string& name, int slots,
+                                         int slot_size = default_buffer_len);
+  ~ShmRing();
+  /**
+   * @brief Copy a msg into the ring, wait up to `timeout_ms` for a free slot.
+   *
+   * @param msg
+   * @param timeout_ms
+   * @return false Return false if the ring is full or the msg, with its
+   * `metaSize()`, is too long.
+   */
+  bool Write(const BaseMsg& msg, int timeout_ms);
+  /**
+   * @brief Take a msg from the ring, wait up to `timeout_ms` for one.
+   *
+   * @param msg
+   * @param maker
+   * @param timeout_ms
+   * @return false Return false if the ring is empty, or the msg made by
+   * `maker` can't load the fields of the one written, then it's dropped.
+   */
+  bool Read(BaseMsg_ptr& msg, const MsgMaker& maker, int timeout_ms);
+  const std::string& Name() const { return name_; }
+  int Size() const;
+  int Capacity() const { return slots_; }
+
+ private:
+  ShmRing(const std::string& name, void* mem, size_t len, int slots,
+          int slot_size);
+  struct Header;
+  struct Slot;
+  Slot* SlotAt(uint64_t index) const;
+
+  std::string name_;
+  void* mem_ = nullptr;
+  size_t len_ = 0;
+  Header* header_ = nullptr;
+  int slots_ = 0;
+  int slot_size_ = 0;
+  DISALLOW_COPY_AND_ASSIGN(ShmRing)
+};
+
+using ShmRing_ptr = std::shared_ptr<ShmRing>;
+
+/**
+ * @brief The egress of a process, it writes the msgs of its up-channels to a
+ * ring. It blocks while the ring is full, so backpressure crosses the process
+ * boundary.
+ *
+ */
+class ShmSender : public MsgSinkNode {
+ public:
+  explicit ShmSender(ShmRing_ptr ring)
+      : MsgSinkNode("shm_tx:" + ring->Name()), ring_(ring) {
+    is_stop_ = false;
+  }
+  void HandleMsg(const msg_type& msg) override {
+    std::lock_guard<std::mutex> lg(write_mutex_);
+    while (!is_stop_ && !ring_->Write(*msg, kWaitMs)) {
+    }
+  }
+
+ private:
+  ShmRing_ptr ring_ = nullptr;
+  // the workers of this node share the producer side of the ring.
+  std::mutex write_mutex_;
+  const int kWaitMs = 10;
+};
+
+/**
+ * @brief The ingress of a process, it reads msgs from a ring and dispatches
+ * them to its down-channels. Set a `MsgMaker` if the downstream expects a
+ * derived msg type.
+ *
+ */
+class ShmReceiver : public MsgSourceNode {
+ public:
+  explicit ShmReceiver(ShmRing_ptr ring,
+                       ShmRing::MsgMaker maker = ShmRing::MsgMaker())
+      : MsgSourceNode("shm_rx:" + ring->Name()), ring_(ring), maker_(maker) {
+    if (!maker_) {
+      maker_ = [](int len) { return std::make_shared<BaseMsg>(len); };
+    }
+    is_stop_ = false;
+  }
+  void HandleMsg(const msg_type& msg) override { Dispatch(msg); }
+  /**
+   * @brief A source node has no up-channel, it polls the ring instead.
+   *
+   */
+  void DoWork() override {
+    uint64_t zero = 0;
+    start_ns_.compare_exchange_strong(zero, NowNs());
+    ThreadAffinity();
+    {
+      std::unique_lock<std::mutex> lg(mutex_);
+      worker_cnt_++;
+    }
+    while (!is_stop_) {
+      msg_type msg = nullptr;
+      {
+        std::lock_guard<std::mutex> lg(read_mutex_);
+        if (!ring_->Read(msg, maker_, kWaitMs)) {
+          continue;
+        }
+      }
+      if (unlikely(StopSignal(msg))) {
+        LOG(INFO) << GetName() << " received stop signal";
+        Dispatch(msg);
+        continue;
+      }
+      Measure([&]() { HandleMsg(msg); });
+    }
+  }
+
+ private:
+  ShmRing_ptr ring_ = nullptr;
+  ShmRing::MsgMaker maker_;
+  // the workers of this node share the consumer side of the ring.
+  std::mutex read_mutex_;
+  const int kWaitMs = 10;
+};
+
+#endif  // SRC_UTIL_SHM_CHANNEL_H_
@@ -0,0 +1,295 @@
+#include "node_duplex.h"
+
+#include <fcntl.h>
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// reads one byte of the fd per msg, or `bytes` without end if it floods.
+class Reader : public NodeDuplex {
+ public:
+  Reader(const std::string& name, int fd, int bytes = 0)
+      : NodeDuplex(name), bytes_(bytes) {
+    fd_ = fd;
+    is_stop_ = false;
+  }
+  int FDRecv() override {
+    if (bytes_ > 0) {
+      reads++;
+      return bytes_;
+    }
+    char c;
+    int ret = read(fd_, &c, 1);
+    if (ret > 0) {
+      reads++;
+    }
+    return ret;
+  }
+  int FDWrite(const msg_type& msg) override { return msg->size(); }
+  bool Init() override { return true; }
+  std::atomic<int> reads = {0};
+
+ private:
+  int bytes_;
+};
+
+// fails every read with `err`.
+class Failing : public Reader {
+ public:
+  Failing(const std::string& name, int fd, int err)
+      : Reader(name, fd), err_(err) {}
+  int FDRecv() override {
+    reads++;
+    errno = err_;
+    return -1;
+  }
+
+ private:
+  int err_;
+};
+
+// dispatches `fanout` numbered msgs per byte of the fd, like a GSO packet
+// which is cut in segments.
+class Producer : public NodeDuplex {
+ public:
+  Producer(const std::string& name, int fd, int fanout = 1)
+      : NodeDuplex(name), fanout_(fanout) {
+    fd_ = fd;
+    is_stop_ = false;
+  }
+  int FDRecv() override {
+    char c;
+    int ret = read(fd_, &c, 1);
+    if (ret <= 0) {
+      return -1;
+    }
+    reads++;
+    for (int i = 0; i < fanout_; i++) {
+      auto msg = std::make_shared<BaseMsg>(1);
+      msg->seq() = seq_++;
+      Dispatch(msg);
+    }
+    return ret;
+  }
+  int FDWrite(const msg_type& msg) override { return msg->size(); }
+  bool Init() override { return true; }
+  std::atomic<int> reads = {0};
+
+ private:
+  int fanout_;
+  uint32_t seq_ = 0;
+};
+
+static void WaitFor(const std::function<bool()>& done) {
+  for (int i = 0; i < 2000 && !done(); i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+TEST(node_duplex_test, read_budget) {
+  ASSERT_TRUE(bats::io::Poller::Configure(1));
+  int flood_fds[2];
+  int fds[2];
+  ASSERT_EQ(pipe(flood_fds), 0);
+  ASSERT_EQ(pipe(fds), 0);
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  ASSERT_EQ(write(flood_fds[1], "x", 1), 1);
+  // the flood never runs dry, only the budget lets the other fd be read.
+  auto flood = std::make_shared<Reader>("flood", flood_fds[0], 100);
+  auto reader = std::make_shared<Reader>("reader", fds[0]);
+  flood->SetReadBudget(32, 1000);
+  ASSERT_TRUE(flood->RegisterToPoller(0));
+  ASSERT_TRUE(reader->RegisterToPoller(0));
+  for (int i = 0; i < 20; i++) {
+    ASSERT_EQ(write(fds[1], "y", 1), 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  WaitFor([&]() { return reader->reads == 20; });
+  EXPECT_EQ(reader->reads, 20);
+  // each callback stops at 10 reads of 100 bytes.
+  EXPECT_GT(flood->ReadYields(), 0u);
+  EXPECT_GE(flood->ReadBytes(), flood->ReadYields() * 1000);
+
+  flood->UnregisterFromPoller();
+  reader->UnregisterFromPoller();
+  close(flood_fds[1]);
+  close(fds[1]);
+}
+
+TEST(node_duplex_test, persistent_read_error) {
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  ASSERT_EQ(write(fds[1], "x", 1), 1);
+  auto node = std::make_shared<Failing>("failing", fds[0], EIO);
+  ASSERT_TRUE(node->RegisterToPoller(0));
+  // re-armed after each error until the shard is unregistered.
+  WaitFor([&]() { return node->ReadErrors() >= 16; });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(node->ReadErrors(), 16u);
+  EXPECT_EQ(node->reads, 16);
+
+  // re-registering reads it again.
+  ASSERT_TRUE(node->ReregisterToPoller());
+  WaitFor([&]() { return node->ReadErrors() >= 32; });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(node->ReadErrors(), 32u);
+
+  node->UnregisterFromPoller();
+  close(fds[1]);
+}
+
+// the seqs of the msgs read off `channel` until it's empty.
+static void Drain(const MsgChannelPtr& channel, std::vector<uint32_t>* seqs) {
+  BaseMsg_ptr msg;
+  while (channel->TryReadMessage(msg)) {
+    seqs->push_back(msg->seq());
+  }
+}
+
+static void ExpectInOrder(const std::vector<uint32_t>& seqs, int total) {
+  ASSERT_EQ(static_cast<int>(seqs.size()), total);
+  for (int i = 0; i < total; i++) {
+    EXPECT_EQ(seqs[i], static_cast<uint32_t>(i));
+  }
+}
+
+TEST(node_duplex_test, channel_credits) {
+  QueueBasedChannel<BaseMsg_ptr> channel("credits", 8);
+  channel.SetWatermark(4, 1);
+  for (int i = 0; i < 4; i++) {
+    EXPECT_TRUE(channel.HasCredit());
+    EXPECT_TRUE(channel.TryWriteMessage(std::make_shared<BaseMsg>(1)));
+  }
+  EXPECT_EQ(channel.Credits(), 0);
+  int fired = 0;
+  channel.OnCredit([&]() { fired++; });
+  EXPECT_EQ(fired, 0);
+  // the credits come back at the low watermark, once.
+  BaseMsg_ptr msg;
+  ASSERT_TRUE(channel.TryReadMessage(msg));
+  ASSERT_TRUE(channel.TryReadMessage(msg));
+  EXPECT_EQ(fired, 0);
+  ASSERT_TRUE(channel.TryReadMessage(msg));
+  EXPECT_EQ(fired, 1);
+  ASSERT_TRUE(channel.TryReadMessage(msg));
+  EXPECT_EQ(fired, 1);
+  // with credits it fires at once.
+  channel.OnCredit([&]() { fired++; });
+  EXPECT_EQ(fired, 2);
+}
+
+TEST(node_duplex_test, backpressure_pause) {
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  auto node = std::make_shared<Producer>("pause", fds[0]);
+  auto out = std::make_shared<QueueBasedChannel<BaseMsg_ptr>>("out", 4);
+  node->AddChannel(out, ChnType::CHN_OUT);
+  ASSERT_TRUE(node->RegisterToPoller(0));
+  ASSERT_EQ(write(fds[1], "0123456789", 10), 10);
+  // the rest stays in the pipe until the credits come back.
+  WaitFor([&]() { return node->IsPaused(); });
+  EXPECT_TRUE(node->IsPaused());
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_EQ(node->reads, 4);
+  std::vector<uint32_t> seqs;
+  WaitFor([&]() {
+    Drain(out, &seqs);
+    return seqs.size() == 10;
+  });
+  ExpectInOrder(seqs, 10);
+  EXPECT_EQ(node->ShedCount(), 0u);
+
+  node->UnregisterFromPoller();
+  close(fds[1]);
+}
+
+TEST(node_duplex_test, backpressure_stash) {
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  // a read yields 3 msgs, more than the credits left.
+  auto node = std::make_shared<Producer>("stash", fds[0], 3);
+  auto out = std::make_shared<QueueBasedChannel<BaseMsg_ptr>>("out", 4);
+  node->AddChannel(out, ChnType::CHN_OUT);
+  ASSERT_TRUE(node->RegisterToPoller(0));
+  ASSERT_EQ(write(fds[1], "01234", 5), 5);
+  WaitFor([&]() { return node->IsPaused(); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_EQ(node->reads, 2);
+  // the stashed msgs go before the ones of the later reads.
+  std::vector<uint32_t> seqs;
+  WaitFor([&]() {
+    Drain(out, &seqs);
+    return seqs.size() == 15;
+  });
+  ExpectInOrder(seqs, 15);
+
+  node->UnregisterFromPoller();
+  close(fds[1]);
+}
+
+TEST(node_duplex_test, backpressure_shed) {
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  auto node = std::make_shared<Producer>("shed", fds[0]);
+  auto out = std::make_shared<QueueBasedChannel<BaseMsg_ptr>>("out", 4);
+  node->AddChannel(out, ChnType::CHN_OUT);
+  // the odd msgs may be dropped, the others wait for room.
+  node->SetBackpressure(Backpressure::SHED, [](const BaseMsg_ptr& msg) {
+    return msg->seq() % 2 == 1;
+  });
+  // the credits run out at 2 msgs, the channel is full at 4.
+  out->SetWatermark(2, 1);
+  ASSERT_TRUE(node->RegisterToPoller(0));
+  ASSERT_EQ(write(fds[1], "0123456789", 10), 10);
+  // 0, 1, 2 and 4 are queued, 3 and 5 are dropped and 6 waits.
+  WaitFor([&]() { return node->reads == 7; });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_EQ(node->reads, 7);
+  EXPECT_EQ(node->ShedCount(), 2u);
+  std::vector<uint32_t> seqs;
+  WaitFor([&]() {
+    Drain(out, &seqs);
+    return node->reads == 10 && out->GetQueue().Size() == 0;
+  });
+  EXPECT_EQ(node->reads, 10);
+  EXPECT_EQ(seqs.size() + node->ShedCount(), 10u);
+  for (uint32_t seq = 0; seq < 10; seq += 2) {
+    EXPECT_NE(std::find(seqs.begin(), seqs.end(), seq), seqs.end());
+  }
+  EXPECT_FALSE(node->IsPaused());
+
+  node->UnregisterFromPoller();
+  close(fds[1]);
+}
+
+TEST(node_duplex_test, backpressure_block) {
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  auto node = std::make_shared<Producer>("block", fds[0]);
+  auto out = std::make_shared<QueueBasedChannel<BaseMsg_ptr>>("out", 4);
+  node->AddChannel(out, ChnType::CHN_OUT);
+  node->SetBackpressure(Backpressure::BLOCK);
+  ASSERT_TRUE(node->RegisterToPoller(0));
+  ASSERT_EQ(write(fds[1], "0123456789", 10), 10);
+  // the reactor waits in the full channel, nothing is dropped.
+  WaitFor([&]() { return node->reads == 5; });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_EQ(node->reads, 5);
+  EXPECT_FALSE(node->IsPaused());
+  std::vector<uint32_t> seqs;
+  WaitFor([&]() {
+    Drain(out, &seqs);
+    return seqs.size() == 10;
+  });
+  ExpectInOrder(seqs, 10);
+
+  node->UnregisterFromPoller();
+  close(fds[1]);
+}
@@ -0,0 +1,126 @@
+#include "node_manager.h"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <thread>
+
+#include "settings.h"
+
+class Relay : public MsgRelayNode {
+ public:
+  explicit Relay(const std::string& name) : MsgRelayNode(name) {}
+  void HandleMsg(const msg_type& msg) override { Dispatch(msg); }
+};
+
+class Source : public MsgSourceNode {
+ public:
+  explicit Source(const std::string& name) : MsgSourceNode(name) {}
+  void HandleMsg(const msg_type& msg) override {}
+  void DoWork() override {
+    while (!is_stop_) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+};
+
+static void RegisterTypes() {
+  NodeFactory::Instance()->Register(
+      "relay", [](const std::string& name, const std::string&) {
+        return NodeHandle(std::make_shared<Relay>(name));
+      });
+  NodeFactory::Instance()->Register(
+      "source", [](const std::string& name, const std::string&) {
+        return NodeHandle(std::make_shared<Source>(name));
+      });
+}
+
+// `source` -> `relay`, and `lonely` of `lonely_type` if it's not empty.
+static void SetTopology(const std::string& lonely_type,
+                        const std::string& to = "relay") {
+  auto& settings = bats::util::Settings::getInstance();
+  settings.setValue<int>("topology.node_count", lonely_type.empty() ? 2 : 3);
+  settings.setValue<int>("topology.edge_count", 1);
+  settings.setValue<std::string>("node0.type", "source");
+  settings.setValue<std::string>("node0.name", "source");
+  settings.setValue<std::string>("node1.type", "relay");
+  settings.setValue<std::string>("node1.name", "relay");
+  settings.setValue<int>("node1.threads", 2);
+  settings.setValue<std::string>("node2.type", lonely_type);
+  settings.setValue<std::string>("node2.name", "lonely");
+  settings.setValue<std::string>("edge0.from", "source");
+  settings.setValue<std::string>("edge0.to", to);
+}
+
+TEST(node_manager_test, load_topology) {
+  RegisterTypes();
+  auto manager = NodeManager::Instance();
+  SetTopology("");
+  ASSERT_TRUE(manager->LoadTopology());
+  auto json = manager->Export("json");
+  EXPECT_NE(json.find("\"source\""), std::string::npos);
+  EXPECT_NE(json.find("\"relay\""), std::string::npos);
+  // the names are taken now.
+  EXPECT_FALSE(manager->LoadTopology());
+  EXPECT_TRUE(manager->RemoveNode("relay"));
+  EXPECT_TRUE(manager->RemoveNode("source"));
+}
+
+TEST(node_manager_test, load_topology_failures) {
+  RegisterTypes();
+  auto manager = NodeManager::Instance();
+  // an unknown type.
+  SetTopology("unknown");
+  EXPECT_FALSE(manager->LoadTopology());
+  EXPECT_FALSE(manager->RemoveNode("source"));
+  // an edge to an unknown node, nothing is connected.
+  SetTopology("", "nowhere");
+  EXPECT_FALSE(manager->LoadTopology());
+  EXPECT_EQ(manager->Export("json").find("\"source\""), std::string::npos);
+  // an edge into a source.
+  SetTopology("", "source");
+  EXPECT_FALSE(manager->LoadTopology());
+
+  // `lonely` has no channel and throws once the others run, they are
+  // stopped and removed.
+  SetTopology("relay");
+  EXPECT_FALSE(manager->LoadTopology());
+  EXPECT_FALSE(manager->RemoveNode("source"));
+  EXPECT_FALSE(manager->RemoveNode("relay"));
+  EXPECT_EQ(manager->Export("json").find("\"source\""), std::string::npos);
+
+  // the names are free again.
+  SetTopology("");
+  EXPECT_TRUE(manager->LoadTopology());
+  EXPECT_TRUE(manager->RemoveNode("relay"));
+  EXPECT_TRUE(manager->RemoveNode("source"));
+}
+
+TEST(node_manager_test, verify) {
+  auto manager = NodeManager::Instance();
+  auto source = NodeHandle(std::make_shared<Source>("v_source"));
+  auto first = NodeHandle(std::make_shared<Relay>("v_first"));
+  auto second = NodeHandle(std::make_shared<Relay>("v_second"));
+  ASSERT_TRUE(manager->Connect(source, first));
+  ASSERT_TRUE(manager->Connect(first, second));
+  // `second` isn't running, the channel into it is not consumed.
+  ASSERT_TRUE(manager->RunAsThreads(source));
+  ASSERT_TRUE(manager->RunAsThreads(first));
+  EXPECT_FALSE(manager->Verify());
+  ASSERT_TRUE(manager->RunAsThreads(second));
+  EXPECT_TRUE(manager->Verify());
+
+  // a cycle.
+  ASSERT_TRUE(manager->Connect(second, first, false));
+  EXPECT_FALSE(manager->Verify());
+  ASSERT_TRUE(manager->Disconnect("v_second", "v_first"));
+  EXPECT_TRUE(manager->Verify());
+
+  // without the ingress the relays are unreachable.
+  ASSERT_TRUE(manager->RemoveNode("v_source"));
+  EXPECT_FALSE(manager->Verify());
+  EXPECT_TRUE(manager->RemoveNode("v_first"));
+  EXPECT_TRUE(manager->RemoveNode("v_second"));
+  EXPECT_TRUE(manager->Verify());
+}
@@ -0,0 +1,71 @@
+#include "node_ordered.h"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+#include "reorder_buffer.h"
+
+class Shuffler : public MsgRelayNode {
+ public:
+  Shuffler() : MsgRelayNode("shuffler") { is_stop_ = false; }
+  void HandleMsg(const msg_type& msg) override {
+    // later messages finish first.
+    std::this_thread::sleep_for(std::chrono::microseconds(msg->seq() % 7));
+    Dispatch(msg);
+  }
+};
+
+TEST(reorder_buffer_test, emit_in_order) {
+  std::vector<uint64_t> out;
+  ReorderBuffer<uint64_t> rb(4, [&out](uint64_t& v) { out.push_back(v); });
+  rb.Commit(2, 2);
+  rb.Commit(1, 1);
+  EXPECT_TRUE(out.empty());
+  EXPECT_EQ(rb.Pending(), 2);
+  rb.Commit(0, 0);
+  rb.Commit(3, 3);
+  ASSERT_EQ(out.size(), 4);
+  for (uint64_t i = 0; i < out.size(); i++) {
+    EXPECT_EQ(out[i], i);
+  }
+  EXPECT_EQ(rb.Next(), 4);
+  EXPECT_EQ(rb.Pending(), 0);
+}
+
+TEST(reorder_buffer_test, ordered_relay) {
+  const int total = 2000;
+  Ordered<Shuffler> node;
+  node.SetWindow(16);
+  auto in = std::make_shared<QueueBasedChannel<BaseMsg_ptr>>("in");
+  auto out = std::make_shared<QueueBasedChannel<BaseMsg_ptr>>("out");
+  node.AddChannel(in, ChnType::CHN_IN);
+  node.AddChannel(out, ChnType::CHN_OUT);
+  std::vector<std::thread> workers;
+  for (int i = 0; i < 4; i++) {
+    workers.emplace_back(&Ordered<Shuffler>::DoWork, &node);
+  }
+  std::thread producer([&in]() {
+    for (int i = 0; i < total; i++) {
+      auto msg = std::make_shared<BaseMsg>(8);
+      msg->seq() = i;
+      in->WriteMessage(msg);
+    }
+  });
+  for (int i = 0; i < total;) {
+    BaseMsg_ptr msg = nullptr;
+    out->ReadMessage(msg);
+    if (msg == nullptr) {
+      continue;
+    }
+    EXPECT_EQ(msg->seq(), static_cast<uint32_t>(i));
+    i++;
+  }
+  producer.join();
+  node.Stop();
+  for (auto& th : workers) {
+    th.join();
+  }
+}
@@ -1,10 +1,281 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
 #include <gflags/gflags.h>
 #include <gtest/gtest.h>
+#include <netinet/udp.h>
 
 #include "src/example/app/src/node_manager.h"
 #include "src/example/app/src/node_tun.h"
 #include "src/example/app/src/node_udp.h"
 
+class Forwarder : public MsgRelayNode {
+ public:
+  explicit Forwarder(const std::string& name) : MsgRelayNode(name) {
+    is_stop_ = false;
+  }
+  void HandleMsg(const msg_type& msg) override { Dispatch(msg); }
+};
+
+class Recorder : public MsgSinkNode {
+ public:
+  explicit Recorder(const std::string& name) : MsgSinkNode(name) {
+    is_stop_ = false;
+  }
+  void HandleMsg(const msg_type& msg) override {
+    std::lock_guard<std::mutex> lg(seqs_mutex);
+    seqs.push_back(msg->seq());
+    sizes.push_back(msg->size());
+  }
+  int Count() {
+    std::lock_guard<std::mutex> lg(seqs_mutex);
+    return seqs.size();
+  }
+  std::mutex seqs_mutex;
+  std::vector<uint32_t> seqs;
+  std::vector<int> sizes;
+};
+
+static void WaitFor(const std::function<bool()>& done) {
+  for (int i = 0; i < 2000 && !done(); i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+// runs first, the other tests shut the manager down.
+TEST(node_test, reconfigure_full_channel) {
+  auto manager = NodeManager::Instance();
+  Forwarder producer("producer");
+  Recorder consumer("consumer");
+  Recorder spare("spare");
+  auto in = std::make_shared<QueueBasedChannel<BaseMsg_ptr>>("in", 16);
+  producer.AddChannel(in, ChnType::CHN_IN);
+  ASSERT_TRUE(
+      manager->Connect(NodeHandle(&producer), NodeHandle(&consumer), true, 2));
+  ASSERT_TRUE(manager->RunAsThreads(NodeHandle(&producer)));
+  for (int i = 0; i < 4; i++) {
+    auto msg = std::make_shared<BaseMsg>(4);
+    msg->seq() = i;
+    in->WriteMessage(msg);
+  }
+  // the producer is blocked on the full channel of the idle consumer.
+  WaitFor([&]() { return in->GetQueue().Size() == 1; });
+  ASSERT_EQ(in->GetQueue().Size(), 1);
+  ASSERT_TRUE(
+      manager->Connect(NodeHandle(&producer), NodeHandle(&spare), false, 2));
+  ASSERT_TRUE(manager->RunAsThreads(NodeHandle(&consumer)));
+  WaitFor([&]() { return consumer.Count() == 4; });
+  ASSERT_EQ(consumer.Count(), 4);
+  for (int i = 0; i < 4; i++) {
+    EXPECT_EQ(consumer.seqs[i], static_cast<uint32_t>(i));
+  }
+
+  // block the producer on the idle spare, then disconnect the spare.
+  for (int i = 4; i < 8; i++) {
+    auto msg = std::make_shared<BaseMsg>(4);
+    msg->seq() = i;
+    msg->id() = 1;
+    in->WriteMessage(msg);
+  }
+  WaitFor([&]() { return in->GetQueue().Size() == 1; });
+  ASSERT_TRUE(manager->Disconnect("producer", "spare"));
+  EXPECT_EQ(producer.GetChannelNum(ChnType::CHN_OUT), 1);
+  // the stashed msg and the queued one go to the consumer, the two in the
+  // channel of the spare are dropped with it.
+  WaitFor([&]() { return consumer.Count() == 6; });
+  EXPECT_EQ(consumer.Count(), 6);
+
+  EXPECT_TRUE(manager->RemoveNode("producer"));
+  EXPECT_TRUE(manager->RemoveNode("consumer"));
+}
+
+// an ipv4 packet of the flow `src` -> `dst`, numbered by `seq`.
+static BaseMsg_ptr FlowPacket(uint8_t src, uint8_t dst, uint32_t seq) {
+  auto msg = std::make_shared<BaseMsg>(20);
+  auto data = msg->begin();
+  data[0] = 0x45;
+  data[15] = src;
+  data[19] = dst;
+  msg->seq() = seq;
+  return msg;
+}
+
+TEST(node_test, dispatch_by_flow) {
+  Forwarder forwarder("flow_forwarder");
+  forwarder.SetDispatchPolicy(DispatchPolicy::DISPATCH_BY_FLOW);
+  std::vector<MsgChannelPtr> channels;
+  for (int i = 0; i < 4; i++) {
+    channels.push_back(std::make_shared<QueueBasedChannel<BaseMsg_ptr>>(
+        "flow" + std::to_string(i), 64));
+    forwarder.AddChannel(channels.back(), ChnType::CHN_OUT);
+  }
+  for (uint32_t seq = 0; seq < 8; seq++) {
+    for (uint8_t flow = 1; flow <= 3; flow++) {
+      forwarder.HandleMsg(FlowPacket(flow, 100 + flow, seq));
+    }
+  }
+  // a truncated packet goes to the first channel.
+  forwarder.HandleMsg(std::make_shared<BaseMsg>(10));
+  EXPECT_GT(channels[0]->GetQueue().Size(), 0);
+
+  // every flow is in one channel, in its order.
+  std::map<uint8_t, int> flow_channel;
+  std::map<uint8_t, uint32_t> next_seq;
+  for (int i = 0; i < 4; i++) {
+    BaseMsg_ptr msg;
+    while (channels[i]->TryReadMessage(msg)) {
+      if (msg->size() < 20) {
+        EXPECT_EQ(i, 0);
+        continue;
+      }
+      auto flow = msg->begin()[15];
+      if (flow_channel.count(flow) == 0) {
+        flow_channel[flow] = i;
+      }
+      EXPECT_EQ(flow_channel[flow], i);
+      EXPECT_EQ(msg->seq(), next_seq[flow]++);
+    }
+  }
+  EXPECT_EQ(flow_channel.size(), 3u);
+  for (auto& item : next_seq) {
+    EXPECT_EQ(item.second, 8u);
+  }
+}
+
+// send `segs` datagrams of `seg` bytes as one `UDP_SEGMENT` buffer.
+static bool SendSegments(int fd, const sockaddr_in& dst, int segs, int seg) {
+  std::vector<char> buf(segs * seg, 'a');
+  iovec iov{buf.data(), buf.size()};
+  alignas(cmsghdr) char ctrl[CMSG_SPACE(sizeof(uint16_t))] = {};
+  msghdr hdr{};
+  hdr.msg_name = const_cast<sockaddr_in*>(&dst);
+  hdr.msg_namelen = sizeof(dst);
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_control = ctrl;
+  hdr.msg_controllen = sizeof(ctrl);
+  auto cmsg = CMSG_FIRSTHDR(&hdr);
+  cmsg->cmsg_level = SOL_UDP;
+  cmsg->cmsg_type = UDP_SEGMENT;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+  uint16_t size = seg;
+  memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+  return sendmsg(fd, &hdr, 0) == static_cast<ssize_t>(buf.size());
+}
+
+TEST(node_test, udp_gro_mixed_segments) {
+  auto manager = NodeManager::Instance();
+  auto udp = std::make_shared<bats::src::Udp>(8899, 1, "gro_udp");
+  udp->SetOffload(false, true);
+  Recorder sink("gro_sink");
+  ASSERT_TRUE(manager->Connect(NodeHandle(udp), NodeHandle(&sink), false));
+  ASSERT_TRUE(manager->RunAsThreads(NodeHandle(&sink)));
+  ASSERT_TRUE(udp->RegisterToPoller());
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in dst{};
+  dst.sin_family = AF_INET;
+  dst.sin_port = htons(8899);
+  dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  // small segments fit the iovs to them, the large ones which follow must
+  // not be truncated.
+  ASSERT_TRUE(SendSegments(fd, dst, 10, 200));
+  WaitFor([&]() { return sink.Count() == 10; });
+  ASSERT_TRUE(SendSegments(fd, dst, 40, 1400));
+  WaitFor([&]() { return sink.Count() == 50; });
+  ASSERT_TRUE(SendSegments(fd, dst, 10, 200));
+  WaitFor([&]() { return sink.Count() == 60; });
+  close(fd);
+  ASSERT_EQ(sink.Count(), 60);
+  for (int i = 0; i < 60; i++) {
+    EXPECT_EQ(sink.sizes[i], i < 10 || i >= 50 ? 200 : 1400);
+  }
+
+  udp->UnregisterFromPoller();
+  EXPECT_TRUE(manager->RemoveNode("gro_sink"));
+}
+
+TEST(node_test, udp_batch) {
+  auto udp = std::make_shared<bats::src::Udp>(8898, 1, "batch_udp");
+  udp->SetBatch(4);
+  auto out = std::make_shared<QueueBasedChannel<BaseMsg_ptr>>("batch", 64);
+  udp->AddChannel(out, ChnType::CHN_OUT);
+  // as `RegisterToPoller` does, a blocking `recvmmsg` waits for a full batch.
+  fcntl(udp->ShardFd(0), F_SETFL, O_NONBLOCK);
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in local{};
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ASSERT_EQ(bind(fd, reinterpret_cast<sockaddr*>(&local), sizeof(local)), 0);
+  socklen_t len = sizeof(local);
+  getsockname(fd, reinterpret_cast<sockaddr*>(&local), &len);
+  sockaddr_in dst = local;
+  dst.sin_port = htons(8898);
+  char buf[2048] = {};
+  for (int i = 0; i < 10; i++) {
+    ASSERT_EQ(sendto(fd, buf, 100, 0, reinterpret_cast<sockaddr*>(&dst),
+                     sizeof(dst)),
+              100);
+  }
+  // one `recvmmsg` takes up to the batch.
+  int msgs = 0;
+  EXPECT_EQ(udp->FDRecvBatch(0, 32, &msgs), 400);
+  EXPECT_EQ(msgs, 4);
+  EXPECT_EQ(udp->FDRecvBatch(0, 32, &msgs), 400);
+  EXPECT_EQ(udp->FDRecvBatch(0, 32, &msgs), 200);
+  EXPECT_EQ(msgs, 2);
+  EXPECT_EQ(out->GetQueue().Size(), 10);
+
+  // one `sendmmsg` per batch, every msg arrives.
+  std::vector<BaseMsg_ptr> batch;
+  for (int i = 0; i < 10; i++) {
+    auto msg = std::make_shared<BaseMsg>(64 + i);
+    msg->encodeInfo().dst_addr = local;
+    batch.push_back(msg);
+  }
+  EXPECT_EQ(udp->FDWriteBatch(batch.data(), batch.size()), 10);
+  for (int i = 0; i < 10; i++) {
+    EXPECT_EQ(recv(fd, buf, sizeof(buf), 0), 64 + i);
+  }
+  close(fd);
+}
+
+TEST(node_test, udp_uring) {
+  auto manager = NodeManager::Instance();
+  auto udp = std::make_shared<bats::src::Udp>(8897, 2, "uring_udp");
+  if (!udp->SetUring(true)) {
+    // an older kernel, the sockets are read by `recvmmsg`.
+    return;
+  }
+  EXPECT_NE(udp->PollFd(0), udp->ShardFd(0));
+  Recorder sink("uring_sink");
+  ASSERT_TRUE(manager->Connect(NodeHandle(udp), NodeHandle(&sink), false));
+  ASSERT_TRUE(manager->RunAsThreads(NodeHandle(&sink)));
+  ASSERT_TRUE(udp->RegisterToPoller());
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in dst{};
+  dst.sin_family = AF_INET;
+  dst.sin_port = htons(8897);
+  dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  // more datagrams than the buffers of a ring, they are lent again.
+  char buf[2048] = {};
+  for (int i = 0; i < 600; i++) {
+    ASSERT_EQ(sendto(fd, buf, 100 + i % 7, 0,
+                     reinterpret_cast<sockaddr*>(&dst), sizeof(dst)),
+              100 + i % 7);
+    if (i % 100 == 99) {
+      WaitFor([&]() { return sink.Count() == i + 1; });
+    }
+  }
+  close(fd);
+  ASSERT_EQ(sink.Count(), 600);
+  // a flow goes to one socket, its datagrams keep their order.
+  for (int i = 0; i < 600; i++) {
+    EXPECT_EQ(sink.sizes[i], 100 + i % 7);
+  }
+
+  udp->UnregisterFromPoller();
+  EXPECT_TRUE(manager->RemoveNode("uring_sink"));
+}
+
 TEST(node_test, node_connection) {
   bats::src::Udp u(8888);
   bats::src::Tun t;
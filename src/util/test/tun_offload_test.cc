@@ -0,0 +1,140 @@
+#include "tun_offload.h"
+
+#include <arpa/inet.h>
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+using base::util::TunFrame;
+using base::util::VnetHdr;
+
+static uint16_t Checksum(const char* data, int len, uint32_t sum = 0) {
+  auto bytes = reinterpret_cast<const uint8_t*>(data);
+  for (int i = 0; i + 1 < len; i += 2) {
+    sum += (bytes[i] << 8) | bytes[i + 1];
+  }
+  if (len & 1) {
+    sum += bytes[len - 1] << 8;
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return ~sum & 0xffff;
+}
+
+// a tcp packet of 20 bytes options and `payload` bytes
+static std::vector<char> MakePacket(int payload, uint32_t seq) {
+  std::vector<char> packet(60 + payload);
+  auto iph = reinterpret_cast<struct ip*>(packet.data());
+  iph->ip_v = 4;
+  iph->ip_hl = 5;
+  iph->ip_len = htons(packet.size());
+  iph->ip_id = htons(100);
+  iph->ip_ttl = 64;
+  iph->ip_p = IPPROTO_TCP;
+  iph->ip_src.s_addr = inet_addr("10.0.0.1");
+  iph->ip_dst.s_addr = inet_addr("10.0.0.2");
+  auto th = reinterpret_cast<struct tcphdr*>(packet.data() + 20);
+  th->source = htons(1000);
+  th->dest = htons(2000);
+  th->seq = htonl(seq);
+  th->doff = 10;
+  th->ack = 1;
+  th->psh = 1;
+  for (int i = 0; i < payload; i++) {
+    packet[60 + i] = (seq + i) % 251;
+  }
+  return packet;
+}
+
+static bool TcpChecksumOk(const char* packet, int len) {
+  uint32_t sum = IPPROTO_TCP + len - 20;
+  sum += Checksum(packet + 12, 8) ^ 0xffff;
+  return Checksum(packet + 20, len - 20, sum) == 0;
+}
+
+TEST(tun_offload_test, segment_and_coalesce) {
+  const int mss = 1000;
+  auto packet = MakePacket(mss * 5 + 300, 7);
+  VnetHdr hdr;
+  hdr.gso_type = VnetHdr::kGsoTcpv4;
+  hdr.gso_size = mss;
+  std::vector<std::vector<char>> segs;
+  int num = base::util::GsoSegment(
+      hdr, packet.data(), packet.size(), [&segs](int len) {
+        segs.emplace_back(len);
+        return segs.back().data();
+      });
+  ASSERT_EQ(num, 6);
+  std::vector<TunFrame> frames;
+  for (int i = 0; i < num; i++) {
+    auto& seg = segs[i];
+    auto th = reinterpret_cast<struct tcphdr*>(seg.data() + 20);
+    EXPECT_EQ(seg.size(), 60u + (i < 5 ? mss : 300));
+    EXPECT_EQ(ntohl(th->seq), 7u + i * mss);
+    // only the last one is pushed
+    EXPECT_EQ(th->psh, i == 5);
+    EXPECT_EQ(Checksum(seg.data(), 20), 0);
+    EXPECT_TRUE(TcpChecksumOk(seg.data(), seg.size()));
+    frames.push_back({seg.data(), static_cast<int>(seg.size())});
+  }
+  ASSERT_EQ(base::util::GroRunLength(frames.data(), frames.size()), 6);
+  VnetHdr vnet;
+  char head[base::util::kMaxGroHeader];
+  int hlen = base::util::GroBuildHeader(frames.data(), num, &vnet, head);
+  ASSERT_EQ(hlen, 60);
+  EXPECT_EQ(vnet.gso_type, VnetHdr::kGsoTcpv4);
+  EXPECT_EQ(vnet.gso_size, mss);
+  EXPECT_EQ(vnet.csum_start, 20);
+  std::vector<char> merged(head, head + hlen);
+  for (auto& frame : frames) {
+    merged.insert(merged.end(), frame.data + hlen, frame.data + frame.len);
+  }
+  EXPECT_EQ(merged.size(), packet.size());
+  EXPECT_EQ(memcmp(merged.data() + hlen, packet.data() + hlen,
+                   packet.size() - hlen),
+            0);
+}
+
+TEST(tun_offload_test, break_runs) {
+  auto a = MakePacket(1000, 0);
+  auto b = MakePacket(1000, 1000);
+  auto c = MakePacket(1000, 5000);
+  // a pushed segment ends a run
+  std::vector<TunFrame> frames = {{a.data(), 1060}, {b.data(), 1060}};
+  EXPECT_EQ(base::util::GroRunLength(frames.data(), 2), 1);
+  reinterpret_cast<struct tcphdr*>(a.data() + 20)->psh = 0;
+  reinterpret_cast<struct tcphdr*>(b.data() + 20)->psh = 0;
+  EXPECT_EQ(base::util::GroRunLength(frames.data(), 2), 2);
+  // a gap in the sequence
+  frames.push_back({c.data(), 1060});
+  EXPECT_EQ(base::util::GroRunLength(frames.data(), 3), 2);
+  // another flow
+  reinterpret_cast<struct tcphdr*>(b.data() + 20)->dest = htons(2001);
+  EXPECT_EQ(base::util::GroRunLength(frames.data(), 2), 1);
+}
+
+TEST(tun_offload_test, complete_checksum) {
+  auto packet = MakePacket(100, 0);
+  auto th = reinterpret_cast<struct tcphdr*>(packet.data() + 20);
+  // the partial checksum is the sum of the pseudo header
+  uint32_t sum = IPPROTO_TCP + packet.size() - 20;
+  th->check = htons(Checksum(packet.data() + 12, 8, sum) ^ 0xffff);
+  VnetHdr hdr;
+  hdr.flags = VnetHdr::kNeedsCsum;
+  hdr.csum_start = 20;
+  hdr.csum_offset = 16;
+  std::vector<char> out;
+  EXPECT_EQ(base::util::GsoSegment(hdr, packet.data(), packet.size(),
+                                   [&out](int len) {
+                                     out.resize(len);
+                                     return out.data();
+                                   }),
+            1);
+  EXPECT_TRUE(TcpChecksumOk(out.data(), out.size()));
+}
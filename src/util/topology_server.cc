@@ -0,0 +1,305 @@
+/**
+ * @file topology_server.cc
+ * @author peng lei (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-11-24
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include "topology_server.h"
+
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <csignal>
+#include <cstring>
+#include <fstream>
+
+#include "io/poller.h"
+#include "util/util.h"
+
+int TopologyServer::signal_pipe_[2] = {-1, -1};
+
+bool TopologyServer::Listen(const std::string& path) {
+  std::lock_guard<std::mutex> lg(mutex_);
+  if (listen_fd_ >= 0) {
+    return false;
+  }
+  struct sockaddr_un addr;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    LOG(ERROR) << "socket path is too long " << path;
+    return false;
+  }
+  if ((listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+    LOG(ERROR) << "socket error " << strerror(errno);
+    return false;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  unlink(path.c_str());
+  if (bind(listen_fd_, (const struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(listen_fd_, 8) < 0) {
+    LOG(ERROR) << "listen on " << path << " error " << strerror(errno);
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  path_ = path;
+  listen_req_.fd = listen_fd_;
+  listen_req_.events = EPOLLIN | EPOLLET;
+  listen_req_.callback = [this](const bats::io::PollResponse& rsp) {
+    if (rsp.events & EPOLLIN) {
+      HandleAccept();
+    }
+  };
+  LOG(INFO) << "topology is served on " << path;
+  return bats::io::Poller::Instance()->Register(listen_req_);
+}
+
+bool TopologyServer::DumpOnSignal(int signo, const std::string& prefix) {
+  std::lock_guard<std::mutex> lg(mutex_);
+  if (signo_ != 0 || signal_pipe_[0] >= 0) {
+    return false;
+  }
+  if (pipe2(signal_pipe_, O_NONBLOCK | O_CLOEXEC) < 0) {
+    LOG(ERROR) << "create pipe failed, " << strerror(errno);
+    return false;
+  }
+  signo_ = signo;
+  dump_prefix_ = prefix;
+  signal_req_.fd = signal_pipe_[0];
+  signal_req_.events = EPOLLIN | EPOLLET;
+  signal_req_.callback = [this](const bats::io::PollResponse& rsp) {
+    if (rsp.events & EPOLLIN) {
+      HandleSignal();
+    }
+  };
+  if (!bats::io::Poller::Instance()->Register(signal_req_)) {
+    return false;
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = &TopologyServer::SignalHandler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  return sigaction(signo, &sa, nullptr) == 0;
+}
+
+void TopologyServer::Stop() {
+  std::lock_guard<std::mutex> lg(mutex_);
+  if (listen_fd_ >= 0) {
+    bats::io::Poller::Instance()->Unregister(listen_req_);
+    close(listen_fd_);
+    unlink(path_.c_str());
+    listen_fd_ = -1;
+  }
+  if (signo_ != 0) {
+    signal(signo_, SIG_DFL);
+    bats::io::Poller::Instance()->Unregister(signal_req_);
+    close(signal_pipe_[0]);
+    close(signal_pipe_[1]);
+    signal_pipe_[0] = signal_pipe_[1] = -1;
+    signo_ = 0;
+  }
+  // no client is accepted any more, drop the ones still sending commands.
+  std::unordered_map<int, Client> clients;
+  {
+    std::lock_guard<std::mutex> clients_lg(clients_mutex_);
+    clients.swap(clients_);
+  }
+  for (auto& client : clients) {
+    bats::io::Poller::Instance()->Unregister(client.second.req);
+    close(client.first);
+  }
+  std::thread worker;
+  {
+    std::lock_guard<std::mutex> jobs_lg(jobs_mutex_);
+    stopping_ = true;
+    worker.swap(worker_);
+  }
+  jobs_cv_.notify_all();
+  if (worker.joinable()) {
+    worker.join();
+  }
+  std::lock_guard<std::mutex> jobs_lg(jobs_mutex_);
+  for (auto& job : jobs_) {
+    if (job.fd >= 0) {
+      close(job.fd);
+    }
+  }
+  jobs_.clear();
+  stopping_ = false;
+}
+
+void TopologyServer::HandleAccept() {
+  while (true) {
+    int fd =
+        accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        LOG(WARNING) << "accept error " << strerror(errno);
+      }
+      if (errno != EINTR) {
+        break;
+      }
+      continue;
+    }
+    // the command is sent right after connecting, a client which doesn't
+    // send it in time is dropped by the timeout of its request.
+    std::lock_guard<std::mutex> lg(clients_mutex_);
+    auto& client = clients_[fd];
+    client.req.fd = fd;
+    client.req.events = EPOLLIN | EPOLLET;
+    client.req.timeout_ms = kCommandTimeoutMs;
+    client.req.callback = [this, fd](const bats::io::PollResponse& rsp) {
+      HandleClient(fd, rsp.events);
+    };
+    if (!bats::io::Poller::Instance()->Register(client.req)) {
+      clients_.erase(fd);
+      close(fd);
+    }
+  }
+}
+
+void TopologyServer::HandleClient(int fd, uint32_t events) {
+  std::unique_lock<std::mutex> lock(clients_mutex_);
+  auto it = clients_.find(fd);
+  if (it == clients_.end()) {
+    return;
+  }
+  auto& client = it->second;
+  bool done = !(events & EPOLLIN);
+  char buf[16];
+  while (!done && client.cmd.size() < kMaxCommandLen) {
+    auto ret = read(fd, buf, kMaxCommandLen - client.cmd.size());
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      done = ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+      break;
+    }
+    client.cmd.append(buf, ret);
+    done = client.cmd.find('\n') != std::string::npos;
+  }
+  done = done || client.cmd.size() >= kMaxCommandLen;
+  if (!done) {
+    // wait for the rest of the command, with a new timeout.
+    bats::io::Poller::Instance()->Register(client.req);
+    return;
+  }
+  auto req = client.req;
+  auto format = bats::util::trim(client.cmd);
+  bool received = !client.cmd.empty();
+  clients_.erase(it);
+  lock.unlock();
+
+  bats::io::Poller::Instance()->Unregister(req);
+  if (!received) {
+    // timed out or closed before sending a command.
+    close(fd);
+    return;
+  }
+  Post(Job{fd, format.empty() ? "json" : format});
+}
+
+void TopologyServer::HandleSignal() {
+  char c = 0;
+  bool signaled = false;
+  while (read(signal_pipe_[0], &c, 1) > 0) {
+    signaled = true;
+  }
+  if (signaled) {
+    Post(Job{-1, ""});
+  }
+}
+
+void TopologyServer::Post(const Job& job) {
+  {
+    std::lock_guard<std::mutex> lg(jobs_mutex_);
+    if (stopping_) {
+      if (job.fd >= 0) {
+        close(job.fd);
+      }
+      return;
+    }
+    jobs_.push_back(job);
+    if (!worker_.joinable()) {
+      worker_ = std::thread(&TopologyServer::Work, this);
+    }
+  }
+  jobs_cv_.notify_one();
+}
+
+void TopologyServer::Work() {
+  while (true) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(jobs_mutex_);
+      jobs_cv_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+      if (stopping_) {
+        return;
+      }
+      job = jobs_.front();
+      jobs_.pop_front();
+    }
+    if (job.fd < 0) {
+      Dump();
+      continue;
+    }
+    Reply(job.fd, job.format);
+    close(job.fd);
+  }
+}
+
+void TopologyServer::Reply(int fd, const std::string& format) {
+  // the worker may block on the client, but not longer than the timeout.
+  int flags = fcntl(fd, F_GETFL);
+  fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+  struct timeval tv = {kSendTimeoutMs / 1000, (kSendTimeoutMs % 1000) * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  auto output = provider_(format);
+  size_t sent = 0;
+  while (sent < output.size()) {
+    auto n = send(fd, output.data() + sent, output.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      LOG(WARNING) << "send topology failed, " << strerror(errno);
+      break;
+    }
+    sent += n;
+  }
+}
+
+void TopologyServer::Dump() {
+  for (auto format : {"dot", "json"}) {
+    auto file = dump_prefix_ + "." + format;
+    std::ofstream stream(file, std::ios_base::out | std::ios_base::trunc);
+    if (!stream) {
+      LOG(WARNING) << "open " << file << " failed";
+      continue;
+    }
+    stream << provider_(format);
+    LOG(INFO) << "topology is dumped to " << file;
+  }
+}
+
+void TopologyServer::SignalHandler(int signo) {
+  UNUSED(signo);
+  int saved = errno;
+  char c = 'S';
+  if (signal_pipe_[1] >= 0) {
+    auto ret = write(signal_pipe_[1], &c, 1);
+    UNUSED(ret);
+  }
+  errno = saved;
+}
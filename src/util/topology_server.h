@@ -0,0 +1,111 @@
+/**
+ * @file topology_server.h
+ * @author peng lei (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-11-24
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef SRC_UTIL_TOPOLOGY_SERVER_H_
+#define SRC_UTIL_TOPOLOGY_SERVER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "io/poll_data.h"
+#include "macros.h"
+
+/**
+ * @brief Serve the topology export of a running process on demand. Both ways
+ * are driven by the poller thread:
+ * (1) A local unix socket, a client sends `dot` or `json` and reads the
+ * export until the socket is closed, e.g. `echo dot | nc -U /tmp/topo.sock`.
+ * (2) A signal, the export is written to `<prefix>.dot` and `<prefix>.json`.
+ * The poller only reads the requests, the exports are built and written by a
+ * worker thread of the server, so a slow client or the locks taken by the
+ * provider never stall the other fds of a reactor.
+ */
+class TopologyServer {
+ public:
+  /**
+   * @brief Produce the export in `format`, which is `dot` or `json`.
+   */
+  using Provider = std::function<std::string(const std::string& format)>;
+
+  explicit TopologyServer(Provider provider) : provider_(provider) {}
+  ~TopologyServer() { Stop(); }
+  /**
+   * @brief Listen on a unix socket.
+   *
+   * @param path The path of the socket, it's replaced if it exists.
+   * @return true
+   * @return false
+   */
+  bool Listen(const std::string& path);
+  /**
+   * @brief Dump the export to files when `signo` is received.
+   *
+   * @param signo
+   * @param prefix
+   * @return true
+   * @return false
+   */
+  bool DumpOnSignal(int signo, const std::string& prefix);
+  void Stop();
+
+ private:
+  // a client which has not sent its whole command yet.
+  struct Client {
+    bats::io::PollRequest req;
+    std::string cmd;
+  };
+  // an export to produce, for a client or for the files if `fd` is -1.
+  struct Job {
+    int fd = -1;
+    std::string format;
+  };
+  void HandleAccept();
+  void HandleClient(int fd, uint32_t events);
+  void HandleSignal();
+  void Post(const Job& job);
+  void Work();
+  void Reply(int fd, const std::string& format);
+  void Dump();
+  static void SignalHandler(int signo);
+
+  Provider provider_;
+  std::mutex mutex_;
+  std::mutex clients_mutex_;
+  std::unordered_map<int, Client> clients_;
+  std::mutex jobs_mutex_;
+  std::condition_variable jobs_cv_;
+  std::deque<Job> jobs_;
+  bool stopping_ = false;
+  std::thread worker_;
+  int listen_fd_ = -1;
+  std::string path_;
+  bats::io::PollRequest listen_req_;
+  int signo_ = 0;
+  std::string dump_prefix_;
+  bats::io::PollRequest signal_req_;
+  // the signal handler writes to the pipe, the poller reads from it.
+  static int signal_pipe_[2];
+  // The time to wait for the command of a client.
+  const int kCommandTimeoutMs = 50;
+  // The time to wait for a client to take the export.
+  const int kSendTimeoutMs = 1000;
+  const size_t kMaxCommandLen = 15;
+  DISALLOW_COPY_AND_ASSIGN(TopologyServer)
+};
+
+using TopologyServer_ptr = std::shared_ptr<TopologyServer>;
+
+#endif  // SRC_UTIL_TOPOLOGY_SERVER_H_
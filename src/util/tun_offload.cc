@@ -0,0 +1,251 @@
+/**
+ * @file tun_offload.cc
+ * @author peng lei (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-11-28
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include "tun_offload.h"
+
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <algorithm>
+
+namespace base {
+namespace util {
+
+namespace {
+
+const int kIpv6HdrLen = sizeof(struct ip6_hdr);
+
+uint64_t CsumAdd(uint64_t sum, const char* data, int len) {
+  auto bytes = reinterpret_cast<const uint8_t*>(data);
+  for (; len > 1; len -= 2, bytes += 2) {
+    sum += (bytes[0] << 8) | bytes[1];
+  }
+  if (len == 1) {
+    sum += bytes[0] << 8;
+  }
+  return sum;
+}
+
+uint16_t CsumFold(uint64_t sum) {
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return static_cast<uint16_t>(sum);
+}
+
+// the sum of the pseudo header of a tcp or udp packet of `len` bytes
+uint64_t PseudoSum(const char* packet, uint8_t proto, int len) {
+  uint64_t sum = proto + len;
+  if ((packet[0] >> 4) == 4) {
+    return CsumAdd(sum, packet + offsetof(struct ip, ip_src), 8);
+  }
+  return CsumAdd(sum, packet + offsetof(struct ip6_hdr, ip6_src), 32);
+}
+
+void StoreCsum(char* at, uint16_t csum) {
+  uint16_t value = htons(csum);
+  memcpy(at, &value, sizeof(value));
+}
+
+// the length of the ip header, 0 if it's not a tcp packet
+int TcpOffset(const char* packet, int len) {
+  if (len >= static_cast<int>(sizeof(struct ip)) && (packet[0] >> 4) == 4) {
+    auto iph = reinterpret_cast<const struct ip*>(packet);
+    return iph->ip_p == IPPROTO_TCP ? iph->ip_hl * 4 : 0;
+  }
+  if (len >= kIpv6HdrLen && (packet[0] >> 4) == 6) {
+    auto ip6h = reinterpret_cast<const struct ip6_hdr*>(packet);
+    // no extension headers
+    return ip6h->ip6_nxt == IPPROTO_TCP ? kIpv6HdrLen : 0;
+  }
+  return 0;
+}
+
+// fix the ip header of a packet of `len` bytes, `index` is the segment number
+void FixIpHeader(char* packet, int iphl, int len, int index) {
+  if ((packet[0] >> 4) == 4) {
+    auto iph = reinterpret_cast<struct ip*>(packet);
+    iph->ip_len = htons(len);
+    iph->ip_id = htons(ntohs(iph->ip_id) + index);
+    iph->ip_sum = 0;
+    iph->ip_sum = htons(~CsumFold(CsumAdd(0, packet, iphl)));
+  } else {
+    auto ip6h = reinterpret_cast<struct ip6_hdr*>(packet);
+    ip6h->ip6_plen = htons(len - kIpv6HdrLen);
+  }
+}
+
+int SegmentTcp(const VnetHdr& hdr, const char* packet, int len,
+               const std::function<char*(int len)>& alloc) {
+  int iphl = TcpOffset(packet, len);
+  if (iphl == 0 || len < iphl + static_cast<int>(sizeof(struct tcphdr))) {
+    return -1;
+  }
+  auto th = reinterpret_cast<const struct tcphdr*>(packet + iphl);
+  int hlen = iphl + th->doff * 4;
+  int mss = hdr.gso_size;
+  if (mss == 0 || hlen > len) {
+    return -1;
+  }
+  int payload = len - hlen;
+  uint32_t seq = ntohl(th->seq);
+  int segs = 0;
+  for (int offset = 0; offset < payload; offset += mss, segs++) {
+    int seg_payload = std::min(mss, payload - offset);
+    int seg_len = hlen + seg_payload;
+    char* seg = alloc(seg_len);
+    memcpy(seg, packet, hlen);
+    memcpy(seg + hlen, packet + hlen + offset, seg_payload);
+    FixIpHeader(seg, iphl, seg_len, segs);
+    auto seg_th = reinterpret_cast<struct tcphdr*>(seg + iphl);
+    seg_th->seq = htonl(seq + offset);
+    if (offset + seg_payload < payload) {
+      // only the last segment keeps FIN and PSH
+      seg_th->fin = 0;
+      seg_th->psh = 0;
+    }
+    if (segs > 0) {
+      // CWR is set on the first segment only
+      seg_th->th_flags &= ~0x80;
+    }
+    seg_th->check = 0;
+    uint64_t sum = PseudoSum(seg, IPPROTO_TCP, seg_len - iphl);
+    seg_th->check = htons(~CsumFold(CsumAdd(sum, seg + iphl, seg_len - iphl)));
+  }
+  return segs;
+}
+
+}  // namespace
+
+int GsoSegment(const VnetHdr& hdr, const char* packet, int len,
+               const std::function<char*(int len)>& alloc) {
+  switch (hdr.gso_type & ~VnetHdr::kGsoEcn) {
+    case VnetHdr::kGsoNone:
+      break;
+    case VnetHdr::kGsoTcpv4:
+    case VnetHdr::kGsoTcpv6:
+      return SegmentTcp(hdr, packet, len, alloc);
+    default:
+      return -1;
+  }
+  char* out = alloc(len);
+  memcpy(out, packet, len);
+  if (hdr.flags & VnetHdr::kNeedsCsum) {
+    // the checksum field holds the sum of the pseudo header
+    int start = hdr.csum_start;
+    int at = start + hdr.csum_offset;
+    if (at + 2 > len) {
+      return -1;
+    }
+    StoreCsum(out + at, ~CsumFold(CsumAdd(0, out + start, len - start)));
+  }
+  return 1;
+}
+
+int GroRunLength(const TunFrame* frames, int num) {
+  num = std::min(num, kMaxGroSegments);
+  const char* first = frames[0].data;
+  int iphl = TcpOffset(first, frames[0].len);
+  if (iphl == 0 || num < 2 ||
+      frames[0].len < iphl + static_cast<int>(sizeof(struct tcphdr))) {
+    return 1;
+  }
+  if ((first[0] >> 4) == 4) {
+    auto iph = reinterpret_cast<const struct ip*>(first);
+    if (iph->ip_hl != 5 || (ntohs(iph->ip_off) & (IP_MF | IP_OFFMASK))) {
+      return 1;
+    }
+  }
+  auto th = reinterpret_cast<const struct tcphdr*>(first + iphl);
+  int hlen = iphl + th->doff * 4;
+  int mss = frames[0].len - hlen;
+  // nothing but ACK and PSH
+  const uint8_t kGroFlags = TH_ACK | TH_PUSH;
+  if (mss <= 0 || (th->th_flags & ~kGroFlags) || th->psh) {
+    return 1;
+  }
+  uint32_t next_seq = ntohl(th->seq) + mss;
+  int bytes = frames[0].len;
+  int run = 1;
+  for (; run < num; run++) {
+    auto& frame = frames[run];
+    int payload = frame.len - hlen;
+    if (payload <= 0 || payload > mss || bytes + payload > kMaxGsoPacket) {
+      break;
+    }
+    const char* data = frame.data;
+    auto seg_th = reinterpret_cast<const struct tcphdr*>(data + iphl);
+    if (TcpOffset(data, frame.len) != iphl || seg_th->doff != th->doff ||
+        ntohl(seg_th->seq) != next_seq ||
+        (seg_th->th_flags & ~kGroFlags) != 0) {
+      break;
+    }
+    // same tos, fragment flags, ttl, addresses, ports, ack, window and options
+    bool same = (data[0] >> 4) == 4
+                    ? data[1] == first[1] &&
+                          memcmp(data + 6, first + 6, 3) == 0 &&
+                          memcmp(data + 12, first + 12, 8) == 0
+                    : memcmp(data, first, 4) == 0 && data[7] == first[7] &&
+                          memcmp(data + 8, first + 8, 32) == 0;
+    same = same && memcmp(data + iphl, first + iphl, 4) == 0 &&
+           memcmp(data + iphl + 8, first + iphl + 8, 4) == 0 &&
+           memcmp(data + iphl + 14, first + iphl + 14, 2) == 0 &&
+           memcmp(data + iphl + 20, first + iphl + 20, hlen - iphl - 20) == 0;
+    if (!same) {
+      break;
+    }
+    bytes += payload;
+    next_seq += payload;
+    if (payload < mss || seg_th->psh) {
+      // a short or a pushed segment ends the run
+      run++;
+      break;
+    }
+  }
+  return run;
+}
+
+int GroBuildHeader(const TunFrame* frames, int num, VnetHdr* vnet,
+                   char* head) {
+  const char* first = frames[0].data;
+  int iphl = TcpOffset(first, frames[0].len);
+  auto th = reinterpret_cast<const struct tcphdr*>(first + iphl);
+  int hlen = iphl + th->doff * 4;
+  int len = hlen;
+  for (int i = 0; i < num; i++) {
+    len += frames[i].len - hlen;
+  }
+  memcpy(head, first, hlen);
+  bool v4 = (first[0] >> 4) == 4;
+  FixIpHeader(head, iphl, len, 0);
+  auto head_th = reinterpret_cast<struct tcphdr*>(head + iphl);
+  auto last_th =
+      reinterpret_cast<const struct tcphdr*>(frames[num - 1].data + iphl);
+  head_th->psh = last_th->psh;
+  // the kernel completes the checksum of every segment from the pseudo one
+  head_th->check = 0;
+  head_th->check = htons(CsumFold(PseudoSum(head, IPPROTO_TCP, len - iphl)));
+
+  *vnet = VnetHdr();
+  vnet->flags = VnetHdr::kNeedsCsum;
+  vnet->gso_type = v4 ? VnetHdr::kGsoTcpv4 : VnetHdr::kGsoTcpv6;
+  vnet->gso_size = frames[0].len - hlen;
+  vnet->hdr_len = hlen;
+  vnet->csum_start = iphl;
+  vnet->csum_offset = offsetof(struct tcphdr, check);
+  return hlen;
+}
+
+}  // namespace util
+}  // namespace base
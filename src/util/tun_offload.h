@@ -0,0 +1,103 @@
+/**
+ * @file tun_offload.h
+ * @author peng lei (plhitsz@outlook.com)
+ * @brief The virtio-net header offloads of a tun device: segmenting the GSO
+ * packets read from it and coalescing TCP segments into ones to write.
+ * @version 0.1
+ * @date 2022-11-28
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef SRC_UTIL_TUN_OFFLOAD_H_
+#define SRC_UTIL_TUN_OFFLOAD_H_
+
+#include <stdint.h>
+
+#include <functional>
+
+namespace base {
+namespace util {
+
+/**
+ * @brief The `virtio_net_hdr` before every packet of a tun device with
+ * `IFF_VNET_HDR`, `linux/virtio_net.h` isn't usable from c++.
+ *
+ */
+struct VnetHdr {
+  static constexpr uint8_t kNeedsCsum = 1;
+  static constexpr uint8_t kGsoNone = 0;
+  static constexpr uint8_t kGsoTcpv4 = 1;
+  static constexpr uint8_t kGsoTcpv6 = 4;
+  static constexpr uint8_t kGsoEcn = 0x80;
+
+  uint8_t flags = 0;
+  uint8_t gso_type = kGsoNone;
+  uint16_t hdr_len = 0;
+  uint16_t gso_size = 0;
+  uint16_t csum_start = 0;
+  uint16_t csum_offset = 0;
+};
+static_assert(sizeof(VnetHdr) == 10, "virtio_net_hdr is 10 bytes");
+
+constexpr int kVnetHdrLen = sizeof(VnetHdr);
+// the largest GSO packet a tun device reads or writes, without the vnet header
+constexpr int kMaxGsoPacket = 65535;
+// the longest ip and tcp header of a coalesced packet
+constexpr int kMaxGroHeader = 120;
+// the most segments coalesced into one packet
+constexpr int kMaxGroSegments = 64;
+
+/**
+ * @brief An ip packet to be written.
+ *
+ */
+struct TunFrame {
+  const char* data = nullptr;
+  int len = 0;
+};
+
+/**
+ * @brief Split a packet read from a tun device into packets of at most
+ * `hdr.gso_size` payload and complete their checksums. A packet without GSO
+ * comes out as it is, with its checksum completed if it's partial.
+ *
+ * @param hdr The vnet header of the packet.
+ * @param packet The ip packet following the header.
+ * @param len The length of `packet`.
+ * @param alloc Return a buffer of the given length for the next segment.
+ * @return int The number of segments, -1 if the GSO type isn't supported or
+ * the packet is malformed.
+ */
+int GsoSegment(const VnetHdr& hdr, const char* packet, int len,
+               const std::function<char*(int len)>& alloc);
+
+/**
+ * @brief The number of frames from `frames[0]` which make one TCP packet for
+ * TSO: the contiguous segments of a flow with equal payloads, the last one may
+ * be shorter.
+ *
+ * @param frames
+ * @param num
+ * @return int 1 if the first frame can't be coalesced with the next ones.
+ */
+int GroRunLength(const TunFrame* frames, int num);
+
+/**
+ * @brief Build the headers of the packet coalesced from `num` frames given by
+ * `GroRunLength`. The packet is `head` followed by the payloads of the
+ * frames.
+ *
+ * @param frames
+ * @param num More than 1.
+ * @param vnet The vnet header to write before the packet.
+ * @param head At least `kMaxGroHeader` bytes.
+ * @return int The length of the ip and tcp header in `head`.
+ */
+int GroBuildHeader(const TunFrame* frames, int num, VnetHdr* vnet,
+                   char* head);
+
+}  // namespace util
+}  // namespace base
+
+#endif  // SRC_UTIL_TUN_OFFLOAD_H_
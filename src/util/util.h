@@ -17,6 +17,7 @@
 #include <sys/socket.h>
 
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -94,6 +95,23 @@ inline int Stoi(const std::string& value) {
   return std::stoi(value, &sz);
 }
 
+// A hash of the addresses of the ip packet of `len` bytes, equal for all the
+// packets of a flow. 0 if it isn't a whole ipv4 or ipv6 header.
+inline uint32_t IpFlowHash(const char* packet, int len) {
+  uint32_t src = 0;
+  uint32_t dst = 0;
+  if (len >= 20 && (packet[0] >> 4) == 4) {
+    memcpy(&src, packet + 12, sizeof(src));
+    memcpy(&dst, packet + 16, sizeof(dst));
+  } else if (len >= 40 && (packet[0] >> 4) == 6) {
+    // the low words of the ipv6 source and destination
+    memcpy(&src, packet + 20, sizeof(src));
+    memcpy(&dst, packet + 36, sizeof(dst));
+  }
+  uint32_t hash = src ^ dst;
+  return hash ^ (hash >> 16);
+}
+
 inline std::string Hexdump(const char* data, int len) {
   std::string res = "\n";
   std::string enter = "\n";
@@ -0,0 +1,306 @@
+/**
+ * @file warm_restart.cc
+ * @author peng lei (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-11-26
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#include "warm_restart.h"
+
+#include <glog/logging.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace {
+const char kMagic[8] = {'B', 'A', 'T', 'S', 'W', 'R', 'M', '1'};
+// the fds of one handoff are sent in a single control msg.
+const int kMaxFds = 64;
+
+struct Preamble {
+  char magic[8];
+  uint32_t fds;
+  uint32_t msgs;
+  uint64_t body_len;
+};
+
+void PutU32(std::vector<uint8_t>& buf, uint32_t v) {
+  auto p = reinterpret_cast<const uint8_t*>(&v);
+  buf.insert(buf.end(), p, p + sizeof(v));
+}
+
+void PutString(std::vector<uint8_t>& buf, const std::string& s) {
+  PutU32(buf, s.size());
+  buf.insert(buf.end(), s.begin(), s.end());
+}
+
+bool GetU32(const std::vector<uint8_t>& buf, size_t& pos, uint32_t& v) {
+  if (pos + sizeof(v) > buf.size()) {
+    return false;
+  }
+  memcpy(&v, buf.data() + pos, sizeof(v));
+  pos += sizeof(v);
+  return true;
+}
+
+bool GetBytes(const std::vector<uint8_t>& buf, size_t& pos, uint32_t len,
+              const uint8_t** out) {
+  if (pos + len > buf.size()) {
+    return false;
+  }
+  *out = buf.data() + pos;
+  pos += len;
+  return true;
+}
+
+bool SendAll(int sock, const uint8_t* data, size_t len) {
+  while (len > 0) {
+    auto n = send(sock, data, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool RecvAll(int sock, uint8_t* data, size_t len) {
+  while (len > 0) {
+    auto n = recv(sock, data, len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool MakeAddress(const std::string& path, struct sockaddr_un& addr) {
+  if (path.size() >= sizeof(addr.sun_path)) {
+    LOG(ERROR) << "socket path is too long " << path;
+    return false;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  return true;
+}
+}  // namespace
+
+int WarmRestart::Listen(const std::string& path) {
+  struct sockaddr_un addr;
+  if (!MakeAddress(path, addr)) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    LOG(ERROR) << "socket error " << strerror(errno);
+    return -1;
+  }
+  unlink(path.c_str());
+  if (bind(fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(fd, 1) < 0) {
+    LOG(ERROR) << "listen on " << path << " error " << strerror(errno);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool WarmRestart::Send(int sock, const FdList& fds, const MsgList& msgs) {
+  if (fds.size() > kMaxFds) {
+    LOG(ERROR) << "too many fds to hand off " << fds.size();
+    return false;
+  }
+  std::vector<uint8_t> body;
+  for (auto& item : fds) {
+    PutString(body, item.first);
+  }
+  for (auto& item : msgs) {
+    auto& msg = item.second;
+    PutString(body, item.first);
+    PutU32(body, msg->type());
+    PutU32(body, msg->signal());
+    PutU32(body, msg->id());
+    PutU32(body, msg->seq());
+    PutU32(body, msg->size());
+    body.insert(body.end(), msg->Data().begin(), msg->Data().end());
+  }
+
+  Preamble pre;
+  memcpy(pre.magic, kMagic, sizeof(kMagic));
+  pre.fds = fds.size();
+  pre.msgs = msgs.size();
+  pre.body_len = body.size();
+
+  struct iovec iov;
+  iov.iov_base = &pre;
+  iov.iov_len = sizeof(pre);
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  char control[CMSG_SPACE(sizeof(int) * kMaxFds)];
+  if (!fds.empty()) {
+    memset(control, 0, sizeof(control));
+    mh.msg_control = control;
+    mh.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+    auto cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    auto data = reinterpret_cast<int*>(CMSG_DATA(cmsg));
+    for (size_t i = 0; i < fds.size(); i++) {
+      data[i] = fds[i].second;
+    }
+  }
+  if (sendmsg(sock, &mh, MSG_NOSIGNAL) != sizeof(pre)) {
+    LOG(ERROR) << "send fds error " << strerror(errno);
+    return false;
+  }
+  if (!SendAll(sock, body.data(), body.size())) {
+    LOG(ERROR) << "send queued msgs error " << strerror(errno);
+    return false;
+  }
+  LOG(INFO) << "handed off " << fds.size() << " fds and " << msgs.size()
+            << " msgs";
+  return true;
+}
+
+bool WarmRestart::Receive(const std::string& path) {
+  struct sockaddr_un addr;
+  if (!MakeAddress(path, addr)) {
+    return false;
+  }
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    return false;
+  }
+  if (connect(sock, (const struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    LOG(INFO) << "no predecessor on " << path << ", cold start";
+    close(sock);
+    return false;
+  }
+  // the predecessor drains its pipeline before it answers.
+  struct timeval tv = {kReceiveTimeoutSec, 0};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  Preamble pre;
+  struct iovec iov;
+  iov.iov_base = &pre;
+  iov.iov_len = sizeof(pre);
+  char control[CMSG_SPACE(sizeof(int) * kMaxFds)];
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = control;
+  mh.msg_controllen = sizeof(control);
+  auto n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+  std::vector<int> fds;
+  for (auto cmsg = CMSG_FIRSTHDR(&mh); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      auto num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      auto data = reinterpret_cast<int*>(CMSG_DATA(cmsg));
+      fds.insert(fds.end(), data, data + num);
+    }
+  }
+  std::vector<uint8_t> body;
+  bool ok = n == sizeof(pre) &&
+            memcmp(pre.magic, kMagic, sizeof(kMagic)) == 0 &&
+            pre.fds == fds.size();
+  if (ok) {
+    body.resize(pre.body_len);
+    ok = RecvAll(sock, body.data(), body.size());
+  }
+  close(sock);
+
+  std::lock_guard<std::mutex> lg(mutex_);
+  size_t pos = 0;
+  for (size_t i = 0; ok && i < fds.size(); i++) {
+    uint32_t len = 0;
+    const uint8_t* key = nullptr;
+    ok = GetU32(body, pos, len) && GetBytes(body, pos, len, &key);
+    if (ok) {
+      fds_[std::string((const char*)key, len)] = fds[i];
+    }
+  }
+  for (uint32_t i = 0; ok && i < pre.msgs; i++) {
+    uint32_t len = 0;
+    const uint8_t* name = nullptr;
+    const uint8_t* data = nullptr;
+    Record record;
+    ok = GetU32(body, pos, len) && GetBytes(body, pos, len, &name) &&
+         GetU32(body, pos, record.type) && GetU32(body, pos, record.signal) &&
+         GetU32(body, pos, record.id) && GetU32(body, pos, record.seq);
+    uint32_t size = 0;
+    ok = ok && GetU32(body, pos, size) && GetBytes(body, pos, size, &data);
+    if (ok) {
+      record.data.assign(data, data + size);
+      msgs_[std::string((const char*)name, len)].push_back(std::move(record));
+    }
+  }
+  if (!ok) {
+    LOG(ERROR) << "broken handoff from " << path;
+    for (auto fd : fds) {
+      close(fd);
+    }
+    fds_.clear();
+    msgs_.clear();
+    return false;
+  }
+  LOG(INFO) << "took over " << fds_.size() << " fds and " << pre.msgs
+            << " msgs from " << path;
+  return true;
+}
+
+int WarmRestart::TakeFd(const std::string& key) {
+  std::lock_guard<std::mutex> lg(mutex_);
+  auto itr = fds_.find(key);
+  if (itr == fds_.end()) {
+    return -1;
+  }
+  auto fd = itr->second;
+  fds_.erase(itr);
+  return fd;
+}
+
+std::vector<BaseMsg_ptr> WarmRestart::TakeMsgs(const std::string& channel,
+                                               const MsgMaker& maker) {
+  std::vector<BaseMsg_ptr> out;
+  std::lock_guard<std::mutex> lg(mutex_);
+  auto itr = msgs_.find(channel);
+  if (itr == msgs_.end()) {
+    return out;
+  }
+  for (auto& record : itr->second) {
+    auto msg = maker ? maker(channel, record.data.size())
+                     : std::make_shared<BaseMsg>(record.data.size());
+    msg->resize(record.data.size());
+    std::copy(record.data.begin(), record.data.end(), msg->Data().begin());
+    msg->type() = static_cast<MSG_TYPE>(record.type);
+    msg->signal() = static_cast<MSG_SIGNAL>(record.signal);
+    msg->id() = record.id;
+    msg->seq() = record.seq;
+    // let a derived msg parse its headers again.
+    msg->decode();
+    out.push_back(msg);
+  }
+  msgs_.erase(itr);
+  return out;
+}
@@ -0,0 +1,111 @@
+/**
+ * @file warm_restart.h
+ * @author peng lei (plhitsz@outlook.com)
+ * @brief
+ * @version 0.1
+ * @date 2022-11-26
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+#ifndef SRC_UTIL_WARM_RESTART_H_
+#define SRC_UTIL_WARM_RESTART_H_
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "macros.h"
+#include "msg.h"
+
+/**
+ * @brief The state passed from a running process to its successor on a warm
+ * restart: the fds of the I/O nodes, sent as SCM_RIGHTS over a unix socket,
+ * and the msgs still queued in the channels.
+ *
+ * The successor calls `Receive` before it creates its nodes. An I/O node
+ * takes its fd by `TakeFd` instead of opening a new one, and the queued msgs
+ * are put back to the channels of the same name by `TakeMsgs`.
+ */
+class WarmRestart {
+ public:
+  /**
+   * @brief Make a msg object for a msg of `len` bytes queued in `channel`.
+   */
+  using MsgMaker =
+      std::function<BaseMsg_ptr(const std::string& channel, int len)>;
+  using FdList = std::vector<std::pair<std::string, int>>;
+  using MsgList = std::vector<std::pair<std::string, BaseMsg_ptr>>;
+
+  static WarmRestart* Instance() {
+    static WarmRestart* ins = nullptr;
+    if (!ins) {
+      static std::once_flag flag;
+      std::call_once(flag, [&]() { ins = new (std::nothrow) WarmRestart(); });
+    }
+    return ins;
+  }
+  /**
+   * @brief Listen for the successor on a unix socket.
+   *
+   * @param path
+   * @return int The listening fd, or -1 on failure.
+   */
+  static int Listen(const std::string& path);
+  /**
+   * @brief Send the fds, keyed by their owners, and the queued msgs.
+   *
+   * @param sock A connected unix socket.
+   * @param fds
+   * @param msgs
+   * @return true
+   * @return false
+   */
+  static bool Send(int sock, const FdList& fds, const MsgList& msgs);
+  /**
+   * @brief Connect to the predecessor and receive its state.
+   *
+   * @param path
+   * @return false Return false if no process hands off on `path`, then it's a
+   * cold start.
+   */
+  bool Receive(const std::string& path);
+  /**
+   * @brief Take over the fd of `key`, e.g. `tun:tun0` or `udp:8888`.
+   *
+   * @param key
+   * @return int -1 if there is no such fd.
+   */
+  int TakeFd(const std::string& key);
+  /**
+   * @brief Take the msgs which were queued in `channel`, in their order.
+   *
+   * @param channel
+   * @param maker
+   * @return std::vector<BaseMsg_ptr>
+   */
+  std::vector<BaseMsg_ptr> TakeMsgs(const std::string& channel,
+                                    const MsgMaker& maker);
+
+ private:
+  WarmRestart() = default;
+  struct Record {
+    uint32_t type = 0;
+    uint32_t signal = 0;
+    uint32_t id = 0;
+    uint32_t seq = 0;
+    std::vector<uint8_t> data;
+  };
+  std::mutex mutex_;
+  std::unordered_map<std::string, int> fds_;
+  std::unordered_map<std::string, std::vector<Record>> msgs_;
+  // The time to wait for the predecessor to finish the handoff.
+  static const int kReceiveTimeoutSec = 10;
+  DISALLOW_COPY_AND_ASSIGN(WarmRestart)
+};
+
+#endif  // SRC_UTIL_WARM_RESTART_H_